@@ -0,0 +1,161 @@
+#include "client.h"
+
+/* returns the next whitespace separated field of line at *pos, or NULL if
+   there is none. if rest is set, the field is the rest of the line */
+static char* next_field(char* line, size_t* pos, bool rest){
+    while(isspace((unsigned char)line[*pos])){
+        (*pos)++;
+    }
+    if(line[*pos] == '\0'){
+        return NULL;
+    }
+
+    size_t start = *pos;
+    while(line[*pos] != '\0' && (rest || !isspace((unsigned char)line[*pos]))){
+        (*pos)++;
+    }
+
+    //the rest of the line loses only its trailing whitespace
+    size_t end = *pos;
+    while(rest && end > start && isspace((unsigned char)line[end-1])){
+        end--;
+    }
+    return strndup(line + start, end - start);
+}
+
+/* reads the users of the manifest at path into b. returns false if it
+   could not be read */
+static bool load_manifest(batch* b, char* path){
+    FILE* f = fopen(path, "r");
+    if(f == NULL){
+        syslog(LOG_ERR, "Could not open manifest %s", path);
+        return false;
+    }
+
+    int capacity = 0;
+    char* line = NULL;
+    size_t size = 0;
+    int line_no = 0;
+    while(getline(&line, &size, f) != -1){
+        line_no++;
+        size_t pos = 0;
+        char* username = next_field(line, &pos, false);
+        if(username == NULL || username[0] == '#'){
+            free(username);
+            continue;
+        }
+        char* password = next_field(line, &pos, false);
+        char* root_dir = password != NULL ? next_field(line, &pos, true) : NULL;
+        if(root_dir == NULL){
+            syslog(LOG_WARNING, "%s:%d: username, password and directory required, skipping", path, line_no);
+            free(username);
+            free(password);
+            continue;
+        }
+
+        if(b->num_users == capacity){
+            capacity = capacity > 0 ? 2*capacity : 16;
+            b->users = (batch_user*)realloc(b->users, capacity*sizeof(batch_user));
+        }
+        batch_user* u = &b->users[b->num_users++];
+        u->username = username;
+        u->password = password;
+        u->root_dir = expand_home_dir(root_dir);
+        if(u->root_dir != root_dir){
+            free(root_dir);
+        }
+        u->batch = b;
+    }
+    free(line);
+    fclose(f);
+    return true;
+}
+
+/* the task of syncing one user, on a worker of the batch's pool. the
+   worker's connections are made the first time it syncs someone, and
+   kept for the next */
+static void sync_user(void* arg){
+    batch_user* u = (batch_user*)arg;
+    batch* b = u->batch;
+    batch_worker* worker = &b->workers[pool_worker_index(b->pool)];
+    if(worker->hmds_fd == -1){
+        worker->hmds_fd = open_connection(get_sockaddr(b->base.hostname, b->base.port));
+    }
+    if(worker->session == NULL){
+        worker->session = hftp_open(b->base.fserver, b->base.fport, b->base.flows);
+    }
+
+    sync_config config = b->base;
+    config.username = u->username;
+    config.password = u->password;
+    config.root_dir = u->root_dir;
+    config.history_file = order_history_path(u->username, u->root_dir);
+    config.cache_file = b->cache ? cache_path(u->username, u->root_dir) : NULL;
+    config.token_file = b->cache ? token_path(u->username, b->base.hostname, b->base.port) : NULL;
+    config.hmds_fd = worker->hmds_fd;
+    config.session = worker->session;
+
+    file_index* files = index_create(0);
+    if(!sync_dir(&config, files, b->threads, false)){
+        //the connection may have been left mid request, so the next user
+        //starts on a new one
+        syslog(LOG_WARNING, "Could not sync %s", u->username);
+        atomic_fetch_add(&b->failed, 1);
+        close(worker->hmds_fd);
+        worker->hmds_fd = -1;
+    }
+    index_free(files);
+    free(config.history_file);
+    free(config.cache_file);
+    free(config.token_file);
+}
+
+/* syncs each user of the manifest at path with the servers and options of
+   base, jobs at once, each one's directory scanned with threads threads.
+   cache sets whether their scans are cached. the manifest has a user per
+   line: their username, password and directory, separated by whitespace,
+   the directory being the rest of the line. blank lines and lines starting
+   with '#' are skipped. returns the number of users who could not be
+   synced, or -1 if the manifest could not be read */
+int batch_sync(char* path, sync_config* base, int jobs, int threads, bool cache){
+    batch b = {
+        .base = *base,
+        .cache = cache,
+        .threads = threads
+    };
+    if(!load_manifest(&b, path)){
+        return -1;
+    }
+    atomic_init(&b.failed, 0);
+    syslog(LOG_INFO, "Syncing %d users, %d at a time", b.num_users, jobs);
+
+    //each user is a task of the pool, synced by whichever worker is free
+    b.pool = pool_create(jobs);
+    b.workers = (batch_worker*)malloc(jobs*sizeof(batch_worker));
+    for(int i=0; i<jobs; i++){
+        b.workers[i].hmds_fd = -1;
+        b.workers[i].session = NULL;
+    }
+    for(int i=0; i<b.num_users; i++){
+        pool_submit(b.pool, sync_user, &b.users[i]);
+    }
+    pool_wait(b.pool);
+    pool_destroy(b.pool);
+
+    for(int i=0; i<jobs; i++){
+        if(b.workers[i].hmds_fd != -1){
+            close(b.workers[i].hmds_fd);
+        }
+        if(b.workers[i].session != NULL){
+            hftp_close(b.workers[i].session);
+        }
+    }
+    for(int i=0; i<b.num_users; i++){
+        free(b.users[i].username);
+        free(b.users[i].password);
+        free(b.users[i].root_dir);
+    }
+    free(b.users);
+    free(b.workers);
+    return atomic_load(&b.failed);
+}
@@ -0,0 +1,65 @@
+/* DESCRIPTION: Syncs the directories of many users from one process, as
+        a backup host would, rather than starting a client for each.
+        The users are read from a manifest and synced by a pool of
+        workers, a few at a time. Each worker keeps one connection to
+        the hmds and one hftp session with the hftpd, and syncs every
+        user it takes over them: an AUTH makes the connection the next
+        user's, and each CONTROL_INIT carries its owner's token, so
+        the servers are looked up and connected to once per worker
+        instead of once per user.                                    */
+
+#ifndef BATCH_H
+#define BATCH_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <stdatomic.h>
+
+#include "thread_pool.h"
+#include "watch.h"
+#include "uploader.h"
+
+//a user of the manifest, and the directory they are synced from
+typedef struct
+{
+    char* username;
+    char* password;
+    char* root_dir;
+    struct batch* batch;        //the batch the user is part of
+} batch_user;
+
+//what a worker keeps between the users it syncs
+typedef struct
+{
+    int hmds_fd;                //its connection to the hmds, -1 until it has one
+    hftp_session* session;      //its hftp session, NULL until it has one
+} batch_worker;
+
+//the users of a manifest, being synced
+typedef struct batch
+{
+    sync_config base;           //the servers and options every user is synced with
+    bool cache;                 //each user's scan is cached
+    int threads;                //scan threads for each user
+    batch_user* users;
+    int num_users;
+    thread_pool* pool;
+    batch_worker* workers;      //one per worker of pool
+    atomic_int failed;          //users who could not be synced
+} batch;
+
+/* syncs each user of the manifest at path with the servers and options of
+   base, jobs at once, each one's directory scanned with threads threads.
+   cache sets whether their scans are cached. the manifest has a user per
+   line: their username, password and directory, separated by whitespace,
+   the directory being the rest of the line. blank lines and lines starting
+   with '#' are skipped. returns the number of users who could not be
+   synced, or -1 if the manifest could not be read */
+int batch_sync(char* path, sync_config* base, int jobs, int threads, bool cache);
+
+#endif /* BATCH_H */
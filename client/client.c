@@ -13,138 +13,57 @@
 #include "client.h"
 
 
-/* This function recursively iterates through directories starting at "dir".
-   For each file, this algorithm prints it's relative path from "dir", along
-   with its CRC-32 checksum, into the file "file"*/
-void iterate_dirs(char* dir, char* relative_path, hdb_record* head, char* username){
+/* computes the crc32 value of the given file, reading it once through a
+   fixed-size buffer. if size is not NULL, it is set to the bytes read */
+unsigned long crc(char* filepath, uint64_t* size){
 
-    DIR* d; //the directory in which we are iterating
-
-    d = opendir(dir);
-    //check to see if the directory was succesfully opened
-    if (!d) {
-	syslog(LOG_ERR, "Cannot open directory '%s'\n", dir);
-	exit(EXIT_FAILURE);
-    }
-
-    struct dirent* entry; //a file/directory in the directory "dir"
-    //begin iterating through directories. Break when no more entries remain in dir
-    while( (entry = readdir(d)) ) {
-        //get the name and path of the entry
-        char* entry_name;       //the name of "entry"
-        char path[PATH_MAX];    //the path of "entry"
-        entry_name = entry->d_name;
-        sprintf(path, "%s/%s", dir, entry_name);
-
-
-        //if the entry is a file...
-        DIR* is_dir = opendir(path);
-        if (! is_dir) {
-            if(fopen(path,"r")){
-
-                //add the file's path and crc-32 to "file" to a linked list
-                char* path_of_file;
-                asprintf(&path_of_file, "%s%s", relative_path, entry_name);
-                syslog(LOG_DEBUG, " * found file: %s (%s)\n", path_of_file, ulong_to_hexstr(crc(path)));
-                add_to_list(head, path, path_of_file, ulong_to_hexstr(crc(path)), username);
-            }else{
-                syslog(LOG_WARNING, "Could not open %s", path);
-            }
-
-        }
-
-
-        //if the entry is a directory (which is not the parent dir or the dir itslef)
-        else if(strcmp (entry_name, "..") != 0 && strcmp(entry_name, ".") != 0) {
-
-            //save parent path
-	        char* parent; //parent of "entry"
-            asprintf(&parent, "%s", relative_path);
-
-	        //update the relative path
-            strcat(relative_path, entry_name);
-            strcat(relative_path, "/");
-
-            //recursively iterate through this directory
-            iterate_dirs(path,relative_path, head, username);
-
-	        //return the relative_dir back to parent
-	        relative_path = strcpy(relative_path, parent);
-	        free(parent);
-
-        }
-    }
-
-    //close the directory
-    if (closedir(d)) {
-	    syslog(LOG_ERR, "Could not close '%s'\n", dir);
-	    exit(EXIT_FAILURE);
-    }
-
-}
-
-/* computes the crc32 value of the given file */
-unsigned long crc(char filepath[PATH_MAX]){
-
-    Bytef* buf; //a buffer to hold the contents of the file
-    long len;  //the length of the file
-    FILE* fp = fopen(filepath,"rb"); //a pointer to the file
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC); //the file
 
     //open file and check for a successful open
-    if(fp==NULL){
+    if(fd==-1){
 	   syslog(LOG_WARNING, "Could not open file '%s' to calculate checksum\n", filepath);
 	   exit(EXIT_FAILURE);
     }
 
-    //get the length of the file
-    fseek(fp, 0, SEEK_END);
-    len = ftell(fp);
-    rewind(fp);
-
-    //get a binary buffer of the contents of the file
-    buf = (Bytef*)malloc((len+1)*sizeof(Bytef));
-    fread(buf, len, 1, fp);
-    fclose(fp); //close the file
-
-    //compute the crc32 value
-    uLong crc_value = crc32(0L, Z_NULL, 0);
-    crc_value = crc32(crc_value, buf, len);
-
+    unsigned long crc_value = crc_range(fd, filepath, 0, CRC_TO_END, size);
+    close(fd); //close the file
     return crc_value;
 }
 
+/* computes the crc32 value of len bytes of the file open at fd, which is
+   at filepath, starting at offset. len may be CRC_TO_END. if size is not
+   NULL, it is set to the bytes read */
+unsigned long crc_range(int fd, char* filepath, uint64_t offset, uint64_t len, uint64_t* size){
 
-/* adds data to linked list. returns a pointer to the last node */
-void add_to_list(hdb_record* head, char* abs_path, char* filepath, char* crc32, char* uname){
-    hdb_record* current = head;
-    //find the first empty node
-    while(current->next != NULL){
-        current = current->next;
-    }
+    Bytef* buf; //a buffer to hold part of the file
+    ssize_t bytes; //the length of the part read
+    uint64_t total = 0; //the length of the range so far
 
-    //inject data
-    current->filename = filepath;
-    current->checksum = crc32;
-    current->username = uname;
-    current->abs_path = abs_path;
+    posix_fadvise(fd, offset, len == CRC_TO_END ? 0 : len, POSIX_FADV_SEQUENTIAL);
 
-    //open up next node
-    current->next = malloc(sizeof(hdb_record));
-    current->next->next = NULL;
-}
-
-/* returns the hdb_recrod in a linked list with a mathcing filename to parameter filename */
-hdb_record* get_hdb_record(hdb_record* head, char* filename){
-    hdb_record* current = head;
-    //find the node containing the same filename as filename
-    while(current != NULL){
-        if(strcmp(current->filename, filename) == 0){
-            return current;
-        }
-        current = current->next;
+    //compute the crc32 value a buffer at a time
+    buf = (Bytef*)malloc(CRC_BUFFER_SIZE*sizeof(Bytef));
+    uLong crc_value = crc32(0L, Z_NULL, 0);
+    while(total < len){
+	size_t want = len - total < CRC_BUFFER_SIZE ? len - total : CRC_BUFFER_SIZE;
+	bytes = pread(fd, buf, want, offset + total);
+	profile_io_counts.calls++;
+	if(bytes == 0) break;
+	if(bytes == -1){
+	    if(errno == EINTR) continue;
+	    syslog(LOG_WARNING, "Could not read file '%s' to calculate checksum", filepath);
+	    exit(EXIT_FAILURE);
+	}
+	crc_value = crc32(crc_value, buf, bytes);
+	total += bytes;
+	profile_io_counts.bytes += bytes;
     }
+    free(buf);
 
-    return NULL;
+    if(size != NULL){
+	*size = total;
+    }
+    return crc_value;
 }
 
 
@@ -163,26 +82,6 @@ char* ulong_to_hexstr(uLong num){
 }
 
 
-/* frees values associated with linked list of crc values */
-void hdb_free_result(hdb_record* record) {
-   hdb_record *next = record; //start from the head of the list
-
-    while(next->next!=NULL){
-        //get the next item in the list
-        next = record->next;
-        //free all of the values in the struct, and the struct itself
-        //free(record->username);
-        free(record->filename);
-        free(record->checksum);
-        free(record);
-        //continue to the next item
-        record = next;
-    }
-
-    free(record->next);
-    free(record);
-}
-
 /* expands a '~' in a directory path name to the home directory */
 char* expand_home_dir(char* dir){
     if(*dir == '~'){
@@ -226,65 +125,21 @@ int open_connection(struct addrinfo* addr_list){
 
 }
 
-/*  creates, sends, receives, and handles the response of the auth request
-    returns the token generated for the current connection to the hmds*/
-char* auth_request(int sockfd, char* username, char* password){
-
-    char* auth_req;
-    char* auth_rsp;
-    char* status;
-    int i = 0;
-
-    //create and send the request
-    asprintf(&auth_req, "AUTH\nUsername:%s\nPassword:%s\n\n", username, password);
-    syslog(LOG_DEBUG, "Sending credentials");
-    if(send(sockfd, auth_req, strlen(auth_req), 0) == -1){
+/* sends the request req over sockfd, exiting if it cannot be sent */
+static void send_request(int sockfd, char* req){
+    size_t len = strlen(req);
+    tcp_counts.calls++;
+    tcp_counts.bytes += len;
+    if(send(sockfd, req, len, 0) == -1){
         syslog(LOG_ERR, "%s", "Unable to send");
         exit(EXIT_FAILURE);
     }
-
-    //get the response
-    auth_rsp = recv_message(sockfd);
-
-    //get the response status
-    status = readuntil(auth_rsp, ' ', &i);
-    readuntil(auth_rsp, '\n', &i);
-
-
-    //auth successful
-    if(strcmp(status, "200")==0){
-
-        syslog(LOG_INFO, "Authentication successful");
-
-        char* key;
-        char* value;
-        //get token from headers
-        while(auth_rsp[i] != '\n'){
-            key = readuntil(auth_rsp, ':', &i);
-            value = readuntil(auth_rsp, '\n', &i);
-
-            if(strcmp(key, "Token")==0){
-                free(key);
-                return value; //return token
-            }else{
-                free(key);
-                free(value);
-            }
-        }
-
-
-    //unauthorized
-    }else{
-        syslog(LOG_INFO, "Authentication unsuccessful");
-    }
-
-    return NULL;
-
 }
 
 /*  handles the LIST request. creates the request, gets the response,
-    and handles the response accordingly */
-char* list_request(int sockfd, hdb_record* head, char* token){
+    and handles the response accordingly. sorted says the files are in
+    order of path, so the hmds may join them against its own in order */
+char* list_request(int sockfd, file_index* files, char* token, bool sorted){
 
     char* list;
     int list_length;
@@ -293,30 +148,31 @@ char* list_request(int sockfd, hdb_record* head, char* token){
     char* status;
     int i;
 
-    list_length = create_list_body(head, &list);
+    profile_span span;
+    profile_begin(&span);
+    list_length = create_list_body(files, &list);
 
     //create the LIST request
-    asprintf(&list_req, "LIST\nToken:%s\nLength:%d\n\n%s", token, list_length, list);
+    asprintf(&list_req, "LIST\nToken:%s\n%sLength:%d\n\n%s", token, sorted ? "Sorted:1\n" : "", list_length, list);
+    free(list);
 
     //send the request
     syslog(LOG_INFO, "Uploading file list");
-    if(send(sockfd, list_req, strlen(list_req), 0) == -1){
-        syslog(LOG_ERR, "%s", "Unable to send");
-        exit(EXIT_FAILURE);
-    }
+    send_request(sockfd, list_req);
+    free(list_req);
 
     //get the response
-    list_rsp = recv_message(sockfd);
+    list_rsp = recv_reply(sockfd);
 
     i=0;
     //get the response status
     status = readuntil(list_rsp, ' ', &i);
-    readuntil(list_rsp, '\n', &i);
+    free(readuntil(list_rsp, '\n', &i));
 
+    char* req_files = NULL;
     if(strcmp(status, "204")==0){
         //no files requested
         syslog(LOG_INFO, "No files requested");
-        return NULL;
     }else if(strcmp(status, "302")==0){
         //files requested, get and print list
 
@@ -329,92 +185,457 @@ char* list_request(int sockfd, hdb_record* head, char* token){
             if(strcmp(key, "Length")==0){
                 list_length = atoi(value);
             }
+            free(key);
+            free(value);
         }
 
-        //get and return the list of requested files
+        //get the list of requested files
         syslog(LOG_INFO, "Server is requesting file(s)");
-        char* req_files = recv_message_len(sockfd, list_length);
+        req_files = recv_message_len(sockfd, list_length);
         syslog(LOG_DEBUG, "Server requested the following file(s):\n%s", req_files);
-        return req_files;
 
-    }else if(strcmp(status, "401")){
+    }else if(strcmp(status, "401")==0){
         //token mismatch
         syslog(LOG_INFO, "Unauthorized: bad token");
-        return NULL;
     }
 
-    return NULL;
+    free(status);
+    free(list_rsp);
+
+    profile_end(&span, PROFILE_LIST);
+    return req_files;
 
 }
 
-/*  creates the body of the LIST request using a linked list of hdb_records
+/*  handles the TREE request. sends the sums of the directories of dirs and
+    returns the list of the ones which differ from the stored ones, or NULL
+    if none do */
+char* tree_request(int sockfd, file_index* dirs, char* token){
+
+    char* body;
+    int body_length;
+    char* tree_req;
+    char* tree_rsp;
+    char* status;
+    int i;
+
+    profile_span span;
+    profile_begin(&span);
+    body_length = create_tree_body(dirs, &body);
+
+    //create the TREE request
+    asprintf(&tree_req, "TREE\nToken:%s\nLength:%d\n\n%s", token, body_length, body);
+    free(body);
+
+    //send the request
+    syslog(LOG_DEBUG, "Comparing %lu director(ies)", (unsigned long)dirs->count);
+    send_request(sockfd, tree_req);
+    free(tree_req);
+
+    //get the response
+    tree_rsp = recv_reply(sockfd);
+
+    i=0;
+    //get the response status
+    status = readuntil(tree_rsp, ' ', &i);
+    readuntil(tree_rsp, '\n', &i);
+
+    char* differing = NULL;
+    if(strcmp(status, "200")==0){
+        //get the list length
+        int list_length = 0;
+        while(tree_rsp[i] != '\n'){
+            char* key = readuntil(tree_rsp, ':', &i);
+            char* value = readuntil(tree_rsp, '\n', &i);
+
+            if(strcmp(key, "Length")==0){
+                list_length = atoi(value);
+            }
+        }
+
+        //get the list of directories which differ
+        differing = recv_message_len(sockfd, list_length);
+        syslog(LOG_DEBUG, "The following directories differ:\n%s", differing);
+
+    }else if(strcmp(status, "401")==0){
+        //token mismatch
+        syslog(LOG_INFO, "Unauthorized: bad token");
+    }
+
+    profile_end(&span, PROFILE_TREE);
+    return differing;
+
+}
+
+/*  creates the body of the LIST request from the files in an index
      and returns the size of the body in bytes */
-int create_list_body(hdb_record* head, char** list){
-    *list = "";
+int create_list_body(file_index* files, char** list){
+    //the checksums are at most 8 hex digits, so the body can be allocated once
+    size_t size = 1;
+    for(size_t i=0; i<files->count; i++){
+        size += strlen(index_path(files, i)) + 1 + 8 + 1;
+    }
+    *list = (char*)malloc(size);
+
+    //add the filename and checksum of every file to list
     int length = 0;
-    //loop through the linked list of hdb_record's
-    for(hdb_record* current = head; current->next!=NULL; current = current->next){
-        //add the filename to list
-        length += strlen(current->filename) + 1;
-        asprintf(list, "%s%s\n", *list, current->filename);
-        //add the checksum to list
-        length += strlen(current->checksum) + 1;
-        asprintf(list, "%s%s\n", *list, current->checksum);
-    }
-
-    length--; //no '\n' on last line
-    list[length] = '\0';
+    for(size_t i=0; i<files->count; i++){
+        //a file which is not hashed yet can match nothing, so it is requested
+        if(files->flags[i] & INDEX_UNHASHED){
+            length += sprintf(*list + length, "%s\n-\n", index_path(files, i));
+        } else{
+            length += sprintf(*list + length, "%s\n%X\n", index_path(files, i), files->checksums[i]);
+        }
+    }
+    (*list)[length] = '\0';
+
+    //no '\n' on last line
+    if(length > 0){
+        length--;
+        (*list)[length] = '\0';
+    }
     return length;
 
 }
 
+/*  returns the connection to the hmds config's syncs share, or a new one
+    if they do not share one */
+static int hmds_open(sync_config* config){
+    if(config->hmds_fd != -1){
+        return config->hmds_fd;
+    }
+    return open_connection(get_sockaddr(config->hostname, config->port));
+}
 
-void send_files(char* fserver, char* fport, char* requested_files, hdb_record* file_list, char* token, char* root_dir){
+/*  closes sockfd, opened by hmds_open(), unless it is shared */
+static void hmds_close(sync_config* config, int sockfd){
+    if(sockfd != config->hmds_fd){
+        close(sockfd);
+    }
+}
+
+/*  returns the hftp session config's syncs share, or a new one if they do
+    not share one */
+static hftp_session* session_open(sync_config* config){
+    if(config->session != NULL){
+        return config->session;
+    }
+    return hftp_open(config->fserver, config->fport, config->flows);
+}
+
+/*  ends session, opened by session_open(), unless it is shared */
+static void session_close(sync_config* config, hftp_session* session){
+    if(session != config->session){
+        hftp_close(session);
+    }
+}
+
+/*  connects to the hmds, authenticates, sends a LIST of the files
+    and uploads the ones the server requests. returns false if the user
+    could not be authenticated */
+bool sync_files(sync_config* config, file_index* files){
+    //connect to server, and get the list of requested files in the same
+    //flight as the user is authorized
+    int sockfd = hmds_open(config);
+    auth_send(sockfd, config->username, config->password, config->token_file);
+    char* requested_files = list_request(sockfd, files, "", false);
+    char* token = auth_receive(sockfd);
+    hmds_close(config, sockfd);
+    if(token == NULL){
+        free(requested_files);
+        return false;
+    }
+
+    //initiate a connection with hftpd server and send the requested files
+    if(requested_files != NULL){
+        uint64_t bytes = 0;
+        hftp_session* session = session_open(config);
+        send_files(session, requested_files, files, token, config->root_dir, config->order, &bytes, NULL);
+        session_close(config, session);
+        free(requested_files);
+    }
+    free(token);
+    return true;
+}
+
+/*  connects to the hmds, authenticates, and finds the directories which
+    differ from the stored ones. only the files in those are sent in a
+    LIST request, and the ones the server requests are uploaded. returns
+    false if the user could not be authenticated */
+bool sync_tree(sync_config* config, file_index* files){
+    //connect to server, and compare the directories in the same flight as
+    //the user is authorized
+    int sockfd = hmds_open(config);
+    auth_send(sockfd, config->username, config->password, config->token_file);
+    file_index* changed = tree_diff(sockfd, files, "");
+    char* token = auth_receive(sockfd);
+    if(token == NULL){
+        index_free(changed);
+        hmds_close(config, sockfd);
+        return false;
+    }
+
+    //list the files of the directories which differ
+    char* requested_files = NULL;
+    if(changed->count > 0){
+        requested_files = list_request(sockfd, changed, token, false);
+    }else{
+        syslog(LOG_INFO, "No files requested");
+    }
+    hmds_close(config, sockfd);
+
+    //upload the requested files
+    upload_stats stats;
+    cache_writer* learned = config->cache_file != NULL ? cache_reopen(config->cache_file) : NULL;
+    hftp_session* session = session_open(config);
+    uploader* up = uploader_start(session, token, config->root_dir, config->order, learned);
+    if(requested_files != NULL){
+        uploader_push(up, changed, requested_files);
+    }else{
+        index_free(changed);
+    }
+    uploader_finish(up, &stats);
+    session_close(config, session);
+    if(learned != NULL){
+        cache_commit(learned);
+    }
+    if(config->history_file != NULL){
+        order_record(config->history_file, config->order, stats.files, stats.bytes, stats.seconds);
+    }
+    free(token);
+    return true;
+}
+
+/*  syncs the files of a streaming scan as they are found. each batch is
+    sent in a LIST request while the scan goes on, and the files the hmds
+    requests are uploaded on a thread of their own. returns false if the
+    user could not be authenticated */
+bool sync_scan(sync_config* config, scan* sc){
+    //connect to server and authorize user while the scan starts
+    int sockfd = hmds_open(config);
+    auth_send(sockfd, config->username, config->password, config->token_file);
+    char* token = auth_receive(sockfd);
+    if(token == NULL){
+        hmds_close(config, sockfd);
+        return false;
+    }
+
+    //list each batch as it is found, and upload what the hmds requests
+    hftp_session* session = session_open(config);
+    uploader* up = uploader_start(session, token, config->root_dir, config->order, NULL);
+    file_index* batch;
+    while((batch = scan_next_batch(sc)) != NULL){
+        char* requested_files = list_request(sockfd, batch, token, false);
+        if(requested_files != NULL){
+            uploader_push(up, batch, requested_files);
+        }else{
+            index_free(batch);
+        }
+    }
+    hmds_close(config, sockfd);
+
+    upload_stats stats;
+    uploader_finish(up, &stats);
+    session_close(config, session);
+    if(config->history_file != NULL){
+        order_record(config->history_file, config->order, stats.files, stats.bytes, stats.seconds);
+    }
+    free(token);
+    return true;
+}
+
+/*  syncs the files of a scan which were spilled to disk as runs. they are
+    read back in order of path and sent in LIST requests of
+    LIST_CHUNK_FILES at a time, and the files the hmds requests are
+    uploaded on a thread of their own. returns false if the user could
+    not be authenticated */
+bool sync_runs(sync_config* config, file_runs* runs){
+    //connect to server and authorize user
+    int sockfd = hmds_open(config);
+    auth_send(sockfd, config->username, config->password, config->token_file);
+    char* token = auth_receive(sockfd);
+    if(token == NULL){
+        hmds_close(config, sockfd);
+        return false;
+    }
+
+    //list the files a chunk at a time, and upload what the hmds requests
+    cache_writer* learned = config->cache_file != NULL ? cache_reopen(config->cache_file) : NULL;
+    hftp_session* session = session_open(config);
+    uploader* up = uploader_start(session, token, config->root_dir, config->order, learned);
+    runs_reader* reader = runs_open(runs);
+    file_index* chunk = index_create(LIST_CHUNK_FILES);
+    char* path;
+    uint32_t checksum;
+    uint64_t size;
+    uint8_t flags;
+    bool more;
+    do{
+        more = runs_next(reader, &path, &checksum, &size, &flags);
+        if(more){
+            size_t record = index_put(chunk, path, checksum, size);
+            chunk->flags[record] = flags;
+        }
+        if(chunk->count == LIST_CHUNK_FILES || (!more && chunk->count > 0)){
+            char* requested_files = list_request(sockfd, chunk, token, true);
+            if(requested_files != NULL){
+                uploader_push(up, chunk, requested_files);
+            }else{
+                index_free(chunk);
+            }
+            chunk = index_create(LIST_CHUNK_FILES);
+        }
+    }while(more);
+    index_free(chunk);
+    runs_close(reader);
+    hmds_close(config, sockfd);
+
+    upload_stats stats;
+    uploader_finish(up, &stats);
+    session_close(config, session);
+    if(learned != NULL){
+        cache_commit(learned);
+    }
+    if(config->history_file != NULL){
+        order_record(config->history_file, config->order, stats.files, stats.bytes, stats.seconds);
+    }
+    free(token);
+    return true;
+}
+
+
+/*  scans config->root_dir with threads threads and syncs it. the files
+    found are put in files, all of them if keep is set, as watching the
+    directory needs. returns false if the user could not be authenticated */
+bool sync_dir(sync_config* config, file_index* files, int threads, bool keep){
+    syslog(LOG_INFO, "Scanning directory: %s", config->root_dir);
+    bool synced;
+    profile_span scan_span; //the scan's I/O is counted by its workers
+    profile_begin(&scan_span);
+
+    //a directory which has no scan cache has not been synced before, so its
+    //files are all new and are sent as they are found. otherwise most are
+    //unchanged, and the directories are compared once the scan is done.
+    //unless they are kept, the files need not all be in memory, and new
+    //files are only read as they are sent
+    char* cache_file = config->cache_file;
+    if(cache_file != NULL && access(cache_file, F_OK) != 0){
+        scan* sc = scan_start(config->root_dir, threads, cache_file, SCAN_STREAM | (keep ? 0 : SCAN_DISCARD));
+        synced = sync_scan(config, sc);
+        scan_finish(sc, files);
+        profile_time(&scan_span, PROFILE_SCAN);
+    }else{
+        scan* sc = scan_start(config->root_dir, threads, cache_file, keep ? 0 : SCAN_SPILL | SCAN_DEFER);
+        file_runs* runs = scan_finish_runs(sc, files);
+        profile_time(&scan_span, PROFILE_SCAN);
+        if(runs != NULL){
+            //too many files for memory, so they are listed from disk in order
+            synced = sync_runs(config, runs);
+            runs_free(runs);
+        }else{
+            synced = sync_tree(config, files);
+        }
+    }
+    return synced;
+}
+
+/* returns the time of day in ns, as file times are kept */
+static int64_t now_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec*1000000000LL + now.tv_nsec;
+}
+
+/* returns true if the files described by a and b, each filled in by
+   cache_fill(), are the same and unchanged */
+static bool same_file(cache_record* a, cache_record* b){
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime_ns == b->mtime_ns && a->ctime_ns == b->ctime_ns;
+}
+
+int send_files(hftp_session* session, char* requested_files, file_index* files, char* token, char* root_dir, int order, uint64_t* bytes_sent, cache_writer* learned){
     //message related variable declarations/initilizations
-    host server;                        //address of the hftpd server
     message* msg;                       //message to send
     response_message* response;         //the response returned by the server
-    int sockfd;                         //the socket id connected to the hftpd
-    uint8_t next_seq = 0;               //the next sequence number for RDT
+    int sockfd = session->sockfd;       //the socket id connected to the hftpd
+    host* server = &session->server;    //address of the hftpd server
 
     //file related variable declarations/initilizations
-    int i=0;                            //index for reading files from list of requested files
-    int i_prev =i;                      //index of last file read
+    int num_files;                      //number of requested files
     uint16_t filename_len;              //length of the current filename
     char* filename;                     //the current filename
     char* abs_path;			//absolute path of the file
-    hdb_record* file_record;            //the hdb_record of the current file
-    FILE* f;				//a pointer to the actual file
+    size_t file_record;                 //the index record of the current file
+    file_reader* f;			//reads the actual file ahead of the sender
+    int sent = 0;                       //files sent so far
 
-    //create a socket to communicate with hftpd
-    sockfd = create_client_socket(fserver, fport, &server);
+    //put the requested files in the order they are to be sent
+    ordered_file* ordered = order_files(requested_files, files, root_dir, order, &num_files);
 
-    while(1){
+    for(int i=0; i<num_files; i++){
 
 	//get the next filename
-	filename = readuntil(requested_files, '\n', &i);
-	filename_len = (uint16_t)(i-i_prev-1);
-	i_prev = i;
-
-
+	filename = ordered[i].filename;
+	filename_len = (uint16_t)strlen(filename);
+
+	//skip files which were not listed
+	file_record = index_find(files, filename);
+	if(file_record == INDEX_NONE){
+	    syslog(LOG_WARNING, "Server requested unknown file %s", filename);
+	    continue;
+	}
+	profile_span span;
+	profile_begin(&span);
 
 	//get the absolute path of the file
 	asprintf(&abs_path, "%s/%s", root_dir, filename);
 
-	//break if there are no more files
-	file_record = get_hdb_record(file_list, filename);
-	if(file_record == NULL){
-	    break;
+	//a file the scan did not hash is hashed as it is sent, and its
+	//checksum follows the data, if the hftpd can take it there
+	uint64_t size = files->sizes[file_record];
+	uint32_t checksum = files->checksums[file_record];
+	bool unhashed = files->flags[file_record] & INDEX_UNHASHED;
+	bool trailer = unhashed && filename_len + CONTROL_EXT_SIZE <= MAX_FILENAME_SIZE &&
+	               (session->server_version == 0 || session->server_version >= 3);
+
+	//note what the file was before it is read, so the checksum found for
+	//it is only kept if it did not change meanwhile
+	cache_record before = {0};
+	struct stat st;
+	if(unhashed && stat(abs_path, &st) == 0){
+	    cache_fill(&before, &st, 0, now_ns());
+	}
+	if(unhashed && !trailer){
+	    checksum = crc(abs_path, &size);
 	}
 
-	//compose the init control message
-	msg = compose_control_message(CONTROL_INIT, next_seq, file_record, filename_len, token, abs_path);
+	//a large file is striped over every flow, if the hftpd can take it so
+	bool striped = filename_len + CONTROL_EXT_SIZE <= MAX_FILENAME_SIZE &&
+	               (session->server_version == 0 || session->server_version >= 5) && stripe_worth(session->others, abs_path, size);
+	uint8_t flags = (trailer ? CONTROL_FLAG_TRAILER : 0) | (striped ? CONTROL_FLAG_STRIPED : 0);
+
+	//compose the init control message, with the size and checksum found by the scan
+	msg = compose_control_message(CONTROL_INIT, session->next_seq, filename, filename_len, checksum, token, size, flags);
 
 	//send the control message and receive a valid ack
 	syslog(LOG_DEBUG, "Seding control init message");
-	response = (response_message*)send_until_valid_ack(msg->buffer[1], msg, sockfd, &server, POLL_TIME);
-	next_seq = (next_seq+1)%2;
+	response = (response_message*)send_until_valid_ack(msg->buffer[1], msg, sockfd, server, POLL_TIME);
+	session->next_seq = (session->next_seq+1)%2;
 	free(msg);
+	int version = response_version(response);
+	session->server_version = version;
+	striped = striped && version >= 5;
+
+	//an older hftpd ignored the flag, so it needs the checksum up front
+	if(trailer && version < 3){
+	    trailer = false;
+	    checksum = crc(abs_path, &size);
+	    msg = compose_control_message(CONTROL_INIT, session->next_seq, filename, filename_len, checksum, token, size, 0);
+	    free(response);
+	    response = (response_message*)send_until_valid_ack(msg->buffer[1], msg, sockfd, server, POLL_TIME);
+	    session->next_seq = (session->next_seq+1)%2;
+	    free(msg);
+	}
     
 	syslog(LOG_DEBUG, "Sending %s", filename);
 
@@ -424,32 +645,107 @@ void send_files(char* fserver, char* fport, char* requested_files, hdb_record* f
 	    exit(EXIT_FAILURE);
 	}
 
-	//open the file
-	f = fopen(abs_path, "rb");
+	//open the file. one which has gone is sent as if it were empty, and
+	//the server will find it does not match its checksum. a striped file
+	//is read by each flow itself
+	f = striped ? NULL : reader_open(abs_path);
+	if(f == NULL && !striped){
+	    syslog(LOG_WARNING, "Could not open %s", abs_path);
+	}
 	int eof = 0;
 
-	//send data messages until entire file is sent
-	while(eof == 0){
-	    //compose and send message
-	    msg = compose_data_message(f, next_seq, &eof);
-	    syslog(LOG_INFO, "Sending data for %s", filename);
-	    response = (response_message*)send_until_valid_ack(msg->buffer[1], msg, sockfd, &server, POLL_TIME);
-	    next_seq = (next_seq+1)%2;
+	if(striped){
+	    //send chunks of the file over every flow at once
+	    uint32_t sent_crc = stripe_send(session->others, sockfd, server, &session->next_seq, abs_path, filename, token, size);
+	    if(trailer){
+		checksum = sent_crc;
+	    }
+	}else if(version >= 2){
+	    //send data messages carrying their offsets until size bytes are sent.
+	    //a long run of zeros, such as a hole, is sent to a version 4 server
+	    //as one message saying how long it is
+	    uint64_t offset = 0;
+	    uLong sent_crc = crc32(0L, Z_NULL, 0);
+	    do{
+		uint64_t zeros = version >= 4 && f != NULL ? reader_zeros(f, size - offset, ZERO_RUN_MIN) : 0;
+		if(zeros > 0){
+		    msg = compose_data_zero_message(session->next_seq, offset, zeros);
+		    if(trailer){
+			sent_crc = crc32_zeros(sent_crc, zeros);
+		    }
+		    offset += zeros;
+		}else{
+		    msg = compose_data_ext_message(f, session->next_seq, offset, size);
+		    uint16_t len = ntohs(((data_ext_message*)msg)->data_len);
+		    if(trailer){
+			sent_crc = crc32(sent_crc, ((data_ext_message*)msg)->data, len);
+		    }
+		    offset += len;
+		}
+		syslog(LOG_INFO, "Sending data for %s", filename);
+		free(response);
+		response = (response_message*)send_until_valid_ack(msg->buffer[1], msg, sockfd, server, POLL_TIME);
+		session->next_seq = (session->next_seq+1)%2;
+		free(msg);
+	    }while(offset < size);
+	    if(trailer){
+		checksum = (uint32_t)sent_crc;
+	    }
+	}else{
+	    //send data messages until entire file is sent
+	    while(eof == 0){
+		//compose and send message
+		msg = compose_data_message(f, session->next_seq, &eof);
+		syslog(LOG_INFO, "Sending data for %s", filename);
+		response = (response_message*)send_until_valid_ack(msg->buffer[1], msg, sockfd, server, POLL_TIME);
+		session->next_seq = (session->next_seq+1)%2;
+	    }
+	    free(msg);
+	}
+	if(f != NULL){
+	    reader_close(f);
 	}
-	free(msg);
-    }
 
-    syslog(LOG_INFO, "Done sending all files");
-    //send a terminating control message
-    msg = compose_control_message(CONTROL_TERM, next_seq, file_record, 0, token, abs_path);
-    response = (response_message*)send_until_valid_ack(msg->buffer[1], msg, sockfd, &server, POLL_TIME);
-    close(sockfd);
+	//a file the scan did not hash is only what was hashed if it did not
+	//change while it was read
+	cache_record after = {0};
+	bool unchanged = false;
+	if(unhashed && before.ino != 0 && stat(abs_path, &st) == 0){
+	    cache_fill(&after, &st, checksum, now_ns());
+	    unchanged = same_file(&before, &after) && after.size == size;
+	}
+
+	if(trailer){
+	    //a checksum which cannot match what was sent has the hftpd drop a
+	    //file which changed, as it would a hashed file which changed
+	    msg = compose_control_message(CONTROL_TRAILER, session->next_seq, NULL, 0, unchanged ? checksum : ~checksum, token, 0, 0);
+	    free(response);
+	    response = (response_message*)send_until_valid_ack(msg->buffer[1], msg, sockfd, server, POLL_TIME);
+	    session->next_seq = (session->next_seq+1)%2;
+	    free(msg);
+	}
 
+	//remember the checksum, so the next scan need not read the file
+	if(unchanged){
+	    files->checksums[file_record] = checksum;
+	    files->flags[file_record] &= ~INDEX_UNHASHED;
+	    if(learned != NULL){
+		cache_write(learned, &after, 1);
+	    }
+	}
+	free(abs_path);
+	*bytes_sent += size;
+	sent++;
+	profile_file(&span, size);
+    }
+    order_free(ordered, num_files);
 
+    syslog(LOG_INFO, "Done sending all files");
+    return sent;
 }
 
 
-message* compose_control_message(uint8_t type, uint8_t seq, hdb_record* file_record, uint16_t filename_len, char* token, char* abs_path){
+message* compose_control_message(uint8_t type, uint8_t seq, char* filename, uint16_t filename_len, uint32_t checksum, char* token, uint64_t size, uint8_t flags){
     control_message* msg = (control_message*)create_message();
     //set msg feilds
     msg->type		= type;
@@ -457,38 +753,33 @@ message* compose_control_message(uint8_t type, uint8_t seq, hdb_record* file_rec
     msg->filename_len	= htons(filename_len);
     memcpy(msg->token, token, TOKEN_SIZE);
     msg->length		= CONTROL_STATIC_SIZE + filename_len;
+    msg->checksum	= htonl(checksum);
     if(filename_len != 0){
-	uint32_t crcval = crc(abs_path);
-	msg->filesize	= htonl(filesize(abs_path));
-	msg->checksum	= htonl(crcval);
-	memcpy(msg->filename, file_record->filename, filename_len);
+	memcpy(msg->filename, filename, filename_len);
+	control_set_ext(msg, size, 0, flags);
     }
 
 
     return (message*)msg;
 }
 
-message* compose_data_message(FILE* f, uint8_t seq, int* eof){
+message* compose_data_message(file_reader* f, uint8_t seq, int* eof){
     data_message* msg = (data_message*)create_message();
     //set type and seq
     msg->type	     = DATA_TYPE;
     msg->seq	     = seq;
     
-    //read the file to the message
-    uint16_t bytes_read;
-    uint8_t* data_ptr = msg->data;
-    bytes_read = fread(data_ptr, sizeof(uint8_t), MAX_DATA_SIZE, f);
+    //copy the next part of the file to the message
+    ssize_t bytes_read = f != NULL ? reader_read(f, msg->data, MAX_DATA_SIZE) : 0;
+    if(bytes_read == -1){
+	syslog(LOG_ERR, "Error reading file");
+	exit(EXIT_FAILURE);
+    }
     msg->data_len = htons(bytes_read);
 
-    //set eof if the end of file has been reached, exit if an error occured
+    //set eof if the end of file has been reached
     if(bytes_read < MAX_DATA_SIZE){
-	if(feof(f)){
-	    *eof = 1;
-	}
-	else if(ferror(f)){
-	    syslog(LOG_ERR, "Error reading file");
-	    exit(EXIT_FAILURE);
-	}
+	*eof = 1;
     }
     
     msg->length = DATA_STATIC_SIZE + bytes_read;
@@ -497,12 +788,51 @@ message* compose_data_message(FILE* f, uint8_t seq, int* eof){
 }
 
 
-uint32_t filesize(char* file){
-    FILE * f = fopen(file, "r");
-    fseek(f, 0, SEEK_END);
-    uint32_t len = (unsigned long)ftell(f);
-    fclose(f);
-    return len;
+message* compose_data_ext_message(file_reader* f, uint8_t seq, uint64_t offset, uint64_t size){
+    data_ext_message* msg = (data_ext_message*)create_message();
+    msg->type	     = DATA_EXT_TYPE;
+    msg->seq	     = seq;
+    msg->offset	     = htobe64(offset);
+
+    //copy the next part of the file to the message
+    uint64_t remaining = size - offset;
+    uint16_t len = remaining < MAX_DATA_EXT_SIZE ? remaining : MAX_DATA_EXT_SIZE;
+    ssize_t bytes_read = f != NULL ? reader_read(f, msg->data, len) : 0;
+    if(bytes_read == -1){
+	syslog(LOG_ERR, "Error reading file");
+	exit(EXIT_FAILURE);
+    }
+    if(bytes_read < len){
+	//the file shrank after its size was taken. the server will find it
+	//does not match its checksum and not record it
+	syslog(LOG_WARNING, "File changed while being sent");
+	memset(msg->data + bytes_read, 0, len - bytes_read);
+    }
+
+    msg->data_len = htons(len);
+    msg->length = DATA_EXT_STATIC_SIZE + len;
+
+    return (message*)msg;
+}
+
+message* compose_data_zero_message(uint8_t seq, uint64_t offset, uint64_t len){
+    data_zero_message* msg = (data_zero_message*)create_message();
+    msg->type	     = DATA_ZERO_TYPE;
+    msg->seq	     = seq;
+    msg->reserved    = 0;
+    msg->offset	     = htobe64(offset);
+    msg->zero_len    = htobe64(len);
+    msg->length      = DATA_ZERO_SIZE;
+
+    return (message*)msg;
+}
+
+uint64_t filesize(char* file){
+    struct stat st;
+    if(stat(file, &st) == -1){
+	return 0;
+    }
+    return st.st_size;
 }
 
 int main(int argc, char *argv[]){
@@ -521,6 +851,15 @@ int main(int argc, char *argv[]){
     char* fserver = "localhost";
     char* fport = "10000";
     int verbose_flag = 0;
+    int restore_flag = 0;
+    int jobs = 4;
+    int threads = 2*sysconf(_SC_NPROCESSORS_ONLN); //scan threads. twice the cores keeps the disk busy while files are checksummed
+    int cache_flag = 1;
+    int watch_flag = 0;
+    int order = ORDER_SERVER;
+    int flows = 1; //flows a large file is striped over
+    char* profile_path = NULL; //where the profile is written, NULL if the sync is not profiled
+    char* manifest = NULL; //the users synced by a batch, NULL if only one is synced
 
     //create the array of long optional args
     struct option long_options[] =
@@ -531,6 +870,15 @@ int main(int argc, char *argv[]){
         {"dir",     required_argument, 0,            'd'},
         {"fserver", required_argument, 0,            'f'},
         {"fport",   required_argument, 0,            'o'},
+        {"restore", no_argument,       &restore_flag, 1 },
+        {"jobs",    required_argument, 0,            'j'},
+        {"threads", required_argument, 0,            't'},
+        {"no-cache", no_argument,      &cache_flag,   0 },
+        {"watch",   no_argument,       &watch_flag,   1 },
+        {"order",   required_argument, 0,            'O'},
+        {"profile", required_argument, 0,            'P'},
+        {"flows",   required_argument, 0,            'F'},
+        {"batch",   required_argument, 0,            'b'},
         {0,0,0,0}
     };
 
@@ -538,7 +886,7 @@ int main(int argc, char *argv[]){
     while(1){
 
         int option_index = 0;
-        c = getopt_long(argc, argv, "vs:p:d:f:o:", long_options, &option_index);
+        c = getopt_long(argc, argv, "vs:p:d:f:o:j:t:O:P:F:b:", long_options, &option_index);
         //if we've reached the end of the options, stop iterating
         if (c==-1) break;
 
@@ -568,7 +916,46 @@ int main(int argc, char *argv[]){
                 verbose_flag = 1;
                 break;
 
+            case 'j':
+                jobs = atoi(optarg);
+                if(jobs < 1){
+                    syslog(LOG_ERR, "-j / --jobs: positive int required");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 't':
+                threads = atoi(optarg);
+                if(threads < 1){
+                    syslog(LOG_ERR, "-t / --threads: positive int required");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'O':
+                order = order_parse(optarg);
+                if(order == -1){
+                    syslog(LOG_ERR, "-O / --order: one of server, size, mtime or extent required");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'P':
+                profile_path = optarg;
+                profile_enable();
+                break;
 
+            case 'F':
+                flows = atoi(optarg);
+                if(flows < 1){
+                    syslog(LOG_ERR, "-F / --flows: positive int required");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'b':
+                manifest = optarg;
+                break;
 
             case '?':
                 exit(EXIT_FAILURE);
@@ -583,6 +970,31 @@ int main(int argc, char *argv[]){
         setlogmask(LOG_UPTO(LOG_DEBUG));
     }
 
+    //a batch syncs the users of its manifest, each from their own directory,
+    //jobs at once, sharing the scan threads between them
+    if(manifest != NULL){
+        if(argc - optind != 0 || restore_flag || watch_flag){
+            syslog(LOG_ERR, "%s: usage: %s [OPTIONS] --batch manifest, without --restore or --watch\n", argv[0], argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        sync_config base = {
+            .hostname = hostname,
+            .port = port,
+            .fserver = fserver,
+            .fport = fport,
+            .order = order,
+            .flows = flows,
+            .hmds_fd = -1,
+            .session = NULL
+        };
+        int failed = batch_sync(manifest, &base, jobs, threads/jobs > 0 ? threads/jobs : 1, cache_flag);
+        if(profile_path != NULL){
+            profile_write(profile_path);
+        }
+        closelog();
+        exit(failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
     /* process required arguments */
     if(argc - optind == 2){
         username = argv[optind];
@@ -597,36 +1009,65 @@ int main(int argc, char *argv[]){
 
     //set up variables to communicate with the hmds server
     root_dir = expand_home_dir(root_dir);
-    hdb_record *head = malloc(sizeof(hdb_record)); //head of linked list of files and checksums
-    head->next = NULL;
-    char r_path[PATH_MAX]= ""; //relative path from root_dir. used to print to file argv[2]
-
-    //iterate the directories, starting from the root dir, gathering files and checksums
-    syslog(LOG_INFO, "Scanning directory: %s", root_dir);
-    iterate_dirs(root_dir, r_path, head, username);
-
-    //connect to server and authorize user
-    struct addrinfo* info = get_sockaddr(hostname, port);
-    int sockfd = open_connection(info);
-    char* token = auth_request(sockfd, username, password);
-
-    //if the user was authenticated successfully
-    if(token != NULL){
 
-        //get the list of requested files from the hmds server
-        char* requested_files = list_request(sockfd, head, token);
+    //restore the Hooli directory from the server instead of uploading it
+    if(restore_flag){
+        //the FILES request is sent in the same flight as the AUTH
+        char* token_file = cache_flag ? token_path(username, hostname, port) : NULL;
+        int sockfd = open_connection(get_sockaddr(hostname, port));
+        auth_send(sockfd, username, password, token_file);
+        char* stored_files = files_request(sockfd, "");
+        char* token = auth_receive(sockfd);
+        int failed = 0;
+
+        if(token != NULL){
+            failed = restore_files(fserver, fport, stored_files, token, root_dir, jobs);
+        }
 
-        //initiate a connection with hftpd server and send the requested files
-        send_files(fserver, fport, requested_files, head, token, root_dir);
+        free(stored_files);
+        free(token_file);
+        close(sockfd);
+        closelog();
+        exit(token != NULL && failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
-        //clean up
-        hdb_free_result(head);
+    //sync the files as the scan finds them, then keep syncing as they
+    //change if asked to
+    char* cache_file = cache_flag ? cache_path(username, root_dir) : NULL;
+    char* token_file = cache_flag ? token_path(username, hostname, port) : NULL;
+    sync_config config = {
+        .hostname = hostname,
+        .port = port,
+        .fserver = fserver,
+        .fport = fport,
+        .username = username,
+        .password = password,
+        .root_dir = root_dir,
+        .order = order,
+        .flows = flows,
+        .history_file = order_history_path(username, root_dir),
+        .cache_file = cache_file,
+        .token_file = token_file,
+        .hmds_fd = -1,
+        .session = NULL
+    };
 
+    //iterate the directories, starting from the root dir, gathering files and checksums
+    file_index* files = index_create(0); //the files found and their checksums
+    bool synced = sync_dir(&config, files, threads, watch_flag);
+    if(synced && watch_flag){
+        watch_dir(&config, files, threads, cache_file);
+    }else{
+        index_free(files);
+    }
+    free(cache_file);
+    free(token_file);
+    free(config.history_file);
+    if(profile_path != NULL){
+        profile_write(profile_path);
     }
-
 
     //clean up
-    close(sockfd);
     closelog();
 
     exit(EXIT_SUCCESS);
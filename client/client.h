@@ -33,66 +33,117 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 
 #include "../common/socketutils.h"
 #include "../common/udp_client.h"
 #include "../common/udp_sockets.h"
-#include "../hdb/hdb.h"
+#include "file_index.h"
 #include "../common/hftp_messages.h"
+#include "restore.h"
+#include "scan.h"
+#include "watch.h"
+#include "uploader.h"
+#include "upload_order.h"
+#include "file_reader.h"
+#include "dir_tree.h"
+#include "ignore.h"
+#include "file_runs.h"
+#include "profile.h"
+#include "hmds_auth.h"
+#include "stripe.h"
+#include "batch.h"
 
 #define POLL_TIME 10000
+#define CRC_BUFFER_SIZE 262144 //bytes read at a time to compute a checksum
+#define CRC_TO_END UINT64_MAX //a crc_range() length which reads to the end of the file
+#define LIST_CHUNK_FILES 4096 //files in each LIST request of a sync from runs
+#define ZERO_RUN_MIN MAX_DATA_EXT_SIZE //shortest run of zeros sent as a DATA_ZERO message
 
-/* This function recursively iterates through directories starting at "dir".
-   For each file, this algorithm prints it's relative path from "dir", along
-   with its CRC-32 checksum, into the file "file"*/
-void iterate_dirs(char*, char*, hdb_record*, char*);
+/* computes the crc32 value of the given file, reading it once through a
+   fixed-size buffer. if size is not NULL, it is set to the bytes read */
+unsigned long crc(char* filepath, uint64_t* size);
 
-/* computes the crc32 value of the given file */
-unsigned long crc(char[]);
-
-/* adds data to linked list. returns a pointer to the newly added node */
-void add_to_list(hdb_record*, char*, char*, char*, char*);
-
-/* returns the hdb_recrod in a linked list with a mathcing filename to parameter filename */
-hdb_record* get_hdb_record(hdb_record* head, char* filename);
+/* computes the crc32 value of len bytes of the file open at fd, which is
+   at filepath, starting at offset. len may be CRC_TO_END. if size is not
+   NULL, it is set to the bytes read */
+unsigned long crc_range(int fd, char* filepath, uint64_t offset, uint64_t len, uint64_t* size);
 
 /* converts an unsigned long to a char */
 char* ulong_to_hexstr(uLong num);
 
-/* frees values associated with linked list of crc values */
-void free_hdb_list(hdb_record* head);
-
 /* expands a '~' in a directory path name to the home directory */
 char* expand_home_dir(char* dir);
 
 /* opens a socket for this process and connects to the server */
 int open_connection(struct addrinfo* addr_list);
 
-/* 	creates, sends, receives, and handles the response of the auth request
-	returns the token generated for the current connection to the hmds*/
-char* auth_request(int sockfd, char* username, char* password);
-
 /*  handles the LIST request. creates the request, gets the response,
-    and handles the response accordingly */
-char* list_request(int sockfd, hdb_record*, char* token);
+    and handles the response accordingly. sorted says the files are in
+    order of path, so the hmds may join them against its own in order */
+char* list_request(int sockfd, file_index* files, char* token, bool sorted);
 
-/*  creates the body of the LIST request using a linked list of hdb_records
+/*  handles the TREE request. sends the sums of the directories of dirs and
+    returns the list of the ones which differ from the stored ones, or NULL
+    if none do */
+char* tree_request(int sockfd, file_index* dirs, char* token);
+
+/*  creates the body of the LIST request from the files in an index
      and returns the size of the body in bytes */
-int create_list_body(hdb_record* head, char** list);
+int create_list_body(file_index* files, char** list);
+
+/*  connects to the hmds, authenticates, sends a LIST of the files
+    and uploads the ones the server requests. returns false if the user
+    could not be authenticated */
+bool sync_files(sync_config* config, file_index* files);
+
+/*  connects to the hmds, authenticates, and finds the directories which
+    differ from the stored ones. only the files in those are sent in a
+    LIST request, and the ones the server requests are uploaded. returns
+    false if the user could not be authenticated */
+bool sync_tree(sync_config* config, file_index* files);
+
+/*  syncs the files of a streaming scan as they are found. each batch is
+    sent in a LIST request while the scan goes on, and the files the hmds
+    requests are uploaded on a thread of their own. returns false if the
+    user could not be authenticated */
+bool sync_scan(sync_config* config, scan* sc);
+
+/*  syncs the files of a scan which were spilled to disk as runs. they are
+    read back in order of path and sent in LIST requests of
+    LIST_CHUNK_FILES at a time, and the files the hmds requests are
+    uploaded on a thread of their own. returns false if the user could
+    not be authenticated */
+bool sync_runs(sync_config* config, file_runs* runs);
+
+/*  scans config->root_dir with threads threads and syncs it. the files
+    found are put in files, all of them if keep is set, as watching the
+    directory needs. returns false if the user could not be authenticated */
+bool sync_dir(sync_config* config, file_index* files, int threads, bool keep);
 
 /* returns the size of the parameter file */
-uint32_t filesize(char* file);
+uint64_t filesize(char* file);
 
-/*sends all the files in requested_files to fport at fserver under user token */
-void send_files(char*, char*, char*, hdb_record*, char*, char*);
+/*  sends all the files in requested_files over session under user token,
+    in the given order. returns the number of files sent, and adds their
+    bytes to bytes_sent. files the scan did not hash are hashed as they are
+    sent, and their checksums are added to learned, if it is not NULL */
+int send_files(hftp_session* session, char*, file_index*, char*, char*, int order, uint64_t* bytes_sent, cache_writer* learned);
 
-/* creates a control message using parameters as feilds */
-message* compose_control_message(uint8_t type, uint8_t seq, hdb_record* file_record, uint16_t filename_len, char* token, char* abs_path);
+/* creates a control message using parameters as feilds. size is the size of the file,
+   and flags are its CONTROL_FLAG_* flags */
+message* compose_control_message(uint8_t type, uint8_t seq, char* filename, uint16_t filename_len, uint32_t checksum, char* token, uint64_t size, uint8_t flags);
 
 /* creates a data message from file f, with seq seq. Returns the message and sets eof if the end of file has been reached*/
-message* compose_data_message(FILE*, uint8_t, int*);
+message* compose_data_message(file_reader*, uint8_t, int*);
+
+/* creates a version 2 data message carrying the part of file f at offset, which is size bytes long */
+message* compose_data_ext_message(file_reader* f, uint8_t seq, uint64_t offset, uint64_t size);
+
+/* creates a version 4 data message standing for len zero bytes of a file at offset */
+message* compose_data_zero_message(uint8_t seq, uint64_t offset, uint64_t len);
 
 /* returns the filesize of file */
-uint32_t filesize(char* file);
+uint64_t filesize(char* file);
 
 #endif /* CLIENT_H */
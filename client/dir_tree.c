@@ -0,0 +1,140 @@
+#include "client.h"
+
+/* returns the path of the directory holding path, copying it to buf,
+   which is grown to fit */
+static char* parent_of(const char* path, char** buf, size_t* size){
+    size_t len = merkle_parent(path, strlen(path));
+    if(len == 0) return MERKLE_ROOT;
+
+    if(len + 1 > *size){
+        *size = len + 1;
+        *buf = (char*)realloc(*buf, *size);
+    }
+    memcpy(*buf, path, len);
+    (*buf)[len] = '\0';
+    return *buf;
+}
+
+/* returns an index of the directories above the files of files, each
+   named by its path ending with a '/', and MERKLE_ROOT. the sum of the
+   leaves below each directory is kept where a file's size would be */
+file_index* tree_build(file_index* files){
+    file_index* dirs = index_create(files->count/8);
+    size_t root = index_put(dirs, MERKLE_ROOT, 0, 0);
+    char* buf = NULL;
+    size_t size = 0;
+    char checksum[9];
+
+    for(size_t i=0; i<files->count; i++){
+        //the leaf hashes the checksum as the hmds stores it. a file which
+        //is not hashed yet can match nothing the hmds stores
+        char* path = index_path(files, i);
+        if(files->flags[i] & INDEX_UNHASHED){
+            strcpy(checksum, "-");
+        } else{
+            sprintf(checksum, "%X", files->checksums[i]);
+        }
+        uint64_t leaf = merkle_leaf(path, checksum);
+        dirs->sizes[root] += leaf;
+
+        //add it to every directory above the file, up to the root
+        size_t len = strlen(path);
+        while((len = merkle_parent(path, len)) > 0){
+            if(len + 1 > size){
+                size = len + 1;
+                buf = (char*)realloc(buf, size);
+            }
+            memcpy(buf, path, len);
+            buf[len] = '\0';
+
+            size_t dir = index_find(dirs, buf);
+            if(dir == INDEX_NONE){
+                dir = index_put(dirs, buf, 0, 0);
+            }
+            dirs->sizes[dir] += leaf;
+        }
+    }
+
+    free(buf);
+    return dirs;
+}
+
+/* creates the body of a TREE request from the directories of dirs and
+   their sums, and returns the size of the body in bytes */
+int create_tree_body(file_index* dirs, char** body){
+    //the sums are at most 16 hex digits, so the body can be allocated once
+    size_t size = 1;
+    for(size_t i=0; i<dirs->count; i++){
+        size += strlen(index_path(dirs, i)) + 1 + 16 + 1;
+    }
+    *body = (char*)malloc(size);
+
+    int length = 0;
+    for(size_t i=0; i<dirs->count; i++){
+        length += sprintf(*body + length, "%s\n%lX\n", index_path(dirs, i), (unsigned long)dirs->sizes[i]);
+    }
+    (*body)[length] = '\0';
+    return length;
+}
+
+/* compares the directories of files with the ones the hmds stores over
+   sockfd, a level at a time. returns an index of the files directly in
+   the directories which differ */
+file_index* tree_diff(int sockfd, file_index* files, char* token){
+    file_index* dirs = tree_build(files);
+    file_index* changed = index_create(0);
+    char* buf = NULL;
+    size_t size = 0;
+
+    //start from the root, which is the sum of everything
+    file_index* level = index_create(0);
+    index_put(level, MERKLE_ROOT, 0, dirs->sizes[index_find(dirs, MERKLE_ROOT)]);
+    int rounds = 0;
+    size_t compared = 0;
+
+    while(level->count > 0){
+        char* differing = tree_request(sockfd, level, token);
+        rounds++;
+        compared += level->count;
+        index_free(level);
+        level = index_create(0);
+        if(differing == NULL) break;
+
+        //every directory named by the hmds ends with a '\n'
+        file_index* differ = index_create(0);
+        char* start = differing;
+        char* end;
+        while((end = strchr(start, '\n')) != NULL){
+            *end = '\0';
+            if(end != start){
+                index_put(differ, start, 0, 0);
+            }
+            start = end + 1;
+        }
+        free(differing);
+
+        //the files directly in a directory which differs are listed, and
+        //its subdirectories are compared next
+        for(size_t i=0; i<files->count; i++){
+            char* path = index_path(files, i);
+            if(index_find(differ, parent_of(path, &buf, &size)) != INDEX_NONE){
+                index_put_record(changed, files, i);
+            }
+        }
+        for(size_t i=0; i<dirs->count; i++){
+            char* path = index_path(dirs, i);
+            if(strcmp(path, MERKLE_ROOT) == 0) continue;
+            if(index_find(differ, parent_of(path, &buf, &size)) != INDEX_NONE){
+                index_put(level, path, 0, dirs->sizes[i]);
+            }
+        }
+        index_free(differ);
+    }
+
+    syslog(LOG_INFO, "Compared %lu of %lu director(ies) in %d round(s), %lu file(s) may have changed",
+           (unsigned long)compared, (unsigned long)dirs->count, rounds, (unsigned long)changed->count);
+    index_free(level);
+    index_free(dirs);
+    free(buf);
+    return changed;
+}
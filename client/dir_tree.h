@@ -0,0 +1,37 @@
+/* DESCRIPTION: Finds which files of the Hooli directory may differ from
+        the ones stored, without listing them all. The sum of the
+        leaves of every file below each directory is found from the
+        index, and the hmds compares those sums with the ones it
+        keeps, starting from the root and going down only into the
+        directories which differ. Only the files directly in those
+        are then sent in a LIST request, so a sync of a directory in
+        which little changed costs about as much as the change.      */
+
+#ifndef DIR_TREE_H
+#define DIR_TREE_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "file_index.h"
+#include "../common/merkle.h"
+
+/* returns an index of the directories above the files of files, each
+   named by its path ending with a '/', and MERKLE_ROOT. the sum of the
+   leaves below each directory is kept where a file's size would be */
+file_index* tree_build(file_index* files);
+
+/* creates the body of a TREE request from the directories of dirs and
+   their sums, and returns the size of the body in bytes */
+int create_tree_body(file_index* dirs, char** body);
+
+/* compares the directories of files with the ones the hmds stores over
+   sockfd, a level at a time. returns an index of the files directly in
+   the directories which differ */
+file_index* tree_diff(int sockfd, file_index* files, char* token);
+
+#endif /* DIR_TREE_H */
@@ -0,0 +1,244 @@
+#include "file_index.h"
+
+/* returns the 64-bit FNV-1a hash of path */
+static uint64_t hash_path(const char* path){
+    uint64_t hash = 14695981039346656037ULL;
+    for(const unsigned char* c = (const unsigned char*)path; *c; c++){
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* returns the slot holding record i */
+static size_t slot_of(file_index* index, size_t i){
+    size_t mask = index->num_slots - 1;
+    size_t slot = index->hashes[i] & mask;
+    while(index->slots[slot] != i + 1){
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/* rebuilds the hash table with num_slots slots, from the stored hashes */
+static void resize_slots(file_index* index, size_t num_slots){
+    free(index->slots);
+    index->slots = (uint32_t*)calloc(num_slots, sizeof(uint32_t));
+    index->num_slots = num_slots;
+
+    size_t mask = num_slots - 1;
+    for(size_t i=0; i<index->count; i++){
+        size_t slot = index->hashes[i] & mask;
+        while(index->slots[slot] != 0){
+            slot = (slot + 1) & mask;
+        }
+        index->slots[slot] = i + 1;
+    }
+}
+
+/* makes room in the record arrays for one more record */
+static void grow_records(file_index* index){
+    if(index->count < index->capacity) return;
+
+    index->capacity = index->capacity ? index->capacity*2 : INDEX_MIN_SLOTS/2;
+    index->path_offsets = (uint64_t*)realloc(index->path_offsets, index->capacity*sizeof(uint64_t));
+    index->hashes = (uint64_t*)realloc(index->hashes, index->capacity*sizeof(uint64_t));
+    index->checksums = (uint32_t*)realloc(index->checksums, index->capacity*sizeof(uint32_t));
+    index->sizes = (uint64_t*)realloc(index->sizes, index->capacity*sizeof(uint64_t));
+    index->flags = (uint8_t*)realloc(index->flags, index->capacity*sizeof(uint8_t));
+    if(index->path_offsets == NULL || index->hashes == NULL || index->checksums == NULL || index->sizes == NULL || index->flags == NULL){
+        syslog(LOG_ERR, "Out of memory for the file index");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* copies path into the arena, returning its offset */
+static uint64_t intern_path(file_index* index, const char* path){
+    size_t len = strlen(path) + 1;
+    if(index->arena_len + len > index->arena_size){
+        size_t size = index->arena_size ? index->arena_size : 4096;
+        while(index->arena_len + len > size) size *= 2;
+        index->arena = (char*)realloc(index->arena, size);
+        if(index->arena == NULL){
+            syslog(LOG_ERR, "Out of memory for the file index");
+            exit(EXIT_FAILURE);
+        }
+        index->arena_size = size;
+    }
+
+    uint64_t offset = index->arena_len;
+    memcpy(index->arena + offset, path, len);
+    index->arena_len += len;
+    return offset;
+}
+
+/* copies the live paths to a new arena, dropping the garbage */
+static void compact_arena(file_index* index){
+    char* old = index->arena;
+    index->arena = (char*)malloc(index->arena_size);
+    index->arena_len = 0;
+    index->garbage = 0;
+    for(size_t i=0; i<index->count; i++){
+        index->path_offsets[i] = intern_path(index, old + index->path_offsets[i]);
+    }
+    free(old);
+}
+
+/* creates an empty index with room for expected records */
+file_index* index_create(size_t expected){
+    file_index* index = (file_index*)calloc(1, sizeof(file_index));
+
+    size_t num_slots = INDEX_MIN_SLOTS;
+    while(num_slots < expected*2) num_slots *= 2;
+    index->slots = (uint32_t*)calloc(num_slots, sizeof(uint32_t));
+    index->num_slots = num_slots;
+    return index;
+}
+
+/* frees index */
+void index_free(file_index* index){
+    free(index->arena);
+    free(index->path_offsets);
+    free(index->hashes);
+    free(index->checksums);
+    free(index->sizes);
+    free(index->flags);
+    free(index->slots);
+    free(index);
+}
+
+/* returns the record for path, or INDEX_NONE if there is none */
+size_t index_find(file_index* index, const char* path){
+    uint64_t hash = hash_path(path);
+    size_t mask = index->num_slots - 1;
+
+    for(size_t slot = hash & mask; index->slots[slot] != 0; slot = (slot + 1) & mask){
+        size_t i = index->slots[slot] - 1;
+        if(index->hashes[i] == hash && strcmp(index_path(index, i), path) == 0){
+            return i;
+        }
+    }
+    return INDEX_NONE;
+}
+
+/* sets the checksum and size of path, adding a record for it if there
+   is none. returns the record */
+size_t index_put(file_index* index, const char* path, uint32_t checksum, uint64_t size){
+    uint64_t hash = hash_path(path);
+    size_t mask = index->num_slots - 1;
+
+    size_t slot;
+    for(slot = hash & mask; index->slots[slot] != 0; slot = (slot + 1) & mask){
+        size_t i = index->slots[slot] - 1;
+        if(index->hashes[i] == hash && strcmp(index_path(index, i), path) == 0){
+            index->checksums[i] = checksum;
+            index->sizes[i] = size;
+            index->flags[i] = 0;
+            return i;
+        }
+    }
+
+    //a new record, in the empty slot the search ended at
+    grow_records(index);
+    size_t i = index->count++;
+    index->path_offsets[i] = intern_path(index, path);
+    index->hashes[i] = hash;
+    index->checksums[i] = checksum;
+    index->sizes[i] = size;
+    index->flags[i] = 0;
+    index->slots[slot] = i + 1;
+
+    //keep the table at most half full, so searches stay short
+    if(index->count*2 > index->num_slots){
+        resize_slots(index, index->num_slots*2);
+    }
+    return i;
+}
+
+/* adds path with its size but no checksum, which is found as the file is
+   sent. returns the record */
+size_t index_put_unhashed(file_index* index, const char* path, uint64_t size){
+    size_t i = index_put(index, path, 0, size);
+    index->flags[i] = INDEX_UNHASHED;
+    return i;
+}
+
+/* sets the record for the path of record i of src to a copy of it.
+   returns the record */
+size_t index_put_record(file_index* index, file_index* src, size_t i){
+    size_t record = index_put(index, index_path(src, i), src->checksums[i], src->sizes[i]);
+    index->flags[record] = src->flags[i];
+    return record;
+}
+
+/* removes record i. the last record takes its place */
+void index_remove(file_index* index, size_t i){
+    size_t mask = index->num_slots - 1;
+
+    //empty the record's slot, moving back any record which would no
+    //longer be found past the gap
+    size_t gap = slot_of(index, i);
+    index->slots[gap] = 0;
+    for(size_t slot = (gap + 1) & mask; index->slots[slot] != 0; slot = (slot + 1) & mask){
+        size_t home = index->hashes[index->slots[slot] - 1] & mask;
+        if(((slot - home) & mask) >= ((slot - gap) & mask)){
+            index->slots[gap] = index->slots[slot];
+            index->slots[slot] = 0;
+            gap = slot;
+        }
+    }
+    index->garbage += strlen(index_path(index, i)) + 1;
+
+    //fill the hole in the arrays with the last record
+    size_t last = index->count - 1;
+    if(i != last){
+        index->slots[slot_of(index, last)] = i + 1;
+        index->path_offsets[i] = index->path_offsets[last];
+        index->hashes[i] = index->hashes[last];
+        index->checksums[i] = index->checksums[last];
+        index->sizes[i] = index->sizes[last];
+        index->flags[i] = index->flags[last];
+    }
+    index->count--;
+
+    if(index->garbage > index->arena_len/2){
+        compact_arena(index);
+    }
+}
+
+/* removes the record for path. if path is a directory, ending with a '/',
+   every record below it is removed. returns the number removed */
+size_t index_remove_path(file_index* index, const char* path){
+    size_t len = strlen(path);
+    if(len == 0 || path[len-1] != '/'){
+        size_t i = index_find(index, path);
+        if(i == INDEX_NONE) return 0;
+        index_remove(index, i);
+        return 1;
+    }
+
+    //a record moved into a removed one's place is checked before moving on
+    size_t removed = 0;
+    for(size_t i=0; i<index->count; ){
+        if(strncmp(index_path(index, i), path, len) == 0){
+            index_remove(index, i);
+            removed++;
+        }else{
+            i++;
+        }
+    }
+    return removed;
+}
+
+/* adds every record of src to index */
+void index_merge(file_index* index, file_index* src){
+    size_t num_slots = index->num_slots;
+    while(num_slots < (index->count + src->count)*2) num_slots *= 2;
+    if(num_slots != index->num_slots){
+        resize_slots(index, num_slots);
+    }
+
+    for(size_t i=0; i<src->count; i++){
+        index_put_record(index, src, i);
+    }
+}
@@ -0,0 +1,80 @@
+/* DESCRIPTION: The client's index of the files in the Hooli directory,
+        with the checksum and size of each. The relative paths are
+        copied one after another into a single arena, the fields of
+        the records are kept in parallel arrays, and the records are
+        found by path through an open-addressing hash table with
+        linear probing. A million files fit in a few allocations, and
+        a file is found or added in constant time.                   */
+
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+
+#define INDEX_NONE ((size_t)-1) //returned when a path is not in the index
+#define INDEX_MIN_SLOTS 64      //the hash table is never smaller than this
+#define INDEX_UNHASHED 1        //the file was not read, so its checksum is not known
+
+//the files of a directory, by relative path
+typedef struct
+{
+    char* arena;                //every path, each ending with a '\0'
+    size_t arena_len;           //bytes of arena in use
+    size_t arena_size;          //bytes of arena allocated
+    size_t garbage;             //bytes of arena left by removed records
+
+    size_t count;               //number of records
+    size_t capacity;            //records the arrays have room for
+    uint64_t* path_offsets;     //where each record's path starts in arena
+    uint64_t* hashes;           //hash of each record's path
+    uint32_t* checksums;        //CRC-32 of each file
+    uint64_t* sizes;            //size of each file
+    uint8_t* flags;             //INDEX_* flags of each file
+
+    uint32_t* slots;            //record index + 1 of each slot, 0 if empty
+    size_t num_slots;           //a power of two, at least twice count
+} file_index;
+
+/* creates an empty index with room for expected records */
+file_index* index_create(size_t expected);
+
+/* frees index */
+void index_free(file_index* index);
+
+/* returns the path of record i */
+static inline char* index_path(file_index* index, size_t i){
+    return index->arena + index->path_offsets[i];
+}
+
+/* returns the record for path, or INDEX_NONE if there is none */
+size_t index_find(file_index* index, const char* path);
+
+/* sets the checksum and size of path, adding a record for it if there
+   is none. returns the record */
+size_t index_put(file_index* index, const char* path, uint32_t checksum, uint64_t size);
+
+/* adds path with its size but no checksum, which is found as the file is
+   sent. returns the record */
+size_t index_put_unhashed(file_index* index, const char* path, uint64_t size);
+
+/* sets the record for the path of record i of src to a copy of it.
+   returns the record */
+size_t index_put_record(file_index* index, file_index* src, size_t i);
+
+/* removes record i. the last record takes its place */
+void index_remove(file_index* index, size_t i);
+
+/* removes the record for path. if path is a directory, ending with a '/',
+   every record below it is removed. returns the number removed */
+size_t index_remove_path(file_index* index, const char* path);
+
+/* adds every record of src to index */
+void index_merge(file_index* index, file_index* src);
+
+#endif /* FILE_INDEX_H */
@@ -0,0 +1,289 @@
+#include "file_reader.h"
+
+/* looks up the hole of r's file at r->pos, if there is one, and the data
+   after it, setting hole_end and data_end */
+static void find_extent(file_reader* r){
+    r->io.calls++;
+    off_t data = lseek(r->fd, r->pos, SEEK_DATA);
+    if(data == -1){
+        //there is no data past pos, or the file system cannot say where
+        //it is, in which case the rest of the file is read
+        r->sparse = errno == ENXIO;
+        r->hole_end = errno == ENXIO && r->size > r->pos ? r->size : r->pos;
+        r->data_end = UINT64_MAX;
+        return;
+    }
+
+    r->io.calls++;
+    off_t hole = lseek(r->fd, data, SEEK_HOLE);
+    r->hole_end = data;
+    r->data_end = hole > data ? (uint64_t)hole : UINT64_MAX;
+}
+
+/* fills one buffer of the ring from r's file. returns the bytes read, or
+   -1 if the read failed */
+static ssize_t fill_buffer(file_reader* r, uint8_t* buf){
+    size_t total = 0;
+    size_t read_bytes = 0;
+    while(total < READER_BUFFER_SIZE){
+        size_t want = READER_BUFFER_SIZE - total;
+        if(r->sparse){
+            if(r->pos >= r->data_end){
+                find_extent(r);
+            }
+            //a hole reads as zeros, so they are filled in without reading it
+            if(r->pos < r->hole_end){
+                size_t len = r->hole_end - r->pos < want ? r->hole_end - r->pos : want;
+                memset(buf + total, 0, len);
+                total += len;
+                r->pos += len;
+                continue;
+            }
+            if(r->data_end - r->pos < want){
+                want = r->data_end - r->pos;
+            }
+        }
+
+        ssize_t len = pread(r->fd, buf + total, want, r->pos);
+        r->io.calls++;
+        if(len == 0) break;
+        if(len == -1){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        total += len;
+        read_bytes += len;
+        r->pos += len;
+    }
+    r->io.bytes += read_bytes;
+    return total;
+}
+
+/* returns how many of the len bytes at p are zero before the first which
+   is not */
+static size_t zero_prefix(const uint8_t* p, size_t len){
+    size_t i = 0;
+#ifdef __SSE2__
+    //64 bytes at a time, while they are all zero
+    const __m128i zero = _mm_setzero_si128();
+    for(; i + 64 <= len; i += 64){
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i)),
+                                              _mm_loadu_si128((const __m128i*)(p + i + 16))),
+                                 _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)),
+                                              _mm_loadu_si128((const __m128i*)(p + i + 48))));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF) break;
+    }
+#endif
+    for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)){
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        if(word != 0) break;
+    }
+    while(i < len && p[i] == 0){
+        i++;
+    }
+    return i;
+}
+
+/* moves the sender on len bytes in the current buffer of r, handing it
+   back to the reader once it is emptied. r's lock must be held */
+static void advance(file_reader* r, size_t len){
+    r->read_pos += len;
+    if(r->read_pos == r->lengths[r->read_index]){
+        r->read_pos = 0;
+        r->read_index = (r->read_index + 1) % READER_BUFFERS;
+        r->filled--;
+        pthread_cond_broadcast(&r->changed);
+    }
+}
+
+/* the body of the read-ahead thread: fills each empty buffer in turn */
+static void* read_ahead(void* arg){
+    file_reader* r = (file_reader*)arg;
+    int write_index = 0;
+
+    while(1){
+        //wait for an empty buffer
+        pthread_mutex_lock(&r->lock);
+        while(r->filled == READER_BUFFERS && !r->stop){
+            pthread_cond_wait(&r->changed, &r->lock);
+        }
+        if(r->stop){
+            pthread_mutex_unlock(&r->lock);
+            break;
+        }
+        pthread_mutex_unlock(&r->lock);
+
+        //the buffer belongs to this thread until it is counted as filled
+        ssize_t len = fill_buffer(r, r->buffers[write_index]);
+
+        pthread_mutex_lock(&r->lock);
+        if(len == -1){
+            r->error = true;
+        }else{
+            r->lengths[write_index] = len;
+            r->filled++;
+            r->eof = len < READER_BUFFER_SIZE;
+        }
+        pthread_cond_broadcast(&r->changed);
+        bool done = r->error || r->eof;
+        pthread_mutex_unlock(&r->lock);
+
+        if(done) break;
+        write_index = (write_index + 1) % READER_BUFFERS;
+    }
+
+    return NULL;
+}
+
+/* opens the file at path and starts reading it. returns NULL if it cannot
+   be opened */
+file_reader* reader_open(char* path){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) return NULL;
+
+    file_reader* r = (file_reader*)calloc(1, sizeof(file_reader));
+    r->fd = fd;
+    r->path = path;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->changed, NULL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    //a file which fits in one buffer is read now, without a thread
+    struct stat st;
+    bool stated = fstat(fd, &st) == 0;
+    bool small = stated && st.st_size < READER_BUFFER_SIZE;
+
+    //a file with fewer blocks than its size needs has holes to look for
+    if(stated){
+        r->size = st.st_size;
+        r->sparse = (uint64_t)st.st_blocks*512 < (uint64_t)st.st_size;
+    }
+    int num_buffers = small ? 1 : READER_BUFFERS;
+    for(int i=0; i<num_buffers; i++){
+        if(posix_memalign((void**)&r->buffers[i], READER_ALIGN, READER_BUFFER_SIZE) != 0){
+            syslog(LOG_ERR, "Out of memory to read %s", path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(small){
+        ssize_t len = fill_buffer(r, r->buffers[0]);
+        if(len == -1){
+            r->error = true;
+        }else{
+            r->lengths[0] = len;
+            r->filled = 1;
+            r->eof = true;
+        }
+        //a file which grew past the buffer since it was stat'ed is read as
+        //it was, as the size sent for it was taken before
+        return r;
+    }
+
+    r->threaded = true;
+    if(pthread_create(&r->thread, NULL, read_ahead, r) != 0){
+        syslog(LOG_ERR, "Could not start reading %s", path);
+        exit(EXIT_FAILURE);
+    }
+    return r;
+}
+
+/* copies up to len bytes of the file to dst, waiting for them to be read
+   if they must. returns the bytes copied, which is less than len only at
+   the end of the file, or -1 if the file could not be read */
+ssize_t reader_read(file_reader* r, void* dst, size_t len){
+    size_t copied = 0;
+
+    pthread_mutex_lock(&r->lock);
+    while(copied < len){
+        while(r->filled == 0 && !r->eof && !r->error){
+            pthread_cond_wait(&r->changed, &r->lock);
+        }
+        if(r->filled == 0){
+            //nothing more is coming
+            if(r->error){
+                pthread_mutex_unlock(&r->lock);
+                syslog(LOG_WARNING, "Could not read %s", r->path);
+                return -1;
+            }
+            break;
+        }
+
+        //take what is wanted from the oldest full buffer
+        size_t available = r->lengths[r->read_index] - r->read_pos;
+        size_t take = len - copied < available ? len - copied : available;
+        memcpy((uint8_t*)dst + copied, r->buffers[r->read_index] + r->read_pos, take);
+        copied += take;
+        advance(r, take);
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return copied;
+}
+
+/* takes the run of zero bytes next in the file, up to max of them, if it
+   is at least min long or is all of the max. returns its length, or 0,
+   taking nothing, if it is shorter */
+uint64_t reader_zeros(file_reader* r, uint64_t max, uint64_t min){
+    uint64_t run = 0;
+    int seen = 0;                   //full buffers looked through
+
+    pthread_mutex_lock(&r->lock);
+    size_t pos = r->read_pos;
+    while(run < max){
+        if(seen == r->filled){
+            //the run goes on into a buffer not yet read. it is only waited
+            //for while the run is too short to take and the ring has room
+            if(run >= min || r->eof || r->error || seen == READER_BUFFERS) break;
+            pthread_cond_wait(&r->changed, &r->lock);
+            continue;
+        }
+
+        int index = (r->read_index + seen) % READER_BUFFERS;
+        size_t available = r->lengths[index] - pos;
+        if(max - run < available){
+            available = max - run;
+        }
+        size_t zeros = zero_prefix(r->buffers[index] + pos, available);
+        run += zeros;
+        if(zeros < available) break;
+        seen++;
+        pos = 0;
+    }
+
+    if(run < min && run < max){
+        run = 0;
+    }
+    for(uint64_t taken = 0; taken < run; ){
+        size_t available = r->lengths[r->read_index] - r->read_pos;
+        size_t take = run - taken < available ? run - taken : available;
+        advance(r, take);
+        taken += take;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return run;
+}
+
+/* stops reading and frees r. its reads are added to the calling thread's
+   profile_io_counts, whichever thread made them */
+void reader_close(file_reader* r){
+    if(r->threaded){
+        pthread_mutex_lock(&r->lock);
+        r->stop = true;
+        pthread_cond_broadcast(&r->changed);
+        pthread_mutex_unlock(&r->lock);
+        pthread_join(r->thread, NULL);
+    }
+    profile_io_counts.calls += r->io.calls;
+    profile_io_counts.bytes += r->io.bytes;
+
+    for(int i=0; i<READER_BUFFERS; i++){
+        free(r->buffers[i]);
+    }
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->changed);
+    close(r->fd);
+    free(r);
+}
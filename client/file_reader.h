@@ -0,0 +1,81 @@
+/* DESCRIPTION: Reads a file ahead of the sender. Small files are read
+        whole when they are opened. Larger ones are read by a thread of
+        their own in large reads into a ring of aligned buffers, so the
+        sender takes each datagram's data from memory and does not wait
+        on the disk while the ring has data in it. The holes of a
+        sparse file are found with SEEK_DATA and SEEK_HOLE and filled
+        in with zeros rather than read, and runs of zeros can be taken
+        from the ring by their length alone.                          */
+
+#ifndef FILE_READER_H
+#define FILE_READER_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "profile.h"
+
+#define READER_BUFFERS 4            //buffers in the ring
+#define READER_BUFFER_SIZE 262144   //bytes read at a time
+#define READER_ALIGN 4096           //alignment of each buffer
+
+//a file being read ahead
+typedef struct
+{
+    int fd;
+    char* path;
+    uint8_t* buffers[READER_BUFFERS];
+    size_t lengths[READER_BUFFERS]; //bytes in each buffer
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;         //signalled when a buffer is filled or emptied
+    int filled;                     //buffers holding data not yet taken
+    int read_index;                 //buffer the sender takes from next
+    size_t read_pos;                //bytes already taken from it
+    bool eof;                       //the whole file is in the ring
+    bool error;                     //a read failed
+    bool stop;                      //the sender is done with the file
+
+    uint64_t pos;                   //offset of the next byte to read into the ring
+    uint64_t size;                  //size of the file when it was opened
+    bool sparse;                    //the file has holes, so its extents are looked up
+    uint64_t hole_end;              //where the hole at pos ends, if there is one
+    uint64_t data_end;              //where the data at hole_end ends
+
+    bool threaded;                  //false if the file was read whole on opening
+    pthread_t thread;
+    profile_io io;                  //the reads made, counted as the closer's
+} file_reader;
+
+/* opens the file at path and starts reading it. returns NULL if it cannot
+   be opened */
+file_reader* reader_open(char* path);
+
+/* copies up to len bytes of the file to dst, waiting for them to be read
+   if they must. returns the bytes copied, which is less than len only at
+   the end of the file, or -1 if the file could not be read */
+ssize_t reader_read(file_reader* r, void* dst, size_t len);
+
+/* takes the run of zero bytes next in the file, up to max of them, if it
+   is at least min long or is all of the max. returns its length, or 0,
+   taking nothing, if it is shorter */
+uint64_t reader_zeros(file_reader* r, uint64_t max, uint64_t min);
+
+/* stops reading and frees r. its reads are added to the calling thread's
+   profile_io_counts, whichever thread made them */
+void reader_close(file_reader* r);
+
+#endif /* FILE_READER_H */
@@ -0,0 +1,254 @@
+#include "file_runs.h"
+
+/* returns the path of run n of runs */
+static char* run_path(file_runs* runs, int n){
+    char* path;
+    asprintf(&path, "%s/run-%d", runs->dir, n);
+    return path;
+}
+
+/* takes the number of a new run, creating the directory for the first */
+static int new_run(file_runs* runs){
+    pthread_mutex_lock(&runs->lock);
+    if(runs->dir == NULL){
+        char* tmp_dir = getenv("TMPDIR");
+        asprintf(&runs->dir, "%s/hooli-scan-XXXXXX", tmp_dir != NULL && *tmp_dir != '\0' ? tmp_dir : "/tmp");
+        if(mkdtemp(runs->dir) == NULL){
+            syslog(LOG_ERR, "Could not create %s", runs->dir);
+            exit(EXIT_FAILURE);
+        }
+    }
+    int n = runs->next_run++;
+    pthread_mutex_unlock(&runs->lock);
+    return n;
+}
+
+/* opens the file at path with mode, giving it a buffer of RUN_BUFFER_SIZE,
+   which is set in buffer to be freed once the file is closed */
+static FILE* open_run(char* path, const char* mode, char** buffer){
+    FILE* f = fopen(path, mode);
+    if(f == NULL){
+        syslog(LOG_ERR, "Could not open %s", path);
+        exit(EXIT_FAILURE);
+    }
+    *buffer = (char*)malloc(RUN_BUFFER_SIZE);
+    setvbuf(f, *buffer, _IOFBF, RUN_BUFFER_SIZE);
+    return f;
+}
+
+/* writes a record to the run f, which is at path */
+static void write_record(FILE* f, char* path, const char* filename, uint32_t checksum, uint64_t size, uint8_t flags){
+    uint32_t len = strlen(filename);
+    if(fwrite(&len, sizeof(len), 1, f) != 1 ||
+       fwrite(filename, 1, len, f) != len ||
+       fwrite(&checksum, sizeof(checksum), 1, f) != 1 ||
+       fwrite(&size, sizeof(size), 1, f) != 1 ||
+       fwrite(&flags, sizeof(flags), 1, f) != 1){
+        syslog(LOG_ERR, "Could not write %s", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* reads the next record of cursor. returns false at the end of its run */
+static bool read_record(run_cursor* cursor){
+    uint32_t len;
+    if(fread(&len, sizeof(len), 1, cursor->f) != 1) return false;
+
+    if(len + 1 > cursor->path_size){
+        cursor->path_size = len + 1;
+        cursor->path = (char*)realloc(cursor->path, cursor->path_size);
+    }
+    if(fread(cursor->path, 1, len, cursor->f) != len ||
+       fread(&cursor->checksum, sizeof(cursor->checksum), 1, cursor->f) != 1 ||
+       fread(&cursor->size, sizeof(cursor->size), 1, cursor->f) != 1 ||
+       fread(&cursor->flags, sizeof(cursor->flags), 1, cursor->f) != 1){
+        syslog(LOG_ERR, "A run of the scan was cut short");
+        exit(EXIT_FAILURE);
+    }
+    cursor->path[len] = '\0';
+    return true;
+}
+
+/* orders the records of the index arg by path */
+static int compare_paths(const void* a, const void* b, void* arg){
+    file_index* index = (file_index*)arg;
+    return strcmp(index_path(index, *(const size_t*)a), index_path(index, *(const size_t*)b));
+}
+
+/* returns true if cursor a of reader is at a lesser path than cursor b */
+static bool cursor_less(runs_reader* reader, int a, int b){
+    return strcmp(reader->cursors[a].path, reader->cursors[b].path) < 0;
+}
+
+/* moves the cursor at i of the heap of reader down to its place */
+static void sift_down(runs_reader* reader, int i){
+    int* heap = reader->heap;
+    while(1){
+        int least = i;
+        int left = 2*i + 1;
+        int right = left + 1;
+        if(left < reader->heap_size && cursor_less(reader, heap[left], heap[least])) least = left;
+        if(right < reader->heap_size && cursor_less(reader, heap[right], heap[least])) least = right;
+        if(least == i) return;
+
+        int swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+/* opens runs first up to last of runs to be read in order of path */
+static runs_reader* open_reader(file_runs* runs, int first, int last){
+    runs_reader* reader = (runs_reader*)calloc(1, sizeof(runs_reader));
+    int num_runs = last - first;
+    reader->cursors = (run_cursor*)calloc(num_runs ? num_runs : 1, sizeof(run_cursor));
+    reader->heap = (int*)malloc((num_runs ? num_runs : 1)*sizeof(int));
+
+    for(int i=0; i<num_runs; i++){
+        char* path = run_path(runs, first + i);
+        reader->cursors[i].f = open_run(path, "rb", &reader->cursors[i].buffer);
+        free(path);
+        if(read_record(&reader->cursors[i])){
+            reader->heap[reader->heap_size++] = i;
+        }
+    }
+    for(int i=reader->heap_size/2 - 1; i>=0; i--){
+        sift_down(reader, i);
+    }
+    reader->num_cursors = num_runs;
+    return reader;
+}
+
+/* creates an empty set of runs. their temporary directory is created
+   when the first is written */
+file_runs* runs_create(){
+    file_runs* runs = (file_runs*)calloc(1, sizeof(file_runs));
+    pthread_mutex_init(&runs->lock, NULL);
+    return runs;
+}
+
+/* sorts the records of index by path and writes them to runs as a run */
+void runs_write(file_runs* runs, file_index* index){
+    size_t* order = (size_t*)malloc((index->count ? index->count : 1)*sizeof(size_t));
+    for(size_t i=0; i<index->count; i++){
+        order[i] = i;
+    }
+    qsort_r(order, index->count, sizeof(size_t), compare_paths, index);
+
+    char* path = run_path(runs, new_run(runs));
+    char* buffer;
+    FILE* f = open_run(path, "wb", &buffer);
+    for(size_t i=0; i<index->count; i++){
+        size_t record = order[i];
+        write_record(f, path, index_path(index, record), index->checksums[record], index->sizes[record], index->flags[record]);
+    }
+    if(fclose(f) != 0){
+        syslog(LOG_ERR, "Could not write %s", path);
+        exit(EXIT_FAILURE);
+    }
+    syslog(LOG_DEBUG, "Wrote %lu file(s) to %s", (unsigned long)index->count, path);
+
+    pthread_mutex_lock(&runs->lock);
+    runs->count += index->count;
+    pthread_mutex_unlock(&runs->lock);
+    free(buffer);
+    free(order);
+    free(path);
+}
+
+/* opens every run of runs to be read in order of path */
+runs_reader* runs_open(file_runs* runs){
+    //too many runs would need too many files open and buffers, so the
+    //oldest are merged into one until few enough are left
+    while(runs->next_run - runs->first_run > RUNS_MAX_MERGE){
+        int first = runs->first_run;
+        runs_reader* reader = open_reader(runs, first, first + RUNS_MAX_MERGE);
+        char* path = run_path(runs, new_run(runs));
+        char* buffer;
+        FILE* f = open_run(path, "wb", &buffer);
+
+        char* filename;
+        uint32_t checksum;
+        uint64_t size;
+        uint8_t flags;
+        while(runs_next(reader, &filename, &checksum, &size, &flags)){
+            write_record(f, path, filename, checksum, size, flags);
+        }
+        if(fclose(f) != 0){
+            syslog(LOG_ERR, "Could not write %s", path);
+            exit(EXIT_FAILURE);
+        }
+        runs_close(reader);
+        free(buffer);
+        free(path);
+
+        for(int n=first; n<first + RUNS_MAX_MERGE; n++){
+            path = run_path(runs, n);
+            unlink(path);
+            free(path);
+        }
+        runs->first_run += RUNS_MAX_MERGE;
+    }
+
+    return open_reader(runs, runs->first_run, runs->next_run);
+}
+
+/* sets path, checksum, size and flags to the next record of reader. path
+   is valid until the next call. returns false once every record is read */
+bool runs_next(runs_reader* reader, char** path, uint32_t* checksum, uint64_t* size, uint8_t* flags){
+    while(reader->heap_size > 0){
+        run_cursor* cursor = &reader->cursors[reader->heap[0]];
+
+        //a path in more than one run is only returned once
+        bool repeated = reader->last != NULL && strcmp(cursor->path, reader->last) == 0;
+        if(!repeated){
+            size_t len = strlen(cursor->path) + 1;
+            if(len > reader->last_size){
+                reader->last_size = len;
+                reader->last = (char*)realloc(reader->last, len);
+            }
+            memcpy(reader->last, cursor->path, len);
+            *path = reader->last;
+            *checksum = cursor->checksum;
+            *size = cursor->size;
+            *flags = cursor->flags;
+        }
+
+        //move the cursor on, taking it out of the heap at the end of its run
+        if(!read_record(cursor)){
+            reader->heap[0] = reader->heap[--reader->heap_size];
+        }
+        sift_down(reader, 0);
+        if(!repeated) return true;
+    }
+    return false;
+}
+
+/* closes reader */
+void runs_close(runs_reader* reader){
+    for(int i=0; i<reader->num_cursors; i++){
+        fclose(reader->cursors[i].f);
+        free(reader->cursors[i].buffer);
+        free(reader->cursors[i].path);
+    }
+    free(reader->cursors);
+    free(reader->heap);
+    free(reader->last);
+    free(reader);
+}
+
+/* deletes the runs and frees runs */
+void runs_free(file_runs* runs){
+    for(int n=runs->first_run; n<runs->next_run; n++){
+        char* path = run_path(runs, n);
+        unlink(path);
+        free(path);
+    }
+    if(runs->dir != NULL && rmdir(runs->dir) == -1){
+        syslog(LOG_WARNING, "Could not remove %s", runs->dir);
+    }
+    pthread_mutex_destroy(&runs->lock);
+    free(runs->dir);
+    free(runs);
+}
@@ -0,0 +1,79 @@
+/* DESCRIPTION: Keeps the files of a scan too large for memory on disk.
+        Each time a worker has found enough files, they are sorted by
+        path and written to a temporary file as a run. The runs are
+        read back merged into a single stream sorted by path, so the
+        whole tree can be sent to the hmds in sorted chunks while only
+        a buffer of each run is in memory.                           */
+
+#ifndef FILE_RUNS_H
+#define FILE_RUNS_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "file_index.h"
+
+#define RUN_BUFFER_SIZE 65536   //bytes buffered for each run as it is written or read
+#define RUNS_MAX_MERGE 256      //most runs read at once. more are merged into fewer first
+
+//the runs written by a scan
+typedef struct
+{
+    char* dir;                  //the temporary directory holding the runs, NULL until one is written
+    int first_run;              //the runs are numbered first_run up to next_run
+    int next_run;
+    uint64_t count;             //records in every run
+    pthread_mutex_t lock;
+} file_runs;
+
+//a run being read, at its current record
+typedef struct
+{
+    FILE* f;
+    char* buffer;               //the FILE's buffer
+    char* path;
+    size_t path_size;           //allocated size of path
+    uint32_t checksum;
+    uint64_t size;
+    uint8_t flags;              //INDEX_* flags
+} run_cursor;
+
+//the records of a set of runs, merged in order of path
+typedef struct
+{
+    run_cursor* cursors;
+    int num_cursors;
+    int* heap;                  //the cursors which have a record, by least path
+    int heap_size;
+    char* last;                 //the path last returned
+    size_t last_size;           //allocated size of last
+} runs_reader;
+
+/* creates an empty set of runs. their temporary directory is created
+   when the first is written */
+file_runs* runs_create();
+
+/* sorts the records of index by path and writes them to runs as a run */
+void runs_write(file_runs* runs, file_index* index);
+
+/* opens every run of runs to be read in order of path */
+runs_reader* runs_open(file_runs* runs);
+
+/* sets path, checksum, size and flags to the next record of reader. path
+   is valid until the next call. returns false once every record is read */
+bool runs_next(runs_reader* reader, char** path, uint32_t* checksum, uint64_t* size, uint8_t* flags);
+
+/* closes reader */
+void runs_close(runs_reader* reader);
+
+/* deletes the runs and frees runs */
+void runs_free(file_runs* runs);
+
+#endif /* FILE_RUNS_H */
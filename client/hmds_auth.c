@@ -0,0 +1,148 @@
+#include "hmds_auth.h"
+
+static __thread hmds_auth pending = { .sockfd = -1 };
+
+/* returns the token kept in path, or NULL if none is */
+static char* load_token(char* path){
+    if(path == NULL) return NULL;
+    FILE* f = fopen(path, "r");
+    if(f == NULL) return NULL;
+
+    char* token = NULL;
+    size_t size = 0;
+    ssize_t len = getline(&token, &size, f);
+    fclose(f);
+    if(len <= 0){
+        free(token);
+        return NULL;
+    }
+    token[strcspn(token, "\n")] = '\0';
+    return token;
+}
+
+/* keeps token in path, readable only by the user */
+static void save_token(char* path, char* token){
+    make_parent_dirs(path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd == -1 || dprintf(fd, "%s\n", token) < 0){
+        syslog(LOG_WARNING, "Could not keep the token in %s", path);
+    }
+    if(fd != -1){
+        close(fd);
+    }
+}
+
+/* reads the reply to the outstanding AUTH, setting its token */
+static void read_auth_reply(){
+    profile_span span;
+    profile_begin(&span);
+    char* auth_rsp = recv_message(pending.sockfd);
+    profile_end(&span, PROFILE_AUTH);
+    pending.received = true;
+    pending.token = NULL;
+    if(auth_rsp == NULL){
+        syslog(LOG_WARNING, "The hmds closed the connection");
+        return;
+    }
+
+    //get the response status
+    int i = 0;
+    char* status = readuntil(auth_rsp, ' ', &i);
+    readuntil(auth_rsp, '\n', &i);
+
+    if(strcmp(status, "200")==0){
+        syslog(LOG_INFO, "Authentication successful");
+
+        //get token from headers
+        while(auth_rsp[i] != '\n'){
+            char* key = readuntil(auth_rsp, ':', &i);
+            char* value = readuntil(auth_rsp, '\n', &i);
+            if(strcmp(key, "Token")==0){
+                pending.token = value;
+            }else{
+                free(value);
+            }
+            free(key);
+        }
+    }else{
+        syslog(LOG_INFO, "Authentication unsuccessful");
+    }
+
+    //a token other than the one kept replaces it
+    if(pending.token != NULL && pending.token_file != NULL &&
+       (pending.cached == NULL || strcmp(pending.token, pending.cached) != 0)){
+        save_token(pending.token_file, pending.token);
+    }
+    free(status);
+    free(auth_rsp);
+}
+
+/* returns the path of the file the token of username on the hmds at
+   hostname and port is kept in */
+char* token_path(char* username, char* hostname, char* port){
+    //kept next to the scan cache, named for the server rather than a directory
+    char* server;
+    asprintf(&server, "%s:%s", hostname, port);
+    char* path = cache_path(username, server);
+    strcpy(path + strlen(path) - strlen("idx"), "tok");
+    free(server);
+    return path;
+}
+
+/* sends an AUTH for username over sockfd, with the token kept in
+   token_file if there is one, and returns without waiting for its reply.
+   token_file may be NULL for no token to be kept */
+void auth_send(int sockfd, char* username, char* password, char* token_file){
+    pending.sockfd = sockfd;
+    pending.received = false;
+    pending.token = NULL;
+    pending.token_file = token_file;
+    pending.cached = load_token(token_file);
+
+    //the hmds gives the same token back while it is still valid
+    char* auth_req;
+    if(pending.cached != NULL){
+        asprintf(&auth_req, "AUTH\nUsername:%s\nPassword:%s\nToken:%s\n\n", username, password, pending.cached);
+    }else{
+        asprintf(&auth_req, "AUTH\nUsername:%s\nPassword:%s\n\n", username, password);
+    }
+    syslog(LOG_DEBUG, "Sending credentials");
+
+    profile_span span;
+    profile_begin(&span);
+    size_t len = strlen(auth_req);
+    tcp_counts.calls++;
+    tcp_counts.bytes += len;
+    if(send(sockfd, auth_req, len, 0) == -1){
+        syslog(LOG_ERR, "%s", "Unable to send");
+        exit(EXIT_FAILURE);
+    }
+    profile_count(&span, PROFILE_AUTH);
+    free(auth_req);
+}
+
+/* returns the token given in reply to the AUTH sent over sockfd, reading
+   the reply if the first request's has not been, or NULL if the user was
+   not authenticated. called once for each auth_send() */
+char* auth_receive(int sockfd){
+    if(pending.sockfd != sockfd) return NULL;
+    if(!pending.received){
+        read_auth_reply();
+    }
+
+    char* token = pending.token;
+    free(pending.cached);
+    pending.sockfd = -1;
+    pending.token = NULL;
+    pending.cached = NULL;
+    return token;
+}
+
+/* receives a reply from the hmds over sockfd, first reading the reply to
+   an AUTH sent ahead of the request */
+char* recv_reply(int sockfd){
+    if(pending.sockfd == sockfd && !pending.received){
+        read_auth_reply();
+    }
+    return recv_message(sockfd);
+}
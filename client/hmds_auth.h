@@ -0,0 +1,56 @@
+/* DESCRIPTION: Authenticates with the hmds without a round trip of its
+        own. The AUTH is sent without waiting for its reply, so the
+        first request of the connection follows it in the same
+        flight, without a token; the hmds takes it as made by the
+        user the AUTH was for. Its reply is read ahead of the first
+        request's. The token the hmds gives is kept in a file next to
+        the scan cache and sent with the next AUTH, so a token which
+        is still valid is reused rather than another one made.      */
+
+#ifndef HMDS_AUTH_H
+#define HMDS_AUTH_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "../common/socketutils.h"
+#include "scan_cache.h"
+#include "restore.h"
+#include "profile.h"
+
+//an AUTH sent over a connection whose reply may not have been read
+typedef struct
+{
+    int sockfd;                 //the connection, -1 if no AUTH is outstanding
+    bool received;              //its reply has been read
+    char* token;                //the token it gave, NULL if it was refused
+    char* cached;               //the token sent with it, NULL if none was
+    char* token_file;           //where the token is kept, NULL if it is not
+} hmds_auth;
+
+/* returns the path of the file the token of username on the hmds at
+   hostname and port is kept in */
+char* token_path(char* username, char* hostname, char* port);
+
+/* sends an AUTH for username over sockfd, with the token kept in
+   token_file if there is one, and returns without waiting for its reply.
+   token_file may be NULL for no token to be kept */
+void auth_send(int sockfd, char* username, char* password, char* token_file);
+
+/* returns the token given in reply to the AUTH sent over sockfd, reading
+   the reply if the first request's has not been, or NULL if the user was
+   not authenticated. called once for each auth_send() */
+char* auth_receive(int sockfd);
+
+/* receives a reply from the hmds over sockfd, first reading the reply to
+   an AUTH sent ahead of the request */
+char* recv_reply(int sockfd);
+
+#endif /* HMDS_AUTH_H */
@@ -0,0 +1,464 @@
+#include "ignore.h"
+
+/* adds byte c to the bitmap bytes */
+static void set_byte(uint8_t* bytes, unsigned char c){
+    bytes[c >> 3] |= 1 << (c & 7);
+}
+
+/* returns true if byte c is in the bitmap bytes */
+static bool has_byte(const uint8_t* bytes, unsigned char c){
+    return bytes[c >> 3] & (1 << (c & 7));
+}
+
+/* sets the bitmap bytes to every byte but a '/', which only the pattern
+   itself can match */
+static void set_name_bytes(uint8_t* bytes){
+    memset(bytes, 0xff, 32);
+    bytes['/' >> 3] &= ~(1 << ('/' & 7));
+}
+
+/* adds a state with no edges to rules, returning it */
+static int add_nfa(ignore_rules* rules){
+    if(rules->num_nfa == rules->nfa_size){
+        rules->nfa_size = rules->nfa_size ? rules->nfa_size*2 : 64;
+        rules->nfa = (ignore_nfa*)realloc(rules->nfa, rules->nfa_size*sizeof(ignore_nfa));
+    }
+    ignore_nfa* state = &rules->nfa[rules->num_nfa];
+    memset(state->bytes, 0, sizeof(state->bytes));
+    state->next = -1;
+    state->eps[0] = state->eps[1] = -1;
+    state->rule = -1;
+    return rules->num_nfa++;
+}
+
+/* returns the index of the ']' closing the class which starts at p[i],
+   or 0 if it is not closed */
+static size_t class_end(const char* p, size_t i){
+    size_t j = i + 1;
+    if(p[j] == '!' || p[j] == '^') j++;
+    if(p[j] == ']') j++;
+    while(p[j] != '\0' && p[j] != ']') j++;
+    return p[j] == ']' ? j : 0;
+}
+
+/* fills bytes with the class from p[i], a '[', to p[end], its ']' */
+static void compile_class(uint8_t* bytes, const char* p, size_t i, size_t end){
+    size_t j = i + 1;
+    bool negated = p[j] == '!' || p[j] == '^';
+    if(negated) j++;
+
+    //a ']' first in the class is one of its bytes
+    do{
+        unsigned char first = p[j];
+        unsigned char last = first;
+        if(p[j+1] == '-' && j + 2 < end){
+            last = p[j+2];
+            j += 2;
+        }
+        for(int c=first; c<=last; c++){
+            set_byte(bytes, c);
+        }
+        j++;
+    }while(j < end);
+
+    if(negated){
+        for(int k=0; k<32; k++){
+            bytes[k] = ~bytes[k];
+        }
+    }
+    bytes['/' >> 3] &= ~(1 << ('/' & 7));
+}
+
+/* compiles pattern, which is matched against whole paths from the
+   directory of the .hooliignore, into states for rule */
+static void compile_rule(ignore_rules* rules, const char* p, int rule){
+    int cur = add_nfa(rules);
+    rules->starts[rule] = cur;
+
+    size_t i = 0;
+    while(p[i] != '\0'){
+        //a "**" which is a whole part of the path may match a '/'
+        if(p[i] == '*' && p[i+1] == '*' && (i == 0 || p[i-1] == '/') && (p[i+2] == '/' || p[i+2] == '\0')){
+            if(p[i+2] == '/'){
+                //"**/" matches no directories, or any number of them
+                int after = add_nfa(rules);
+                int any = add_nfa(rules);
+                int slash = add_nfa(rules);
+                rules->nfa[cur].eps[0] = after;
+                rules->nfa[cur].eps[1] = any;
+                memset(rules->nfa[any].bytes, 0xff, 32);
+                rules->nfa[any].next = any;
+                rules->nfa[any].eps[0] = slash;
+                set_byte(rules->nfa[slash].bytes, '/');
+                rules->nfa[slash].next = after;
+                cur = after;
+                i += 3;
+            }else{
+                //a "**" at the end matches everything inside
+                int any = add_nfa(rules);
+                memset(rules->nfa[cur].bytes, 0xff, 32);
+                rules->nfa[cur].next = any;
+                memset(rules->nfa[any].bytes, 0xff, 32);
+                rules->nfa[any].next = any;
+                cur = any;
+                i += 2;
+            }
+            continue;
+        }
+
+        int next = add_nfa(rules);
+        ignore_nfa* state = &rules->nfa[cur];
+        size_t end;
+        if(p[i] == '*'){
+            //any run of bytes in a name. more '*'s add nothing
+            while(p[i] == '*') i++;
+            set_name_bytes(state->bytes);
+            state->next = cur;
+            state->eps[0] = next;
+        }else if(p[i] == '?'){
+            set_name_bytes(state->bytes);
+            state->next = next;
+            i++;
+        }else if(p[i] == '[' && (end = class_end(p, i)) != 0){
+            compile_class(state->bytes, p, i, end);
+            state->next = next;
+            i = end + 1;
+        }else{
+            if(p[i] == '\\' && p[i+1] != '\0') i++;
+            set_byte(state->bytes, p[i]);
+            state->next = next;
+            i++;
+        }
+        cur = next;
+    }
+
+    rules->nfa[cur].rule = rule;
+}
+
+/* adds the rule on line to rules, if it is one */
+static void add_rule(ignore_rules* rules, char* line){
+    //trailing spaces are dropped unless they are escaped
+    size_t len = strcspn(line, "\r\n");
+    while(len > 0 && line[len-1] == ' ' && !(len > 1 && line[len-2] == '\\')) len--;
+    line[len] = '\0';
+    if(len == 0 || line[0] == '#') return;
+
+    bool negated = false;
+    if(line[0] == '!'){
+        negated = true;
+        line++;
+        len--;
+    }else if(line[0] == '\\' && (line[1] == '!' || line[1] == '#')){
+        line++;
+        len--;
+    }
+
+    bool dir_only = false;
+    if(len > 0 && line[len-1] == '/'){
+        dir_only = true;
+        line[--len] = '\0';
+    }
+    if(len == 0) return;
+
+    //a pattern with a '/' in it is matched from the directory of the
+    //.hooliignore, and one without is matched against names at any depth
+    char* pattern;
+    if(strchr(line, '/') != NULL){
+        pattern = strdup(line[0] == '/' ? line + 1 : line);
+    }else{
+        asprintf(&pattern, "**/%s", line);
+    }
+
+    int rule = rules->num_rules++;
+    rules->starts = (int*)realloc(rules->starts, rules->num_rules*sizeof(int));
+    rules->negated = (bool*)realloc(rules->negated, rules->num_rules*sizeof(bool));
+    rules->dir_only = (bool*)realloc(rules->dir_only, rules->num_rules*sizeof(bool));
+    rules->negated[rule] = negated;
+    rules->dir_only[rule] = dir_only;
+    compile_rule(rules, pattern, rule);
+    free(pattern);
+}
+
+/* adds state and the states reached from it without a byte to the set
+   being built in rules->stack */
+static void add_closure(ignore_rules* rules, int state, int* count){
+    if(state == -1 || rules->seen[state]) return;
+    rules->seen[state] = 1;
+    rules->stack[(*count)++] = state;
+    add_closure(rules, rules->nfa[state].eps[0], count);
+    add_closure(rules, rules->nfa[state].eps[1], count);
+}
+
+/* orders states */
+static int compare_states(const void* a, const void* b){
+    return *(const int*)a - *(const int*)b;
+}
+
+/* returns the deterministic state for the count states in rules->stack,
+   adding it if it is new. called with the lock held */
+static ignore_state* find_state(ignore_rules* rules, int count){
+    int* set = rules->stack;
+    for(int i=0; i<count; i++){
+        rules->seen[set[i]] = 0;
+    }
+    qsort(set, count, sizeof(int), compare_states);
+
+    uint64_t hash = 14695981039346656037ULL;
+    for(int i=0; i<count; i++){
+        hash = (hash ^ (uint64_t)set[i]) * 1099511628211ULL;
+    }
+
+    size_t bucket = hash & (rules->num_buckets - 1);
+    for(ignore_state* state = rules->buckets[bucket]; state != NULL; state = state->chain){
+        if(state->hash == hash && state->set_size == count && memcmp(state->set, set, count*sizeof(int)) == 0){
+            return state;
+        }
+    }
+
+    //a new state. the last rule to match decides, and a rule for
+    //directories only does not decide for a file
+    ignore_state* state = (ignore_state*)calloc(1, sizeof(ignore_state));
+    state->set = (int*)malloc((count ? count : 1)*sizeof(int));
+    memcpy(state->set, set, count*sizeof(int));
+    state->set_size = count;
+    state->hash = hash;
+    int file_rule = -1;
+    int dir_rule = -1;
+    for(int i=0; i<count; i++){
+        int rule = rules->nfa[set[i]].rule;
+        if(rule == -1) continue;
+        if(rule > dir_rule) dir_rule = rule;
+        if(rule > file_rule && !rules->dir_only[rule]) file_rule = rule;
+    }
+    state->file_verdict = file_rule == -1 ? IGNORE_NONE : rules->negated[file_rule] ? IGNORE_INCLUDE : IGNORE_EXCLUDE;
+    state->dir_verdict = dir_rule == -1 ? IGNORE_NONE : rules->negated[dir_rule] ? IGNORE_INCLUDE : IGNORE_EXCLUDE;
+
+    state->chain = rules->buckets[bucket];
+    rules->buckets[bucket] = state;
+    rules->num_states++;
+
+    //keep the chains short
+    if(rules->num_states > rules->num_buckets*2){
+        size_t num_buckets = rules->num_buckets*2;
+        ignore_state** buckets = (ignore_state**)calloc(num_buckets, sizeof(ignore_state*));
+        for(size_t i=0; i<rules->num_buckets; i++){
+            ignore_state* next;
+            for(ignore_state* s = rules->buckets[i]; s != NULL; s = next){
+                next = s->chain;
+                s->chain = buckets[s->hash & (num_buckets - 1)];
+                buckets[s->hash & (num_buckets - 1)] = s;
+            }
+        }
+        free(rules->buckets);
+        rules->buckets = buckets;
+        rules->num_buckets = num_buckets;
+    }
+    return state;
+}
+
+/* compiles the rules of the .hooliignore in the directory open at dirfd.
+   returns NULL if there is none, or it has no rules */
+ignore_rules* ignore_load(int dirfd){
+    int fd = openat(dirfd, IGNORE_FILE, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) return NULL;
+    FILE* f = fdopen(fd, "r");
+    if(f == NULL){
+        close(fd);
+        return NULL;
+    }
+
+    ignore_rules* rules = (ignore_rules*)calloc(1, sizeof(ignore_rules));
+    char* line = NULL;
+    size_t size = 0;
+    while(getline(&line, &size, f) != -1){
+        add_rule(rules, line);
+    }
+    free(line);
+    fclose(f);
+
+    if(rules->num_rules == 0){
+        free(rules->nfa);
+        free(rules);
+        return NULL;
+    }
+
+    //the first state is every rule's first state
+    pthread_mutex_init(&rules->lock, NULL);
+    rules->num_buckets = 64;
+    rules->buckets = (ignore_state**)calloc(rules->num_buckets, sizeof(ignore_state*));
+    rules->stack = (int*)malloc(rules->num_nfa*sizeof(int));
+    rules->seen = (uint8_t*)calloc(rules->num_nfa, 1);
+    int count = 0;
+    for(int i=0; i<rules->num_rules; i++){
+        add_closure(rules, rules->starts[i], &count);
+    }
+    rules->start = find_state(rules, count);
+    atomic_init(&rules->refs, 1);
+    return rules;
+}
+
+/* drops a reference to rules, freeing them with the last */
+void ignore_release(ignore_rules* rules){
+    if(atomic_fetch_sub(&rules->refs, 1) != 1) return;
+
+    for(size_t i=0; i<rules->num_buckets; i++){
+        ignore_state* next;
+        for(ignore_state* state = rules->buckets[i]; state != NULL; state = next){
+            next = state->chain;
+            free(state->set);
+            free(state);
+        }
+    }
+    pthread_mutex_destroy(&rules->lock);
+    free(rules->buckets);
+    free(rules->stack);
+    free(rules->seen);
+    free(rules->nfa);
+    free(rules->starts);
+    free(rules->negated);
+    free(rules->dir_only);
+    free(rules);
+}
+
+/* returns the state reached from state on the bytes of str */
+ignore_state* ignore_step(ignore_rules* rules, ignore_state* state, const char* str){
+    for(const unsigned char* c = (const unsigned char*)str; *c != '\0'; c++){
+        //no rule can match from the empty set
+        if(state->set_size == 0) return state;
+
+        ignore_state* next = atomic_load_explicit(&state->next[*c], memory_order_acquire);
+        if(next == NULL){
+            //the first time this byte is seen here, the states it leads to
+            //are found and the step is kept for every thread
+            pthread_mutex_lock(&rules->lock);
+            next = atomic_load_explicit(&state->next[*c], memory_order_relaxed);
+            if(next == NULL){
+                int count = 0;
+                for(int i=0; i<state->set_size; i++){
+                    ignore_nfa* s = &rules->nfa[state->set[i]];
+                    if(s->next != -1 && has_byte(s->bytes, *c)){
+                        add_closure(rules, s->next, &count);
+                    }
+                }
+                next = find_state(rules, count);
+                atomic_store_explicit(&state->next[*c], next, memory_order_release);
+            }
+            pthread_mutex_unlock(&rules->lock);
+        }
+        state = next;
+    }
+    return state;
+}
+
+/* adds a level matching rules from state to ctx, which may be NULL.
+   returns the context */
+static ignore_context* add_level(ignore_context* ctx, ignore_rules* rules, ignore_state* state){
+    if(ctx == NULL){
+        ctx = (ignore_context*)calloc(1, sizeof(ignore_context));
+    }
+    ctx->rules = (ignore_rules**)realloc(ctx->rules, (ctx->num_levels + 1)*sizeof(ignore_rules*));
+    ctx->states = (ignore_state**)realloc(ctx->states, (ctx->num_levels + 1)*sizeof(ignore_state*));
+    ctx->rules[ctx->num_levels] = rules;
+    ctx->states[ctx->num_levels] = state;
+    ctx->num_levels++;
+    return ctx;
+}
+
+/* adds the rules of the .hooliignore in the directory open at dirfd to
+   ctx, the context of its entries, which may be NULL. returns the context */
+ignore_context* ignore_enter(ignore_context* ctx, int dirfd){
+    ignore_rules* rules = ignore_load(dirfd);
+    if(rules == NULL) return ctx;
+    return add_level(ctx, rules, rules->start);
+}
+
+/* returns true if the entry called name in the directory of ctx is left
+   out. if child is not NULL and the entry is a directory which is not,
+   child is set to the context of the entries in it, or NULL if no rules
+   apply to them */
+bool ignore_match(ignore_context* ctx, const char* name, bool is_dir, ignore_context** child){
+    if(child != NULL) *child = NULL;
+    if(ctx == NULL) return false;
+
+    //the rules of a directory override those of the directories above it
+    ignore_state* reached[ctx->num_levels];
+    int verdict = IGNORE_NONE;
+    for(int i=0; i<ctx->num_levels; i++){
+        reached[i] = ignore_step(ctx->rules[i], ctx->states[i], name);
+        int level_verdict = is_dir ? reached[i]->dir_verdict : reached[i]->file_verdict;
+        if(level_verdict != IGNORE_NONE) verdict = level_verdict;
+    }
+    if(verdict == IGNORE_EXCLUDE) return true;
+
+    //the entries of a directory go on from its path and a '/'. the rules
+    //which can no longer match are left behind
+    if(is_dir && child != NULL){
+        for(int i=0; i<ctx->num_levels; i++){
+            ignore_state* state = ignore_step(ctx->rules[i], reached[i], "/");
+            if(state->set_size == 0) continue;
+            atomic_fetch_add(&ctx->rules[i]->refs, 1);
+            *child = add_level(*child, ctx->rules[i], state);
+        }
+    }
+    return false;
+}
+
+/* frees ctx, which may be NULL */
+void ignore_context_free(ignore_context* ctx){
+    if(ctx == NULL) return;
+    for(int i=0; i<ctx->num_levels; i++){
+        ignore_release(ctx->rules[i]);
+    }
+    free(ctx->rules);
+    free(ctx->states);
+    free(ctx);
+}
+
+/* returns true if relative_path, below root_dir, is left out by the rules
+   of the directories above it. a directory's path ends with a '/'. if
+   child is not NULL and a directory is not left out, child is set as
+   ignore_match() sets it */
+bool ignore_path(char* root_dir, char* relative_path, ignore_context** child){
+    if(child != NULL) *child = NULL;
+    int fd = open(root_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1) return false;
+
+    //match each part of the path in turn, taking in the rules of each
+    //directory on the way
+    ignore_context* ctx = ignore_enter(NULL, fd);
+    char* path = strdup(relative_path);
+    char* name = path;
+    bool ignored = false;
+    while(*name != '\0'){
+        char* slash = strchr(name, '/');
+        bool is_dir = slash != NULL;
+        if(is_dir) *slash = '\0';
+
+        ignore_context* next;
+        ignored = ignore_match(ctx, name, is_dir, &next);
+        ignore_context_free(ctx);
+        ctx = next;
+        if(ignored || !is_dir) break;
+
+        if(slash[1] == '\0'){
+            //the path's own directory. its rules apply to its entries
+            if(child != NULL){
+                *child = ctx;
+                ctx = NULL;
+            }
+            break;
+        }
+
+        int sub = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        fd = sub;
+        if(fd == -1) break;
+        ctx = ignore_enter(ctx, fd);
+        name = slash + 1;
+    }
+
+    if(fd != -1) close(fd);
+    ignore_context_free(ctx);
+    free(path);
+    return ignored;
+}
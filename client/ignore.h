@@ -0,0 +1,114 @@
+/* DESCRIPTION: Leaves files out of the sync by the rules of the
+        .hooliignore files in the Hooli directory, which are written
+        as .gitignore files are. The rules of each .hooliignore are
+        compiled together into one automaton, which is made
+        deterministic a state at a time as paths are matched against
+        it, so however many rules there are, matching a name costs a
+        table lookup per byte. Each directory being scanned carries
+        the states its path reached in the automata of the
+        directories above it, so only the names in it are matched,
+        and a directory which is ignored is never opened.            */
+
+#ifndef IGNORE_H
+#define IGNORE_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define IGNORE_FILE ".hooliignore"  //the name of the files holding the rules
+#define IGNORE_NONE 0               //no rule matched
+#define IGNORE_EXCLUDE 1            //the last rule to match leaves the path out
+#define IGNORE_INCLUDE 2            //the last rule to match was negated with a '!'
+
+//a state of a rule's automaton, before it is made deterministic
+typedef struct
+{
+    uint8_t bytes[32];          //bitmap of the bytes which lead to next
+    int next;                   //-1 if no byte does
+    int eps[2];                 //states reached without a byte, or -1
+    int rule;                   //the rule matched in this state, or -1
+} ignore_nfa;
+
+//a state of the deterministic automaton: a set of ignore_nfa states
+typedef struct ignore_state
+{
+    _Atomic(struct ignore_state*) next[256]; //the state after each byte, NULL until it is needed
+    int* set;                   //the ignore_nfa states, in order
+    int set_size;
+    uint8_t file_verdict;       //IGNORE_* for a file whose path ends here
+    uint8_t dir_verdict;        //IGNORE_* for a directory whose path ends here
+    uint64_t hash;              //of set
+    struct ignore_state* chain; //the next state in the same bucket
+} ignore_state;
+
+//the compiled rules of one .hooliignore
+typedef struct
+{
+    ignore_nfa* nfa;
+    int num_nfa;
+    int nfa_size;               //allocated size of nfa
+    int* starts;                //the first state of each rule
+    bool* negated;              //each rule began with a '!'
+    bool* dir_only;             //each rule ended with a '/'
+    int num_rules;
+
+    //the deterministic states found so far. they are only added under the
+    //lock, and next[] is read without it
+    pthread_mutex_t lock;
+    ignore_state** buckets;
+    size_t num_buckets;
+    size_t num_states;
+    ignore_state* start;
+    int* stack;                 //room to find sets in, under the lock
+    uint8_t* seen;
+    atomic_int refs;
+} ignore_rules;
+
+//the rules which apply to the entries of a directory, and the state the
+//directory's path has reached in each, from the outermost in
+typedef struct
+{
+    int num_levels;
+    ignore_rules** rules;
+    ignore_state** states;
+} ignore_context;
+
+/* compiles the rules of the .hooliignore in the directory open at dirfd.
+   returns NULL if there is none, or it has no rules */
+ignore_rules* ignore_load(int dirfd);
+
+/* drops a reference to rules, freeing them with the last */
+void ignore_release(ignore_rules* rules);
+
+/* returns the state reached from state on the bytes of str */
+ignore_state* ignore_step(ignore_rules* rules, ignore_state* state, const char* str);
+
+/* adds the rules of the .hooliignore in the directory open at dirfd to
+   ctx, the context of its entries, which may be NULL. returns the context */
+ignore_context* ignore_enter(ignore_context* ctx, int dirfd);
+
+/* returns true if the entry called name in the directory of ctx is left
+   out. if child is not NULL and the entry is a directory which is not,
+   child is set to the context of the entries in it, or NULL if no rules
+   apply to them */
+bool ignore_match(ignore_context* ctx, const char* name, bool is_dir, ignore_context** child);
+
+/* frees ctx, which may be NULL */
+void ignore_context_free(ignore_context* ctx);
+
+/* returns true if relative_path, below root_dir, is left out by the rules
+   of the directories above it. a directory's path ends with a '/'. if
+   child is not NULL and a directory is not left out, child is set as
+   ignore_match() sets it */
+bool ignore_path(char* root_dir, char* relative_path, ignore_context** child);
+
+#endif /* IGNORE_H */
@@ -0,0 +1,152 @@
+#include "profile.h"
+
+__thread profile_io profile_io_counts;
+
+static bool enabled = false;
+static int64_t enabled_ns;                  //when profiling was turned on
+static profile_stage stages[PROFILE_STAGES];
+static profile_bucket buckets[PROFILE_SIZE_BUCKETS];
+static const char* stage_names[PROFILE_STAGES] = {"scan", "auth", "list", "tree", "upload"};
+
+/* returns the monotonic time in ns */
+static int64_t now_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000000LL + now.tv_nsec;
+}
+
+/* adds value to counter */
+static void add(atomic_uint_fast64_t* counter, uint64_t value){
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+/* returns the value of counter */
+static uint64_t get(atomic_uint_fast64_t* counter){
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/* returns the largest size held by bucket i, or 0 for the last, which
+   holds the rest */
+static uint64_t bucket_limit(int i){
+    return i < PROFILE_SIZE_BUCKETS - 1 ? 4096ULL << (4*i) : 0;
+}
+
+/* turns profiling on. until it is, nothing is recorded */
+void profile_enable(){
+    enabled = true;
+    enabled_ns = now_ns();
+}
+
+/* returns true if profiling is on */
+bool profile_enabled(){
+    return enabled;
+}
+
+/* starts span on the calling thread */
+void profile_begin(profile_span* span){
+    if(!enabled) return;
+    span->started_ns = now_ns();
+    span->tcp = tcp_counts;
+    span->udp = udp_counts;
+    span->io = profile_io_counts;
+}
+
+/* adds the time since span began and the calling thread's I/O since then
+   to stage, as one call */
+void profile_end(profile_span* span, int stage){
+    profile_time(span, stage);
+    profile_count(span, stage);
+}
+
+/* adds only the calling thread's I/O since span began to stage, for work
+   which is timed as a whole elsewhere */
+void profile_count(profile_span* span, int stage){
+    if(!enabled) return;
+    profile_stage* s = &stages[stage];
+    add(&s->net_bytes, (tcp_counts.bytes - span->tcp.bytes) + (udp_counts.bytes - span->udp.bytes));
+    add(&s->read_bytes, profile_io_counts.bytes - span->io.bytes);
+    add(&s->syscalls, (tcp_counts.calls - span->tcp.calls) + (udp_counts.calls - span->udp.calls) +
+                      (profile_io_counts.calls - span->io.calls));
+    add(&s->retransmits, udp_counts.retransmits - span->udp.retransmits);
+}
+
+/* adds only the time since span began to stage, as one call, for work
+   whose I/O is counted by profile_count() on other threads */
+void profile_time(profile_span* span, int stage){
+    if(!enabled) return;
+    add(&stages[stage].calls, 1);
+    add(&stages[stage].ns, now_ns() - span->started_ns);
+}
+
+/* adds the upload of a file of size bytes, which began at span, to the
+   upload stage and to the bucket for its size */
+void profile_file(profile_span* span, uint64_t size){
+    if(!enabled) return;
+    int64_t ns = now_ns() - span->started_ns;
+    profile_end(span, PROFILE_UPLOAD);
+
+    int i = 0;
+    while(i < PROFILE_SIZE_BUCKETS - 1 && size >= bucket_limit(i)){
+        i++;
+    }
+    profile_bucket* b = &buckets[i];
+    add(&b->files, 1);
+    add(&b->bytes, size);
+    add(&b->ns, ns);
+    add(&b->retransmits, udp_counts.retransmits - span->udp.retransmits);
+
+    //bucket j of the histogram holds the files sent in 2^j us up to 2^(j+1)
+    uint64_t us = ns/1000;
+    int j = us > 1 ? 63 - __builtin_clzll(us) : 0;
+    add(&b->latency[j < PROFILE_LATENCY_BUCKETS ? j : PROFILE_LATENCY_BUCKETS - 1], 1);
+}
+
+/* writes the report as JSON to path, or to stdout if path is "-" */
+void profile_write(char* path){
+    if(!enabled) return;
+    FILE* f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if(f == NULL){
+        syslog(LOG_WARNING, "Could not write profile %s", path);
+        return;
+    }
+
+    fprintf(f, "{\n  \"wall_ms\": %.3f,\n  \"stages\": {\n", (now_ns() - enabled_ns)/1e6);
+    for(int i=0; i<PROFILE_STAGES; i++){
+        profile_stage* s = &stages[i];
+        fprintf(f, "    \"%s\": {\"calls\": %lu, \"ms\": %.3f, \"net_bytes\": %lu, \"read_bytes\": %lu, "
+                   "\"syscalls\": %lu, \"retransmits\": %lu}%s\n",
+                stage_names[i], (unsigned long)get(&s->calls), get(&s->ns)/1e6,
+                (unsigned long)get(&s->net_bytes), (unsigned long)get(&s->read_bytes),
+                (unsigned long)get(&s->syscalls), (unsigned long)get(&s->retransmits),
+                i < PROFILE_STAGES - 1 ? "," : "");
+    }
+
+    //each bucket's histogram only lists the latencies some file took
+    fprintf(f, "  },\n  \"files\": [\n");
+    for(int i=0; i<PROFILE_SIZE_BUCKETS; i++){
+        profile_bucket* b = &buckets[i];
+        if(bucket_limit(i) != 0){
+            fprintf(f, "    {\"below_bytes\": %lu, ", (unsigned long)bucket_limit(i));
+        }else{
+            fprintf(f, "    {\"below_bytes\": null, ");
+        }
+        fprintf(f, "\"files\": %lu, \"bytes\": %lu, \"ms\": %.3f, \"retransmits\": %lu, \"latency_us\": {",
+                (unsigned long)get(&b->files), (unsigned long)get(&b->bytes), get(&b->ns)/1e6,
+                (unsigned long)get(&b->retransmits));
+        bool first = true;
+        for(int j=0; j<PROFILE_LATENCY_BUCKETS; j++){
+            uint64_t count = get(&b->latency[j]);
+            if(count == 0) continue;
+            fprintf(f, "%s\"%llu\": %lu", first ? "" : ", ", 2ULL << j, (unsigned long)count);
+            first = false;
+        }
+        fprintf(f, "}}%s\n", i < PROFILE_SIZE_BUCKETS - 1 ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+
+    if(f == stdout){
+        fflush(f);
+    }else if(fclose(f) != 0){
+        syslog(LOG_WARNING, "Could not write profile %s", path);
+    }
+}
@@ -0,0 +1,106 @@
+/* DESCRIPTION: Profiles a sync, when it is asked to with --profile, so
+        a slow one can be told apart from a slow network or disk
+        without a profiler. Each stage of the sync adds up its calls,
+        its time on the monotonic clock, the bytes it moved over the
+        network and read from disk, its I/O calls and its
+        retransmits. The I/O is counted per thread, so a span taken
+        on one thread is not charged for another's. Each file
+        uploaded is also added to a bucket by its size, with a
+        histogram of how long it took. The report is written as JSON
+        once the sync is done.                                       */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "../common/socketutils.h"
+#include "../common/udp_sockets.h"
+
+//the stages of a sync
+#define PROFILE_SCAN 0          //walking the directory and hashing files
+#define PROFILE_AUTH 1          //AUTH requests to the hmds
+#define PROFILE_LIST 2          //LIST requests to the hmds
+#define PROFILE_TREE 3          //TREE requests to the hmds
+#define PROFILE_UPLOAD 4        //sending files to the hftpd
+#define PROFILE_STAGES 5
+
+#define PROFILE_SIZE_BUCKETS 6      //files under 4 KiB, then each bucket 16 times larger, then the rest
+#define PROFILE_LATENCY_BUCKETS 32  //bucket i holds files sent in under 2^(i+1) us
+
+//the file I/O the calling thread has done, alongside its socket counters
+typedef struct
+{
+    uint64_t calls;
+    uint64_t bytes;
+} profile_io;
+
+extern __thread profile_io profile_io_counts;
+
+//what a stage has done
+typedef struct
+{
+    atomic_uint_fast64_t calls;
+    atomic_uint_fast64_t ns;
+    atomic_uint_fast64_t net_bytes;     //sent and received
+    atomic_uint_fast64_t read_bytes;    //read from files
+    atomic_uint_fast64_t syscalls;      //reads, sends, receives and polls
+    atomic_uint_fast64_t retransmits;
+} profile_stage;
+
+//the files uploaded in a range of sizes
+typedef struct
+{
+    atomic_uint_fast64_t files;
+    atomic_uint_fast64_t bytes;
+    atomic_uint_fast64_t ns;
+    atomic_uint_fast64_t retransmits;
+    atomic_uint_fast64_t latency[PROFILE_LATENCY_BUCKETS];
+} profile_bucket;
+
+//the start of something being profiled, on one thread
+typedef struct
+{
+    int64_t started_ns;
+    tcp_counters tcp;
+    udp_counters udp;
+    profile_io io;
+} profile_span;
+
+/* turns profiling on. until it is, nothing is recorded */
+void profile_enable();
+
+/* returns true if profiling is on */
+bool profile_enabled();
+
+/* starts span on the calling thread */
+void profile_begin(profile_span* span);
+
+/* adds the time since span began and the calling thread's I/O since then
+   to stage, as one call */
+void profile_end(profile_span* span, int stage);
+
+/* adds only the calling thread's I/O since span began to stage, for work
+   which is timed as a whole elsewhere */
+void profile_count(profile_span* span, int stage);
+
+/* adds only the time since span began to stage, as one call, for work
+   whose I/O is counted by profile_count() on other threads */
+void profile_time(profile_span* span, int stage);
+
+/* adds the upload of a file of size bytes, which began at span, to the
+   upload stage and to the bucket for its size */
+void profile_file(profile_span* span, uint64_t size);
+
+/* writes the report as JSON to path, or to stdout if path is "-" */
+void profile_write(char* path);
+
+#endif /* PROFILE_H */
@@ -0,0 +1,321 @@
+/* DESCRIPTION: Restores a user's Hooli directory from the server. The
+        list of stored files is requested from the hmds with a FILES
+        request, and the files themselves are fetched from the hftpd
+        with CONTROL_GET requests. Several files are fetched at once,
+        each worker thread using its own hftp session.                */
+
+#include "client.h"
+
+/*  handles the FILES request. returns the list of files stored for the user
+    (alternating filename and checksum lines), or NULL if there are none */
+char* files_request(int sockfd, char* token){
+    char* files_req;
+    char* files_rsp;
+    char* status;
+    int i = 0;
+
+    //create and send the request
+    asprintf(&files_req, "FILES\nToken:%s\n\n", token);
+    syslog(LOG_INFO, "Requesting stored file list");
+    if(send(sockfd, files_req, strlen(files_req), 0) == -1){
+        syslog(LOG_ERR, "%s", "Unable to send");
+        exit(EXIT_FAILURE);
+    }
+    free(files_req);
+
+    //get the response status
+    files_rsp = recv_reply(sockfd);
+    status = readuntil(files_rsp, ' ', &i);
+    readuntil(files_rsp, '\n', &i);
+
+    if(strcmp(status, "200")==0){
+        //get the list length
+        int list_length = 0;
+        while(files_rsp[i] != '\n'){
+            char* key = readuntil(files_rsp, ':', &i);
+            char* value = readuntil(files_rsp, '\n', &i);
+
+            if(strcmp(key, "Length")==0){
+                list_length = atoi(value);
+            }
+            free(key);
+            free(value);
+        }
+
+        return recv_message_len(sockfd, list_length);
+
+    }else if(strcmp(status, "204")==0){
+        syslog(LOG_INFO, "No files stored on the server");
+    }else{
+        syslog(LOG_INFO, "Unauthorized: bad token");
+    }
+
+    return NULL;
+}
+
+/*  returns whether filename, as listed by the server, stays under the restore
+    directory: it must be non-empty, relative and free of ".." components */
+static bool filename_allowed(const char* filename){
+    if(filename[0] == '\0' || filename[0] == '/') return false;
+    for(const char* c = filename; c != NULL; c = strchr(c, '/')){
+        if(*c == '/') c++;
+        if(strncmp(c, "..", 2) == 0 && (c[2] == '/' || c[2] == '\0')) return false;
+    }
+    return true;
+}
+
+/* the body of each restore thread: fetches files until none remain */
+static void* restore_worker(void* arg){
+    restore_job* job = (restore_job*)arg;
+    host server;
+    uint8_t seq = 0;
+    int sockfd = create_client_socket(job->fserver, job->fport, &server);
+
+    while(1){
+        //take the next file
+        pthread_mutex_lock(&job->lock);
+        int file = job->next_file++;
+        pthread_mutex_unlock(&job->lock);
+        if(file >= job->num_files) break;
+
+        if(restore_file(sockfd, &server, job->token, job->root_dir, job->filenames[file], &seq) == -1){
+            pthread_mutex_lock(&job->lock);
+            job->failed++;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+
+    //end the session
+    control_message* term = (control_message*)create_message();
+    term->type = CONTROL_TERM;
+    term->seq = seq;
+    term->filename_len = 0;
+    memcpy(term->token, job->token, TOKEN_SIZE);
+    term->length = CONTROL_STATIC_SIZE;
+    free(request_until_reply(seq, (message*)term, sockfd, &server));
+    free(term);
+    close(sockfd);
+
+    return NULL;
+}
+
+/*  restores every file in file_list to root_dir from the hftpd at fserver,
+    running jobs transfers in parallel.
+    returns the number of files which could not be restored */
+int restore_files(char* fserver, char* fport, char* file_list, char* token, char* root_dir, int jobs){
+    restore_job job = {
+        .fserver  = fserver,
+        .fport    = fport,
+        .token    = token,
+        .root_dir = root_dir,
+    };
+    pthread_mutex_init(&job.lock, NULL);
+
+    //collect the filenames, skipping the checksum lines
+    int i = 0;
+    int capacity = 16;
+    job.filenames = (char**)malloc(capacity*sizeof(char*));
+    while(file_list != NULL && file_list[i] != '\0'){
+        char* filename = readuntil(file_list, '\n', &i);
+        free(readuntil(file_list, '\n', &i));
+
+        if(job.num_files == capacity){
+            capacity *= 2;
+            job.filenames = (char**)realloc(job.filenames, capacity*sizeof(char*));
+        }
+        job.filenames[job.num_files++] = filename;
+    }
+
+    //run the restore threads
+    if(jobs > job.num_files) jobs = job.num_files;
+    syslog(LOG_INFO, "Restoring %d file(s) to %s", job.num_files, root_dir);
+    pthread_t* threads = (pthread_t*)malloc(jobs*sizeof(pthread_t));
+    for(i=0; i<jobs; i++){
+        pthread_create(&threads[i], NULL, restore_worker, &job);
+    }
+    for(i=0; i<jobs; i++){
+        pthread_join(threads[i], NULL);
+    }
+
+    //clean up
+    for(i=0; i<job.num_files; i++){
+        free(job.filenames[i]);
+    }
+    free(job.filenames);
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+
+    return job.failed;
+}
+
+/*  sends msg until a reply to it (a response or control message with seq seq)
+    arrives. data messages received meanwhile are ignored */
+message* request_until_reply(uint8_t seq, message* msg, int sockfd, host* server){
+    struct pollfd fd = {
+        .fd = sockfd,
+        .events = POLLIN
+    };
+
+    while(1){
+        if(send_message(sockfd, msg, server) == -1){
+            syslog(LOG_ERR, "Error sending message");
+            exit(EXIT_FAILURE);
+        }
+
+        //wait up to POLL_TIME for the reply, discarding stale data from an earlier file
+        struct timespec sent, now;
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+        int remaining = POLL_TIME;
+        while(remaining > 0 && poll(&fd, 1, remaining) == 1){
+            message* reply = receive_message(sockfd, server);
+            if(reply != NULL){
+                uint8_t type = reply->buffer[0];
+                if((type == RESPONSE_TYPE || type == CONTROL_INIT) && reply->buffer[1] == seq){
+                    return reply;
+                }
+                free(reply);
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining = POLL_TIME - ((now.tv_sec - sent.tv_sec)*1000 + (now.tv_nsec - sent.tv_nsec)/1000000);
+        }
+    }
+}
+
+/*  fetches filename from the hftpd and writes it under root_dir.
+    returns 0 on success, -1 on failure */
+int restore_file(int sockfd, host* server, char* token, char* root_dir, char* filename, uint8_t* seq){
+    if(!filename_allowed(filename)){
+        syslog(LOG_WARNING, "Server listed %s, outside the restore directory, skipping it", filename);
+        return -1;
+    }
+    uint16_t filename_len = strlen(filename);
+
+    //request the file
+    control_message* get = (control_message*)create_message();
+    get->type         = CONTROL_GET;
+    get->seq          = *seq;
+    get->filename_len = htons(filename_len);
+    memcpy(get->token, token, TOKEN_SIZE);
+    memcpy(get->filename, filename, filename_len);
+    get->length       = CONTROL_STATIC_SIZE + filename_len;
+    control_set_ext(get, 0, 0, 0);
+
+    syslog(LOG_DEBUG, "Requesting %s", filename);
+    message* reply = request_until_reply(*seq, (message*)get, sockfd, server);
+    *seq = (*seq+1)%2;
+    free(get);
+
+    //the server could not provide the file
+    if(reply->buffer[0] == RESPONSE_TYPE){
+        uint16_t err_code = ntohs(((response_message*)reply)->err_code);
+        free(reply);
+        if(err_code == AUTHENTICATION_ERROR){
+            syslog(LOG_ERR, "Token mismatch. Exiting");
+            exit(EXIT_FAILURE);
+        }
+        syslog(LOG_WARNING, "Server could not provide %s", filename);
+        return -1;
+    }
+
+    //a version 2 server sends the 64-bit size, and data messages carrying their offsets
+    uint64_t size, offset;
+    int version = control_get_ext((control_message*)reply, &size, &offset, NULL);
+    uint32_t checksum = ntohl(((control_message*)reply)->checksum);
+    free(reply);
+
+    //open the file
+    char* path;
+    asprintf(&path, "%s/%s", root_dir, filename);
+    make_parent_dirs(path);
+    FILE* f = fopen(path, "wb");
+    free(path);
+    if(f == NULL){
+        syslog(LOG_WARNING, "Could not open %s for writing", filename);
+        return -1;
+    }
+
+    struct pollfd fd = {
+        .fd = sockfd,
+        .events = POLLIN
+    };
+    response_ext_message* ack = (response_ext_message*)create_message();
+    ack->type     = RESPONSE_TYPE;
+    ack->err_code = htons(ACK);
+    ack->version  = HFTP_VERSION;
+    memset(ack->reserved, 0, sizeof(ack->reserved));
+    ack->length   = version >= 2 ? RESPONSE_EXT_LENGTH : RESPONSE_LENGTH;
+
+    //receive data messages until a short one ends the file
+    syslog(LOG_INFO, "Restoring %s", filename);
+    uint8_t expected_seq = 0;
+    uint64_t bytes_recvd = 0;
+    uLong crc_value = crc32(0L, Z_NULL, 0);
+    int timeouts = 0;
+    int done = 0;
+    while(!done){
+        if(poll(&fd, 1, POLL_TIME) != 1){
+            if(++timeouts == RESTORE_RETRIES){
+                syslog(LOG_WARNING, "Timed out restoring %s", filename);
+                break;
+            }
+            continue;
+        }
+        timeouts = 0;
+
+        data_message* data = (data_message*)receive_message(sockfd, server);
+        if(data == NULL) continue;
+        if(data->type != (version >= 2 ? DATA_EXT_TYPE : DATA_TYPE)){
+            free(data);
+            continue;
+        }
+
+        //write the expected data messages. a version 2 message is expected
+        //if it starts where the file so far ends
+        uint16_t data_len = ntohs(data->data_len);
+        if(version >= 2){
+            data_ext_message* ext = (data_ext_message*)data;
+            if(be64toh(ext->offset) == bytes_recvd){
+                fwrite(ext->data, sizeof(uint8_t), data_len, f);
+                crc_value = crc32(crc_value, ext->data, data_len);
+                bytes_recvd += data_len;
+                done = bytes_recvd >= size;
+            }
+        }else if(data->seq == expected_seq){
+            fwrite(data->data, sizeof(uint8_t), data_len, f);
+            crc_value = crc32(crc_value, data->data, data_len);
+            bytes_recvd += data_len;
+            expected_seq = (expected_seq+1)%2;
+            done = data_len < MAX_DATA_SIZE;
+        }
+
+        //acknowledge every data message
+        ack->seq = data->seq;
+        ack->offset = htobe64(bytes_recvd);
+        send_message(sockfd, (message*)ack, server);
+        free(data);
+    }
+    free(ack);
+    fclose(f);
+
+    if(!done){
+        return -1;
+    }
+    if(bytes_recvd != size || crc_value != checksum){
+        syslog(LOG_WARNING, "Restored %s does not match its stored checksum", filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* creates every missing parent directory of path */
+void make_parent_dirs(char* path){
+    for(char* slash = strchr(path+1, '/'); slash != NULL; slash = strchr(slash+1, '/')){
+        *slash = '\0';
+        if(mkdir(path, 0755) == -1 && errno != EEXIST){
+            syslog(LOG_WARNING, "Could not create directory %s", path);
+        }
+        *slash = '/';
+    }
+}
@@ -0,0 +1,66 @@
+/* DESCRIPTION: Restores a user's Hooli directory from the server. The
+        list of stored files is requested from the hmds with a FILES
+        request, and the files themselves are fetched from the hftpd
+        with CONTROL_GET requests. Several files are fetched at once,
+        each worker thread using its own hftp session.                */
+
+#ifndef RESTORE_H
+#define RESTORE_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <zlib.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "../common/socketutils.h"
+#include "../common/udp_client.h"
+#include "../common/udp_sockets.h"
+#include "../common/hftp_messages.h"
+
+#define RESTORE_RETRIES 3 //polls without data before a restore is abandoned
+
+//the work shared by the restore threads
+typedef struct
+{
+    char* fserver;          //hostname of the hftpd
+    char* fport;            //port of the hftpd
+    char* token;            //token of the user
+    char* root_dir;         //directory the files are restored to
+    char** filenames;       //files to restore
+    int num_files;          //number of files in filenames
+    int next_file;          //index of the next file to hand to a thread
+    int failed;             //number of files which could not be restored
+    pthread_mutex_t lock;   //protects next_file and failed
+} restore_job;
+
+/*  handles the FILES request. returns the list of files stored for the user
+    (alternating filename and checksum lines), or NULL if there are none */
+char* files_request(int sockfd, char* token);
+
+/*  restores every file in file_list to root_dir from the hftpd at fserver,
+    running jobs transfers in parallel.
+    returns the number of files which could not be restored */
+int restore_files(char* fserver, char* fport, char* file_list, char* token, char* root_dir, int jobs);
+
+/*  sends msg until a reply to it (a response or control message with seq seq)
+    arrives. data messages received meanwhile are ignored */
+message* request_until_reply(uint8_t seq, message* msg, int sockfd, host* server);
+
+/*  fetches filename from the hftpd and writes it under root_dir.
+    returns 0 on success, -1 on failure */
+int restore_file(int sockfd, host* server, char* token, char* root_dir, char* filename, uint8_t* seq);
+
+/* creates every missing parent directory of path */
+void make_parent_dirs(char* path);
+
+#endif /* RESTORE_H */
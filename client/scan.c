@@ -0,0 +1,513 @@
+/* DESCRIPTION: Scans the Hooli directory for files and their checksums,
+        spreading the directories and files over a work-stealing pool. */
+
+#include "client.h"
+
+/* creates a scan_entry for name, found in the directory of parent */
+static scan_entry* create_entry(scan* sc, scan_entry* parent, char* name){
+    scan_entry* entry = (scan_entry*)malloc(sizeof(scan_entry));
+    entry->sc = sc;
+    entry->has_stat = false;
+    entry->ignore = NULL;
+    asprintf(&entry->path, "%s/%s", parent->path, name);
+    asprintf(&entry->relative_path, "%s%s", parent->relative_path, name);
+    return entry;
+}
+
+/* returns the current time in ms */
+static int64_t now_ms(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+/* frees entry and its paths */
+static void free_entry(scan_entry* entry){
+    free(entry->path);
+    free(entry->relative_path);
+    ignore_context_free(entry->ignore);
+    free(entry);
+}
+
+/* lists the directory of dir, submitting a task for everything in it */
+static void list_dir(scan_entry* dir){
+    scan* sc = dir->sc;
+
+    int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1){
+        syslog(LOG_WARNING, "Cannot open directory '%s'", dir->path);
+        free_entry(dir);
+        return;
+    }
+
+    //the directory's own rules apply to its entries, after those above it
+    dir->ignore = ignore_enter(dir->ignore, fd);
+
+    //read the listing many entries at a time, straight from the kernel
+    char buf[SCAN_DENTS_SIZE] __attribute__((aligned(__alignof__(struct dirent64))));
+    ssize_t len;
+    while((len = getdents64(fd, buf, sizeof(buf))) != 0){
+        profile_io_counts.calls++;
+        if(len == -1){
+            if(errno == EINTR) continue;
+            syslog(LOG_WARNING, "Cannot read directory '%s'", dir->path);
+            break;
+        }
+
+        for(char* ptr = buf; ptr < buf + len; ptr += ((struct dirent64*)ptr)->d_reclen){
+            struct dirent64* entry = (struct dirent64*)ptr;
+            if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+            //the entry's type comes with the listing on most filesystems. links
+            //are followed, and only they and unknown types cost a stat
+            unsigned char type = entry->d_type;
+            scan_entry* found = create_entry(sc, dir, entry->d_name);
+            if(type == DT_UNKNOWN || type == DT_LNK){
+                type = DT_UNKNOWN;
+                if(fstatat(fd, entry->d_name, &found->st, 0) == 0){
+                    if(S_ISDIR(found->st.st_mode)) type = DT_DIR;
+                    else if(S_ISREG(found->st.st_mode)) type = DT_REG;
+                    found->has_stat = true;
+                }
+            }
+
+            //an entry left out by the rules is never opened
+            if((type == DT_DIR || type == DT_REG) && ignore_match(dir->ignore, entry->d_name, type == DT_DIR, &found->ignore)){
+                syslog(LOG_DEBUG, " * ignored: %s", found->relative_path);
+                free_entry(found);
+                continue;
+            }
+
+            if(type == DT_DIR){
+                //a directory's relative path ends with a '/'
+                char* relative_path;
+                asprintf(&relative_path, "%s/", found->relative_path);
+                free(found->relative_path);
+                found->relative_path = relative_path;
+                pool_submit(sc->pool, scan_dir_task, found);
+            }else if(type == DT_REG){
+                pool_submit(sc->pool, scan_file_task, found);
+            }else{
+                syslog(LOG_WARNING, "Could not open %s", found->path);
+                free_entry(found);
+            }
+        }
+    }
+
+    close(fd);
+    free_entry(dir);
+}
+
+/* a pool task: lists the directory of a scan_entry, submitting a task
+   for everything in it */
+void scan_dir_task(void* arg){
+    profile_span span;
+    profile_begin(&span);
+    list_dir((scan_entry*)arg);
+    profile_count(&span, PROFILE_SCAN);
+}
+
+/* adds file to index with its checksum, or without one if flags has
+   INDEX_UNHASHED */
+static void put_file(file_index* index, scan_entry* file, uint32_t checksum, uint64_t size, uint8_t flags){
+    if(flags & INDEX_UNHASHED){
+        index_put_unhashed(index, file->relative_path, size);
+    } else{
+        index_put(index, file->relative_path, checksum, size);
+    }
+}
+
+/* records the checksum and size of file, which had the stat st before it
+   was read, in the results of the calling worker. hashed is set if the
+   file was read. a file with INDEX_UNHASHED in flags was not read, and is
+   not cached */
+static void record_file(scan* sc, scan_entry* file, struct stat* st, uint32_t checksum, uint64_t size, bool hashed, uint8_t flags){
+    //the worker's own results need no lock
+    scan_results* results = &sc->results[pool_worker_index(sc->pool)];
+    if(hashed){
+        results->hashed++;
+    }
+    if(flags & INDEX_UNHASHED){
+        results->deferred++;
+    }
+    results->found++;
+    syslog(LOG_DEBUG, " * found file: %s (%X)", file->relative_path, checksum);
+
+    if(!(sc->flags & SCAN_DISCARD)){
+        put_file(results->files, file, checksum, size, flags);
+
+        //past this many files, the worker's index goes to disk
+        if(sc->runs != NULL && results->files->count >= SCAN_SPILL_FILES){
+            runs_write(sc->runs, results->files);
+            index_free(results->files);
+            results->files = index_create(SCAN_SPILL_FILES);
+        }
+    }
+
+    //hand the file out with the next batch
+    if(sc->batch != NULL){
+        pthread_mutex_lock(&sc->lock);
+
+        //the files found must not pile up faster than they are sent
+        while(sc->num_full >= SCAN_MAX_BATCHES && !sc->finishing){
+            pthread_cond_wait(&sc->batch_taken, &sc->lock);
+        }
+        if(sc->batch->count == 0){
+            sc->batch_started_ms = now_ms();
+        }
+        put_file(sc->batch, file, checksum, size, flags);
+        if(sc->batch->count >= SCAN_BATCH_FILES){
+            //queue the batch, so no batch grows past the limit while the
+            //last one is being sent
+            scan_batch* full = (scan_batch*)malloc(sizeof(scan_batch));
+            full->files = sc->batch;
+            full->next = NULL;
+            if(sc->full_tail != NULL){
+                sc->full_tail->next = full;
+            }else{
+                sc->full = full;
+            }
+            sc->full_tail = full;
+            sc->num_full++;
+            sc->batch = index_create(SCAN_BATCH_FILES);
+            pthread_cond_signal(&sc->batch_ready);
+        }
+        pthread_mutex_unlock(&sc->lock);
+    }
+
+    //remember the checksum for the next scan, unless the file changed while
+    //it was read
+    if(sc->cache != NULL && size == (uint64_t)st->st_size && !(flags & INDEX_UNHASHED)){
+        if(results->num_cached == results->cached_size){
+            results->cached_size = results->cached_size ? results->cached_size*2 : 256;
+            results->cached = (cache_record*)realloc(results->cached, results->cached_size*sizeof(cache_record));
+        }
+        cache_fill(&results->cached[results->num_cached++], st, checksum, sc->started_ns);
+
+        //the records are written out a block at a time, so they never all
+        //have to be in memory
+        if(results->num_cached == CACHE_FLUSH_RECORDS){
+            cache_write(sc->cache_out, results->cached, results->num_cached);
+            results->num_cached = 0;
+        }
+    }
+}
+
+/* splits the file open at fd into segments, submitting a task to checksum
+   each. the last of them records the file */
+static void hash_segments(scan* sc, scan_entry* file, struct stat* st, int fd){
+    segmented_file* seg = (segmented_file*)malloc(sizeof(segmented_file));
+    seg->entry = file;
+    seg->st = *st;
+    seg->fd = fd;
+    seg->num_segments = (st->st_size + SEGMENT_SIZE - 1)/SEGMENT_SIZE;
+    seg->crcs = (uLong*)malloc(seg->num_segments*sizeof(uLong));
+    seg->lengths = (uint64_t*)malloc(seg->num_segments*sizeof(uint64_t));
+    atomic_init(&seg->remaining, seg->num_segments);
+
+    for(int i=0; i<seg->num_segments; i++){
+        file_segment* segment = (file_segment*)malloc(sizeof(file_segment));
+        segment->file = seg;
+        segment->index = i;
+        pool_submit(sc->pool, scan_segment_task, segment);
+    }
+}
+
+/* checksums the file of file and records it */
+static void hash_file(scan_entry* file){
+    scan* sc = file->sc;
+
+    //the listing may already have needed the file's stat
+    struct stat st = file->st;
+    if(!file->has_stat && stat(file->path, &st) != 0){
+        syslog(LOG_WARNING, "Could not open %s", file->path);
+        free_entry(file);
+        return;
+    }
+
+    //only read the file if it changed since the last scan
+    uint32_t checksum;
+    if(sc->cache != NULL && cache_lookup(sc->cache, &st, &checksum)){
+        record_file(sc, file, &st, checksum, st.st_size, false, 0);
+        free_entry(file);
+        return;
+    }
+
+    //a file the cache has never seen must be sent, so it is only read
+    //once, as it is sent. a file which changed is still read here, as it
+    //may have changed back. with no cache, every file seems new
+    if((sc->flags & SCAN_DEFER) && sc->cache != NULL && sc->cache->count > 0 &&
+       !cache_has(sc->cache, &st) && !cache_racy(&st, sc->started_ns)){
+        record_file(sc, file, &st, 0, st.st_size, false, INDEX_UNHASHED);
+        free_entry(file);
+        return;
+    }
+
+    //a file which cannot be opened is skipped, as one which cannot be
+    //stat'ed is
+    int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1){
+        syslog(LOG_WARNING, "Could not open %s", file->path);
+        free_entry(file);
+        return;
+    }
+
+    //one thread cannot checksum a large file as fast as the disk reads it
+    if(st.st_size >= SEGMENT_THRESHOLD && sc->pool->num_threads > 1){
+        hash_segments(sc, file, &st, fd);
+        return;
+    }
+
+    uint64_t size;
+    checksum = crc_range(fd, file->path, 0, CRC_TO_END, &size);
+    close(fd);
+    record_file(sc, file, &st, checksum, size, true, 0);
+    free_entry(file);
+}
+
+/* a pool task: checksums the file of a scan_entry and records it */
+void scan_file_task(void* arg){
+    profile_span span;
+    profile_begin(&span);
+    hash_file((scan_entry*)arg);
+    profile_count(&span, PROFILE_SCAN);
+}
+
+/* checksums segment. the one which finishes the last segment of a file
+   combines their checksums and records the file */
+static void hash_segment(file_segment* segment){
+    segmented_file* seg = segment->file;
+    int i = segment->index;
+    free(segment);
+
+    //the last segment reads on to the end, in case the file grew
+    uint64_t len = i == seg->num_segments - 1 ? CRC_TO_END : SEGMENT_SIZE;
+    seg->crcs[i] = crc_range(seg->fd, seg->entry->path, (uint64_t)i*SEGMENT_SIZE, len, &seg->lengths[i]);
+    if(atomic_fetch_sub(&seg->remaining, 1) != 1) return;
+
+    //every segment is done. the checksum of the whole file is the first
+    //segment's, extended by each of the others in turn
+    uLong checksum = seg->crcs[0];
+    uint64_t size = seg->lengths[0];
+    bool whole = true;
+    for(int j=1; j<seg->num_segments; j++){
+        checksum = crc32_combine(checksum, seg->crcs[j], seg->lengths[j]);
+        whole = whole && seg->lengths[j-1] == SEGMENT_SIZE;
+        size += seg->lengths[j];
+    }
+    close(seg->fd);
+
+    //a segment cut short means the file shrank while it was read. its
+    //checksum is of no use, so the file is left for the next scan
+    if(whole){
+        record_file(seg->entry->sc, seg->entry, &seg->st, checksum, size, true, 0);
+    }else{
+        syslog(LOG_WARNING, "%s changed while it was read", seg->entry->path);
+    }
+
+    free_entry(seg->entry);
+    free(seg->crcs);
+    free(seg->lengths);
+    free(seg);
+}
+
+/* a pool task: checksums a file_segment. the task which finishes the
+   last segment of a file combines their checksums and records the file */
+void scan_segment_task(void* arg){
+    profile_span span;
+    profile_begin(&span);
+    hash_segment((file_segment*)arg);
+    profile_count(&span, PROFILE_SCAN);
+}
+
+/* scans dir recursively using threads threads, adding a record with the
+   relative path, CRC-32 checksum and size of each file to index.
+   if cache_file is not NULL, unchanged files take their checksum from it,
+   and it is replaced with what this scan found */
+void iterate_dirs(char* dir, file_index* index, int threads, char* cache_file){
+    scan_finish(scan_start(dir, threads, cache_file, 0), index);
+}
+
+/* starts scanning dir in the background, as iterate_dirs() does, as
+   flags, a set of SCAN_*, say */
+scan* scan_start(char* dir, int threads, char* cache_file, int flags){
+    //a missing root is an error, unlike a subdirectory which cannot be read
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1){
+        syslog(LOG_ERR, "Cannot open directory '%s'", dir);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    scan* sc = (scan*)calloc(1, sizeof(scan));
+    sc->pool = pool_create(threads);
+    sc->threads = threads;
+    sc->results = (scan_results*)calloc(threads, sizeof(scan_results));
+    sc->flags = flags;
+    sc->cache = cache_file != NULL ? cache_open(cache_file) : NULL;
+    sc->cache_out = cache_file != NULL ? cache_begin(cache_file) : NULL;
+    sc->runs = flags & SCAN_SPILL ? runs_create() : NULL;
+    sc->started_ns = (int64_t)now.tv_sec*1000000000LL + now.tv_nsec;
+    pthread_mutex_init(&sc->lock, NULL);
+    pthread_cond_init(&sc->batch_ready, NULL);
+    pthread_cond_init(&sc->batch_taken, NULL);
+    sc->batch = flags & SCAN_STREAM ? index_create(SCAN_BATCH_FILES) : NULL;
+
+    for(int i=0; i<threads; i++){
+        sc->results[i].files = index_create(0);
+    }
+
+    scan_entry* root = (scan_entry*)malloc(sizeof(scan_entry));
+    root->sc = sc;
+    root->has_stat = false;
+    root->ignore = NULL;
+    root->path = strdup(dir);
+    root->relative_path = strdup("");
+    pool_submit(sc->pool, scan_dir_task, root);
+    return sc;
+}
+
+/* waits for the next batch of files found by a streaming scan, returning
+   it once it is full, once its first file has waited long enough, or once
+   the scan is done. returns NULL when every file has been handed out */
+file_index* scan_next_batch(scan* sc){
+    pthread_mutex_lock(&sc->lock);
+    while(1){
+        if(sc->full != NULL){
+            scan_batch* full = sc->full;
+            sc->full = full->next;
+            if(sc->full == NULL){
+                sc->full_tail = NULL;
+            }
+            sc->num_full--;
+            pthread_cond_broadcast(&sc->batch_taken);
+            pthread_mutex_unlock(&sc->lock);
+
+            file_index* batch = full->files;
+            free(full);
+            return batch;
+        }
+
+        //every file is recorded before its task counts as finished
+        bool done = atomic_load(&sc->pool->pending) == 0;
+        int64_t now = now_ms();
+        size_t count = sc->batch->count;
+
+        if(count > 0 && (done || now >= sc->batch_started_ms + SCAN_BATCH_MS)){
+            file_index* batch = sc->batch;
+            sc->batch = index_create(SCAN_BATCH_FILES);
+            pthread_mutex_unlock(&sc->lock);
+            return batch;
+        }
+        if(done){
+            pthread_mutex_unlock(&sc->lock);
+            return NULL;
+        }
+
+        //the end of the scan is not signalled, so wake up now and then to
+        //look for it
+        int64_t wake = now + SCAN_BATCH_MS;
+        if(count > 0 && wake > sc->batch_started_ms + SCAN_BATCH_MS){
+            wake = sc->batch_started_ms + SCAN_BATCH_MS;
+        }
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        int64_t until_ns = (int64_t)until.tv_sec*1000000000LL + until.tv_nsec + (wake - now)*1000000LL;
+        until.tv_sec = until_ns/1000000000LL;
+        until.tv_nsec = until_ns%1000000000LL;
+        pthread_cond_timedwait(&sc->batch_ready, &sc->lock, &until);
+    }
+}
+
+/* waits for sc to finish, adds every file it found to index, saves the
+   cache and frees sc */
+void scan_finish(scan* sc, file_index* index){
+    file_runs* runs = scan_finish_runs(sc, index);
+    if(runs == NULL) return;
+
+    //the caller wants every file in memory after all
+    runs_reader* reader = runs_open(runs);
+    char* path;
+    uint32_t checksum;
+    uint64_t size;
+    uint8_t flags;
+    while(runs_next(reader, &path, &checksum, &size, &flags)){
+        size_t record = index_put(index, path, checksum, size);
+        index->flags[record] = flags;
+    }
+    runs_close(reader);
+    runs_free(runs);
+}
+
+/* waits for sc to finish, saves the cache and frees sc. if any files were
+   spilled to disk, the rest are too and the runs are returned. otherwise
+   every file found is added to index and NULL is returned */
+file_runs* scan_finish_runs(scan* sc, file_index* index){
+    //workers held back by batches which will never be taken are let go
+    pthread_mutex_lock(&sc->lock);
+    sc->finishing = true;
+    pthread_cond_broadcast(&sc->batch_taken);
+    pthread_mutex_unlock(&sc->lock);
+
+    pool_wait(sc->pool);
+    pool_destroy(sc->pool);
+
+    //merge the workers' indexes, or spill them too if any were
+    bool spilled = sc->runs != NULL && sc->runs->next_run > 0;
+    long found = 0;
+    long hashed = 0;
+    long deferred = 0;
+    for(int i=0; i<sc->threads; i++){
+        found += sc->results[i].found;
+        hashed += sc->results[i].hashed;
+        deferred += sc->results[i].deferred;
+        if(spilled){
+            if(sc->results[i].files->count > 0){
+                runs_write(sc->runs, sc->results[i].files);
+            }
+        }else{
+            index_merge(index, sc->results[i].files);
+        }
+        index_free(sc->results[i].files);
+    }
+    syslog(LOG_INFO, "Found %ld file(s), %ld of them new or changed", found, hashed + deferred);
+    if(deferred > 0){
+        syslog(LOG_INFO, "%ld new file(s) will be hashed as they are sent", deferred);
+    }
+
+    //replace the cache with what this scan found
+    if(sc->cache != NULL){
+        cache_close(sc->cache);
+        for(int i=0; i<sc->threads; i++){
+            cache_write(sc->cache_out, sc->results[i].cached, sc->results[i].num_cached);
+            free(sc->results[i].cached);
+        }
+        cache_commit(sc->cache_out);
+    }
+
+    file_runs* runs = NULL;
+    if(spilled){
+        runs = sc->runs;
+        syslog(LOG_DEBUG, "Spilled %lu file(s) to %d run(s)", (unsigned long)runs->count, runs->next_run);
+    }else if(sc->runs != NULL){
+        runs_free(sc->runs);
+    }
+
+    if(sc->batch != NULL){
+        index_free(sc->batch);
+    }
+    while(sc->full != NULL){
+        scan_batch* next = sc->full->next;
+        index_free(sc->full->files);
+        free(sc->full);
+        sc->full = next;
+    }
+    pthread_mutex_destroy(&sc->lock);
+    pthread_cond_destroy(&sc->batch_ready);
+    pthread_cond_destroy(&sc->batch_taken);
+    free(sc->results);
+    free(sc);
+    return runs;
+}
@@ -0,0 +1,164 @@
+/* DESCRIPTION: Scans the Hooli directory for files and their checksums.
+        The scan runs on a work-stealing thread pool: every directory
+        found is a task which lists it, and every file found is a task
+        which checksums it. Idle threads steal whole subdirectories, so
+        the scan keeps every core and many disk requests busy. Each
+        thread collects its records in its own index, and the indexes
+        are merged once the scan is complete. A large file is split
+        into segments which are checksummed by several threads, and
+        their checksums are combined. Files unchanged since the last
+        scan take their checksum from the scan cache, and entries left
+        out by the .hooliignore rules are skipped as they are listed.
+        A scan which may find more files than fit in memory spills
+        each worker's index to disk as a sorted run once it is large
+        enough, and a streaming scan holds its workers back while
+        too many batches are waiting to be taken.                    */
+
+#ifndef SCAN_H
+#define SCAN_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <zlib.h>
+
+#include "file_index.h"
+#include "thread_pool.h"
+#include "scan_cache.h"
+#include "ignore.h"
+#include "file_runs.h"
+
+#define SCAN_DENTS_SIZE 65536 //bytes of directory listing read at a time
+#define SEGMENT_THRESHOLD 67108864 //files this large are checksummed a segment per thread
+#define SEGMENT_SIZE 16777216 //bytes in each segment of a large file
+#define SCAN_BATCH_FILES 1024 //files found before a batch is handed out
+#define SCAN_BATCH_MS 250 //longest a found file waits for its batch to fill
+#define SCAN_MAX_BATCHES 16 //full batches waiting before the workers wait too
+#define SCAN_SPILL_FILES 262144 //files a worker holds before they are written out as a run
+
+#define SCAN_STREAM 1 //the files found can be taken in batches while the scan runs
+#define SCAN_SPILL 2 //files past SCAN_SPILL_FILES a worker go to disk in sorted runs
+#define SCAN_DISCARD 4 //the files are not kept once they are handed out
+#define SCAN_DEFER 8 //files new since the last scan are not read, but hashed as they are sent
+
+//the records found by one worker
+typedef struct
+{
+    file_index* files;          //the files found
+    long found;                 //files recorded
+    long hashed;                //files which were not in the cache
+    long deferred;              //new files left to be hashed as they are sent
+    cache_record* cached;       //what to cache for the next scan
+    size_t num_cached;
+    size_t cached_size;         //allocated size of cached
+} scan_results;
+
+//a full batch of files, waiting to be handed out
+typedef struct scan_batch
+{
+    file_index* files;
+    struct scan_batch* next;
+} scan_batch;
+
+//a scan in progress
+typedef struct
+{
+    thread_pool* pool;
+    int threads;
+    scan_results* results;      //one per worker
+    int flags;                  //SCAN_*
+    scan_cache* cache;          //checksums found by the last scan
+    cache_writer* cache_out;    //what this scan found, for the next one
+    file_runs* runs;            //the files spilled to disk, NULL unless SCAN_SPILL is set
+    int64_t started_ns;         //when the scan started
+
+    //files found but not yet handed out in a batch, if the scan streams
+    pthread_mutex_t lock;
+    pthread_cond_t batch_ready; //signalled when a batch is full
+    pthread_cond_t batch_taken; //signalled when a full batch is handed out
+    scan_batch* full;           //full batches, oldest first
+    scan_batch* full_tail;
+    int num_full;
+    bool finishing;             //no more batches will be taken
+    file_index* batch;          //the batch being filled. NULL if the scan does not stream
+    int64_t batch_started_ms;   //when the first file of batch was found
+} scan;
+
+//a directory or file waiting to be scanned
+typedef struct
+{
+    scan* sc;
+    char* path;                 //absolute path
+    char* relative_path;        //path from the root of the scan
+    struct stat st;             //the entry's stat, if listing it needed one
+    bool has_stat;
+    ignore_context* ignore;     //the rules for a directory's entries, NULL if none apply
+} scan_entry;
+
+//a large file being checksummed in segments
+typedef struct
+{
+    scan_entry* entry;          //the file
+    struct stat st;             //its stat, before it was read
+    int fd;                     //the file, open for every segment to read
+    int num_segments;
+    uLong* crcs;                //checksum of each segment
+    uint64_t* lengths;          //bytes read for each segment
+    atomic_int remaining;       //segments not yet checksummed
+} segmented_file;
+
+//one segment of a segmented_file
+typedef struct
+{
+    segmented_file* file;
+    int index;
+} file_segment;
+
+/* scans dir recursively using threads threads, adding a record with the
+   relative path, CRC-32 checksum and size of each file to index.
+   if cache_file is not NULL, unchanged files take their checksum from it,
+   and it is replaced with what this scan found */
+void iterate_dirs(char* dir, file_index* index, int threads, char* cache_file);
+
+/* starts scanning dir in the background, as iterate_dirs() does, as
+   flags, a set of SCAN_*, say */
+scan* scan_start(char* dir, int threads, char* cache_file, int flags);
+
+/* waits for the next batch of files found by a streaming scan, returning
+   it once it is full, once its first file has waited long enough, or once
+   the scan is done. returns NULL when every file has been handed out */
+file_index* scan_next_batch(scan* sc);
+
+/* waits for sc to finish, adds every file it found to index, saves the
+   cache and frees sc */
+void scan_finish(scan* sc, file_index* index);
+
+/* waits for sc to finish, saves the cache and frees sc. if any files were
+   spilled to disk, the rest are too and the runs are returned. otherwise
+   every file found is added to index and NULL is returned */
+file_runs* scan_finish_runs(scan* sc, file_index* index);
+
+/* a pool task: lists the directory of a scan_entry, submitting a task
+   for everything in it */
+void scan_dir_task(void* arg);
+
+/* a pool task: checksums the file of a scan_entry and records it */
+void scan_file_task(void* arg);
+
+/* a pool task: checksums a file_segment. the task which finishes the
+   last segment of a file combines their checksums and records the file */
+void scan_segment_task(void* arg);
+
+#endif /* SCAN_H */
@@ -0,0 +1,252 @@
+#include "scan_cache.h"
+#include "restore.h"
+
+/* returns ts in ns */
+static int64_t to_ns(struct timespec* ts){
+    return (int64_t)ts->tv_sec*1000000000LL + ts->tv_nsec;
+}
+
+/* orders records by dev, then ino */
+static int compare_records(const void* a, const void* b){
+    const cache_record* ra = (const cache_record*)a;
+    const cache_record* rb = (const cache_record*)b;
+    if(ra->dev != rb->dev) return ra->dev < rb->dev ? -1 : 1;
+    if(ra->ino != rb->ino) return ra->ino < rb->ino ? -1 : 1;
+    return 0;
+}
+
+/* returns the path of the cache for username's scans of root_dir */
+char* cache_path(char* username, char* root_dir){
+    char* path;
+    char* cache_home = getenv("XDG_CACHE_HOME");
+    uLong root_crc = crc32(crc32(0L, Z_NULL, 0), (Bytef*)root_dir, strlen(root_dir));
+
+    if(cache_home != NULL && *cache_home != '\0'){
+        asprintf(&path, "%s/hooli/%s-%08lX.idx", cache_home, username, root_crc);
+    }else{
+        asprintf(&path, "%s/.cache/hooli/%s-%08lX.idx", getpwuid(getuid())->pw_dir, username, root_crc);
+    }
+    return path;
+}
+
+/* maps the cache at path. a missing or unreadable cache is an empty one */
+scan_cache* cache_open(char* path){
+    scan_cache* cache = (scan_cache*)calloc(1, sizeof(scan_cache));
+    struct stat st;
+
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) return cache;
+    if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(cache_header)){
+        close(fd);
+        return cache;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return cache;
+
+    //check that the file is a cache this version can read
+    cache_header* header = (cache_header*)map;
+    if(memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+       header->version != CACHE_VERSION || header->record_size != sizeof(cache_record) ||
+       header->count > (st.st_size - sizeof(cache_header))/sizeof(cache_record)){
+        syslog(LOG_WARNING, "Ignoring unreadable scan cache %s", path);
+        munmap(map, st.st_size);
+        return cache;
+    }
+
+    cache->map = map;
+    cache->map_len = st.st_size;
+    cache->records = (cache_record*)((uint8_t*)map + sizeof(cache_header));
+    cache->count = header->count;
+    madvise(map, st.st_size, MADV_RANDOM);
+    syslog(LOG_DEBUG, "Loaded %lu cached checksum(s)", (unsigned long)cache->count);
+
+    return cache;
+}
+
+/* returns true if the file described by st changed too recently to be
+   cached safely, given that the scan started at started_ns */
+bool cache_racy(struct stat* st, int64_t started_ns){
+    //a file changed just before or during the scan may change again without
+    //its times moving on, if the filesystem's clock is coarse
+    return to_ns(&st->st_mtim) >= started_ns - CACHE_RACY_NS || to_ns(&st->st_ctim) >= started_ns - CACHE_RACY_NS;
+}
+
+/* fills in record from st. a racy file is marked CACHE_RACY, so it is
+   read again by the next scan, but is still known to the cache */
+void cache_fill(cache_record* record, struct stat* st, uint32_t checksum, int64_t started_ns){
+    record->dev      = st->st_dev;
+    record->ino      = st->st_ino;
+    record->size     = st->st_size;
+    record->mtime_ns = to_ns(&st->st_mtim);
+    record->ctime_ns = to_ns(&st->st_ctim);
+    record->checksum = checksum;
+    record->flags    = cache_racy(st, started_ns) ? CACHE_RACY : 0;
+}
+
+/* returns true, setting checksum, if cache holds the file described by st
+   and it is unchanged */
+bool cache_lookup(scan_cache* cache, struct stat* st, uint32_t* checksum){
+    cache_record key = {
+        .dev = st->st_dev,
+        .ino = st->st_ino
+    };
+
+    cache_record* found = (cache_record*)bsearch(&key, cache->records, cache->count, sizeof(cache_record), compare_records);
+    if(found == NULL ||
+       (found->flags & CACHE_RACY) ||
+       found->size != (uint64_t)st->st_size ||
+       found->mtime_ns != to_ns(&st->st_mtim) ||
+       found->ctime_ns != to_ns(&st->st_ctim)){
+        return false;
+    }
+
+    *checksum = found->checksum;
+    return true;
+}
+
+/* returns true if cache holds any record of the file described by st,
+   whether or not it has changed since */
+bool cache_has(scan_cache* cache, struct stat* st){
+    cache_record key = {
+        .dev = st->st_dev,
+        .ino = st->st_ino
+    };
+    return bsearch(&key, cache->records, cache->count, sizeof(cache_record), compare_records) != NULL;
+}
+
+/* creates the file the new cache of writer is written to, with room for
+   the header */
+static void start_writer(cache_writer* writer){
+    //write a new file and move it over the old one, so a scan running at
+    //the same time never sees half a cache
+    asprintf(&writer->tmp_path, "%s.%d", writer->path, getpid());
+    make_parent_dirs(writer->path);
+    writer->f = fopen(writer->tmp_path, "wb");
+    if(writer->f == NULL){
+        syslog(LOG_WARNING, "Could not write scan cache %s", writer->tmp_path);
+        return;
+    }
+
+    //room for the header, which is written once the count is known
+    cache_header header = {0};
+    if(fwrite(&header, sizeof(header), 1, writer->f) != 1){
+        fclose(writer->f);
+        writer->f = NULL;
+    }
+}
+
+/* starts writing a new cache, which replaces the one at path once it is
+   committed */
+cache_writer* cache_begin(char* path){
+    cache_writer* writer = (cache_writer*)calloc(1, sizeof(cache_writer));
+    writer->path = path;
+    pthread_mutex_init(&writer->lock, NULL);
+    start_writer(writer);
+    return writer;
+}
+
+/* starts adding records to the cache at path. the cache is copied into a
+   new one when the first records are added, and is left alone if none are */
+cache_writer* cache_reopen(char* path){
+    cache_writer* writer = (cache_writer*)calloc(1, sizeof(cache_writer));
+    writer->path = path;
+    writer->reopened = true;
+    pthread_mutex_init(&writer->lock, NULL);
+    return writer;
+}
+
+/* starts the new cache of a reopened writer with the records of the old
+   one, which are already in order */
+static void copy_old_cache(cache_writer* writer){
+    writer->reopened = false;
+    start_writer(writer);
+    if(writer->f == NULL) return;
+
+    scan_cache* old = cache_open(writer->path);
+    if(fwrite(old->records, sizeof(cache_record), old->count, writer->f) == old->count){
+        writer->count = old->count;
+        writer->sorted = old->count;
+    }else{
+        syslog(LOG_WARNING, "Could not write scan cache %s", writer->tmp_path);
+        fclose(writer->f);
+        writer->f = NULL;
+    }
+    cache_close(old);
+}
+
+/* adds count records to the cache of writer */
+void cache_write(cache_writer* writer, cache_record* records, size_t count){
+    pthread_mutex_lock(&writer->lock);
+    if(writer->reopened){
+        copy_old_cache(writer);
+    }
+    if(writer->f != NULL){
+        if(fwrite(records, sizeof(cache_record), count, writer->f) == count){
+            writer->count += count;
+        }else{
+            syslog(LOG_WARNING, "Could not write scan cache %s", writer->tmp_path);
+            fclose(writer->f);
+            writer->f = NULL;
+        }
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/* sorts the records of writer and replaces the old cache with them, then
+   frees writer */
+void cache_commit(cache_writer* writer){
+    //a reopened cache nothing was added to stays as it is
+    if(writer->reopened){
+        pthread_mutex_destroy(&writer->lock);
+        free(writer);
+        return;
+    }
+
+    bool ok = writer->f != NULL;
+    cache_header header = {
+        .version = CACHE_VERSION,
+        .record_size = sizeof(cache_record),
+        .count = writer->count
+    };
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+
+    if(ok){
+        ok = fseek(writer->f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, writer->f) == 1;
+        ok = fclose(writer->f) == 0 && ok;
+    }
+
+    //the records are sorted in the file itself, so they need not fit in memory
+    if(ok && writer->count > writer->sorted){
+        size_t len = sizeof(cache_header) + writer->count*sizeof(cache_record);
+        void* map = MAP_FAILED;
+        int fd = open(writer->tmp_path, O_RDWR);
+        if(fd != -1){
+            map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+        }
+        if(map != MAP_FAILED){
+            qsort((uint8_t*)map + sizeof(cache_header), writer->count, sizeof(cache_record), compare_records);
+            ok = munmap(map, len) == 0;
+        }else{
+            ok = false;
+        }
+    }
+
+    if(!ok || rename(writer->tmp_path, writer->path) == -1){
+        syslog(LOG_WARNING, "Could not write scan cache %s", writer->path);
+        unlink(writer->tmp_path);
+    }
+    pthread_mutex_destroy(&writer->lock);
+    free(writer->tmp_path);
+    free(writer);
+}
+
+/* unmaps and frees cache */
+void cache_close(scan_cache* cache){
+    if(cache->map != NULL){
+        munmap(cache->map, cache->map_len);
+    }
+    free(cache);
+}
@@ -0,0 +1,118 @@
+/* DESCRIPTION: A cache of the checksums found by earlier scans, so that
+        files which have not changed are not read again. Each file is
+        identified by its device and inode, and is taken to be unchanged
+        while its size, modification time and change time are. The
+        cache is a file of fixed-size records sorted by device and
+        inode, which is mapped into memory and binary searched. A new
+        cache is written out as the scan goes on and sorted where it
+        lies once the scan is done, so it never has to fit in memory.
+        Files first hashed as they are uploaded are added afterwards. */
+
+#ifndef SCAN_CACHE_H
+#define SCAN_CACHE_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <pwd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define CACHE_MAGIC "HOOLIIDX"
+#define CACHE_VERSION 1
+#define CACHE_RACY_NS 2000000000LL //files changed this close to a scan are hashed again next time
+#define CACHE_FLUSH_RECORDS 4096 //records a worker collects before they are written out
+#define CACHE_RACY 1 //the file changed too close to its scan for its checksum to be trusted
+
+//the header at the start of a cache file
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;       //sizeof(cache_record), so a changed layout is not misread
+    uint64_t count;             //number of records which follow
+} cache_header;
+
+//what a scan found out about one file
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint32_t checksum;
+    uint32_t flags;             //CACHE_* flags
+} cache_record;
+
+//an open cache file
+typedef struct
+{
+    void* map;                  //the mapped file, NULL if there is none
+    size_t map_len;
+    cache_record* records;      //sorted by dev, then ino
+    uint64_t count;
+} scan_cache;
+
+//a new cache, being written
+typedef struct
+{
+    char* path;                 //where the cache goes once it is complete
+    char* tmp_path;             //where it is written until then
+    FILE* f;                    //NULL if it could not be written
+    uint64_t count;             //records written
+    uint64_t sorted;            //records at the start which are already in order
+    bool reopened;              //the old cache is yet to be copied in, as nothing has been added
+    pthread_mutex_t lock;
+} cache_writer;
+
+/* returns the path of the cache for username's scans of root_dir */
+char* cache_path(char* username, char* root_dir);
+
+/* maps the cache at path. a missing or unreadable cache is an empty one */
+scan_cache* cache_open(char* path);
+
+/* returns true if the file described by st changed too recently to be
+   cached safely, given that the scan started at started_ns */
+bool cache_racy(struct stat* st, int64_t started_ns);
+
+/* fills in record from st. a racy file is marked CACHE_RACY, so it is
+   read again by the next scan, but is still known to the cache */
+void cache_fill(cache_record* record, struct stat* st, uint32_t checksum, int64_t started_ns);
+
+/* returns true, setting checksum, if cache holds the file described by st
+   and it is unchanged */
+bool cache_lookup(scan_cache* cache, struct stat* st, uint32_t* checksum);
+
+/* returns true if cache holds any record of the file described by st,
+   whether or not it has changed since */
+bool cache_has(scan_cache* cache, struct stat* st);
+
+/* starts writing a new cache, which replaces the one at path once it is
+   committed */
+cache_writer* cache_begin(char* path);
+
+/* starts adding records to the cache at path. the cache is copied into a
+   new one when the first records are added, and is left alone if none are */
+cache_writer* cache_reopen(char* path);
+
+/* adds count records to the cache of writer */
+void cache_write(cache_writer* writer, cache_record* records, size_t count);
+
+/* sorts the records of writer and replaces the old cache with them, then
+   frees writer */
+void cache_commit(cache_writer* writer);
+
+/* unmaps and frees cache */
+void cache_close(scan_cache* cache);
+
+#endif /* SCAN_CACHE_H */
@@ -0,0 +1,177 @@
+#include "client.h"
+
+/* sends chunk of job over the flow whose socket is sockfd, to server,
+   reading it into buf. next_seq is the flow's sequence number */
+static void send_chunk(stripe_job* job, uint64_t chunk, int sockfd, host* server, uint8_t* next_seq, uint8_t* buf){
+    uint64_t offset = chunk*STRIPE_CHUNK;
+    size_t len = job->size - offset < STRIPE_CHUNK ? job->size - offset : STRIPE_CHUNK;
+
+    //read the whole chunk at once. a file which has gone or shrunk is sent
+    //padded with zeros, and the server will find it does not match its checksum
+    size_t got = 0;
+    while(job->fd != -1 && got < len){
+        ssize_t bytes = pread(job->fd, buf + got, len - got, offset + got);
+        profile_io_counts.calls++;
+        if(bytes == -1 && errno == EINTR) continue;
+        if(bytes <= 0) break;
+        got += bytes;
+        profile_io_counts.bytes += bytes;
+    }
+    if(got < len){
+        syslog(LOG_WARNING, "File changed while being sent");
+        memset(buf + got, 0, len - got);
+    }
+    job->crcs[chunk] = crc32(crc32(0L, Z_NULL, 0), buf, len);
+
+    //send it a data message at a time, each carrying its offset
+    data_ext_message* msg = (data_ext_message*)create_message();
+    for(size_t sent = 0; sent < len; ){
+        uint16_t part = len - sent < MAX_DATA_EXT_SIZE ? len - sent : MAX_DATA_EXT_SIZE;
+        msg->type     = DATA_EXT_TYPE;
+        msg->seq      = *next_seq;
+        msg->data_len = htons(part);
+        msg->offset   = htobe64(offset + sent);
+        memcpy(msg->data, buf + sent, part);
+        msg->length   = DATA_EXT_STATIC_SIZE + part;
+
+        free(send_until_valid_ack(msg->seq, (message*)msg, sockfd, server, POLL_TIME));
+        *next_seq = (*next_seq+1)%2;
+        sent += part;
+    }
+    free(msg);
+}
+
+/* sends chunks of job over the flow whose socket is sockfd until every
+   chunk has been taken */
+static void send_chunks(stripe_job* job, int sockfd, host* server, uint8_t* next_seq){
+    uint8_t* buf = (uint8_t*)malloc(STRIPE_CHUNK);
+    uint64_t chunk;
+    while((chunk = atomic_fetch_add(&job->next_chunk, 1)) < job->num_chunks){
+        send_chunk(job, chunk, sockfd, server, next_seq, buf);
+    }
+    free(buf);
+}
+
+/* the body of each flow's thread: joins the upload of the flow's file and
+   sends chunks of it. a flow which cannot join leaves them to the others */
+static void* flow_thread(void* arg){
+    stripe_flow* flow = (stripe_flow*)arg;
+    stripe_job* job = flow->job;
+
+    char* filename = job->filename;
+    message* msg = compose_control_message(CONTROL_INIT, flow->next_seq, filename, strlen(filename), 0, job->token, job->size, CONTROL_FLAG_JOIN);
+    response_message* response = (response_message*)send_until_valid_ack(msg->buffer[1], msg, flow->sockfd, &flow->server, POLL_TIME);
+    flow->next_seq = (flow->next_seq+1)%2;
+    free(msg);
+
+    if(response_version(response) >= 5 && ntohs(response->err_code) == ACK){
+        send_chunks(job, flow->sockfd, &flow->server, &flow->next_seq);
+    }else{
+        syslog(LOG_DEBUG, "A flow could not join the upload of %s", filename);
+    }
+    free(response);
+
+    //handed to the sending thread, so its profile counts them
+    flow->udp = udp_counts;
+    flow->io = profile_io_counts;
+    return NULL;
+}
+
+/* opens count flows to the hftpd at fserver:fport, besides the session's
+   first. returns NULL if count is 0 */
+stripes* stripes_open(char* fserver, char* fport, int count){
+    if(count <= 0) return NULL;
+
+    stripes* st = (stripes*)malloc(sizeof(stripes));
+    st->flows = (stripe_flow*)calloc(count, sizeof(stripe_flow));
+    st->count = count;
+    for(int i=0; i<count; i++){
+        st->flows[i].sockfd = create_client_socket(fserver, fport, &st->flows[i].server);
+    }
+    return st;
+}
+
+/* returns true if the file at path, of size bytes, is worth striping over
+   st: it is large, and has no holes, which are sent as runs of zeros
+   over the first flow instead */
+bool stripe_worth(stripes* st, char* path, uint64_t size){
+    struct stat s;
+    if(st == NULL || size < STRIPE_MIN || stat(path, &s) == -1){
+        return false;
+    }
+    return (uint64_t)s.st_blocks*512 >= (uint64_t)s.st_size;
+}
+
+/* sends the size bytes of the file at path, whose striped upload was
+   begun as filename over the first flow of the session, sockfd to server,
+   over it and the flows of st. next_seq is the first flow's sequence
+   number. returns the CRC-32 of what was sent */
+uint32_t stripe_send(stripes* st, int sockfd, host* server, uint8_t* next_seq, char* path, char* filename, char* token, uint64_t size){
+    stripe_job job = {
+        .fd = open(path, O_RDONLY | O_CLOEXEC),
+        .filename = filename,
+        .token = token,
+        .size = size,
+        .num_chunks = (size + STRIPE_CHUNK - 1)/STRIPE_CHUNK
+    };
+    if(job.fd == -1){
+        syslog(LOG_WARNING, "Could not open %s", path);
+    }
+    job.crcs = (uint32_t*)calloc(job.num_chunks, sizeof(uint32_t));
+    atomic_init(&job.next_chunk, 0);
+
+    //the other flows join the upload and take chunks as this one does. one
+    //whose thread cannot start leaves its chunks to the rest
+    bool started[st->count];
+    for(int i=0; i<st->count; i++){
+        stripe_flow* flow = &st->flows[i];
+        flow->job = &job;
+        flow->used = true;
+        started[i] = pthread_create(&flow->thread, NULL, flow_thread, flow) == 0;
+    }
+    send_chunks(&job, sockfd, server, next_seq);
+
+    for(int i=0; i<st->count; i++){
+        if(!started[i]) continue;
+        stripe_flow* flow = &st->flows[i];
+        pthread_join(flow->thread, NULL);
+        udp_counts.calls += flow->udp.calls;
+        udp_counts.bytes += flow->udp.bytes;
+        udp_counts.retransmits += flow->udp.retransmits;
+        profile_io_counts.calls += flow->io.calls;
+        profile_io_counts.bytes += flow->io.bytes;
+    }
+
+    //the checksum of the file is that of its chunks in order
+    uLong crc = crc32(0L, Z_NULL, 0);
+    for(uint64_t i=0; i<job.num_chunks; i++){
+        uint64_t offset = i*STRIPE_CHUNK;
+        crc = crc32_combine(crc, job.crcs[i], size - offset < STRIPE_CHUNK ? size - offset : STRIPE_CHUNK);
+    }
+
+    if(job.fd != -1){
+        close(job.fd);
+    }
+    free(job.crcs);
+    return (uint32_t)crc;
+}
+
+/* ends the session of every flow of st, closes them, and frees st */
+void stripes_close(stripes* st){
+    if(st == NULL) return;
+
+    //a flow which never joined an upload has no session to end. the hftpd
+    //does not check the token of a CONTROL_TERM
+    char token[TOKEN_SIZE] = {0};
+    for(int i=0; i<st->count; i++){
+        stripe_flow* flow = &st->flows[i];
+        if(flow->used){
+            message* msg = compose_control_message(CONTROL_TERM, flow->next_seq, NULL, 0, 0, token, 0, 0);
+            free(send_until_valid_ack(msg->buffer[1], msg, flow->sockfd, &flow->server, POLL_TIME));
+            free(msg);
+        }
+        close(flow->sockfd);
+    }
+    free(st->flows);
+    free(st);
+}
@@ -0,0 +1,87 @@
+/* DESCRIPTION: Stripes the upload of a large file over several flows to
+        the hftpd, each from a socket of its own, so the file is not
+        held to the one receive queue and core its first flow is
+        hashed to. The file is cut into chunks, which the flows take in
+        turn and send on threads of their own, each flow waiting only
+        for its own ACKs. The other flows are opened once for a whole
+        session, join each striped upload begun on the first, and are
+        closed with it.                                               */
+
+#ifndef STRIPE_H
+#define STRIPE_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <zlib.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include "../common/udp_client.h"
+#include "../common/udp_sockets.h"
+#include "../common/hftp_messages.h"
+#include "profile.h"
+
+#define STRIPE_CHUNK (64*MAX_DATA_EXT_SIZE) //bytes of a file a flow sends at a time
+#define STRIPE_MIN (16*STRIPE_CHUNK)        //smallest file striped
+
+//a file being striped over the flows
+typedef struct
+{
+    int fd;                     //the file, -1 if it could not be opened
+    char* filename;
+    char* token;
+    uint64_t size;
+    uint64_t num_chunks;
+    atomic_uint_fast64_t next_chunk; //the next chunk for a flow to take
+    uint32_t* crcs;             //the CRC-32 of each chunk alone
+} stripe_job;
+
+//a flow the striped uploads of a session are sent over, besides the first
+typedef struct
+{
+    int sockfd;
+    host server;
+    uint8_t next_seq;           //the next sequence number for RDT
+    bool used;                  //it has tried to join an upload
+    pthread_t thread;
+    stripe_job* job;            //the file being striped
+    udp_counters udp;           //what its thread sent of the file
+    profile_io io;              //what its thread read of the file
+} stripe_flow;
+
+//the flows of a session besides the first
+typedef struct
+{
+    stripe_flow* flows;
+    int count;
+} stripes;
+
+/* opens count flows to the hftpd at fserver:fport, besides the session's
+   first. returns NULL if count is 0 */
+stripes* stripes_open(char* fserver, char* fport, int count);
+
+/* returns true if the file at path, of size bytes, is worth striping over
+   st: it is large, and has no holes, which are sent as runs of zeros
+   over the first flow instead */
+bool stripe_worth(stripes* st, char* path, uint64_t size);
+
+/* sends the size bytes of the file at path, whose striped upload was
+   begun as filename over the first flow of the session, sockfd to server,
+   over it and the flows of st. next_seq is the first flow's sequence
+   number. returns the CRC-32 of what was sent */
+uint32_t stripe_send(stripes* st, int sockfd, host* server, uint8_t* next_seq, char* path, char* filename, char* token, uint64_t size);
+
+/* ends the session of every flow of st, closes them, and frees st */
+void stripes_close(stripes* st);
+
+#endif /* STRIPE_H */
@@ -0,0 +1,209 @@
+#include "thread_pool.h"
+
+//the pool the calling thread works for, and its index in it
+static __thread thread_pool* own_pool = NULL;
+static __thread int own_index = -1;
+
+//what a worker thread needs to know about itself
+typedef struct
+{
+    thread_pool* pool;
+    int index;
+} worker_arg;
+
+/* adds t to the back of d, growing d if it is full */
+static void deque_push(task_deque* d, task t){
+    pthread_mutex_lock(&d->lock);
+    if(d->back - d->front > d->mask){
+        //double the buffer, keeping every task at the same position
+        size_t size = (d->mask + 1)*2;
+        task* tasks = (task*)malloc(size*sizeof(task));
+        for(size_t i = d->front; i != d->back; i++){
+            tasks[i & (size-1)] = d->tasks[i & d->mask];
+        }
+        free(d->tasks);
+        d->tasks = tasks;
+        d->mask = size - 1;
+    }
+    d->tasks[d->back++ & d->mask] = t;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* takes the newest task of d into t. returns false if d is empty */
+static bool deque_pop(task_deque* d, task* t){
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if(d->back != d->front){
+        *t = d->tasks[--d->back & d->mask];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/* takes the oldest task of d into t. returns false if d is empty */
+static bool deque_steal(task_deque* d, task* t){
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if(d->back != d->front){
+        *t = d->tasks[d->front++ & d->mask];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/* returns true if any deque of pool has a task */
+static bool has_tasks(thread_pool* pool){
+    for(int i=0; i<pool->num_threads; i++){
+        task_deque* d = &pool->deques[i];
+        pthread_mutex_lock(&d->lock);
+        bool empty = d->back == d->front;
+        pthread_mutex_unlock(&d->lock);
+        if(!empty) return true;
+    }
+    return false;
+}
+
+/* finds the next task for worker index: its own newest, or else the
+   oldest task of another worker. returns false if there are none */
+static bool find_task(thread_pool* pool, int index, task* t){
+    if(deque_pop(&pool->deques[index], t)) return true;
+
+    for(int i=1; i<pool->num_threads; i++){
+        if(deque_steal(&pool->deques[(index+i) % pool->num_threads], t)) return true;
+    }
+    return false;
+}
+
+/* the body of each worker: runs tasks, sleeping while there are none */
+static void* worker(void* arg){
+    thread_pool* pool = ((worker_arg*)arg)->pool;
+    int index = ((worker_arg*)arg)->index;
+    free(arg);
+    own_pool = pool;
+    own_index = index;
+
+    while(1){
+        task t;
+        if(find_task(pool, index, &t)){
+            t.fn(t.arg);
+
+            //wake pool_wait() once the last task is done
+            if(atomic_fetch_sub(&pool->pending, 1) == 1){
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->done);
+                pthread_mutex_unlock(&pool->idle_lock);
+            }
+            continue;
+        }
+
+        //nothing to do. announce that we are going to sleep, then check once
+        //more so a task pushed before the announcement is not slept through
+        pthread_mutex_lock(&pool->idle_lock);
+        if(pool->stop){
+            pthread_mutex_unlock(&pool->idle_lock);
+            break;
+        }
+        atomic_fetch_add(&pool->sleepers, 1);
+        if(!has_tasks(pool)){
+            pthread_cond_wait(&pool->idle, &pool->idle_lock);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+
+    return NULL;
+}
+
+/* creates a pool of num_threads workers */
+thread_pool* pool_create(int num_threads){
+    thread_pool* pool = (thread_pool*)calloc(1, sizeof(thread_pool));
+    pool->num_threads = num_threads;
+    atomic_init(&pool->next_deque, 0);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->sleepers, 0);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    pool->deques = (task_deque*)calloc(num_threads, sizeof(task_deque));
+    for(int i=0; i<num_threads; i++){
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].tasks = (task*)malloc(DEQUE_INITIAL_SIZE*sizeof(task));
+        pool->deques[i].mask = DEQUE_INITIAL_SIZE - 1;
+    }
+
+    pool->threads = (pthread_t*)malloc(num_threads*sizeof(pthread_t));
+    for(int i=0; i<num_threads; i++){
+        worker_arg* arg = (worker_arg*)malloc(sizeof(worker_arg));
+        arg->pool = pool;
+        arg->index = i;
+        if(pthread_create(&pool->threads[i], NULL, worker, arg) != 0){
+            syslog(LOG_ERR, "Could not start worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return pool;
+}
+
+/* adds a task to the pool. called from a worker, the task goes on that
+   worker's own deque */
+void pool_submit(thread_pool* pool, void (*fn)(void*), void* arg){
+    task t = {
+        .fn = fn,
+        .arg = arg
+    };
+
+    //count the task before it can be run, so pool_wait() cannot miss it
+    atomic_fetch_add(&pool->pending, 1);
+    int index = pool_worker_index(pool);
+    if(index == -1){
+        index = atomic_fetch_add(&pool->next_deque, 1) % pool->num_threads;
+    }
+    deque_push(&pool->deques[index], t);
+
+    //wake a sleeping worker to take it, or steal it
+    if(atomic_load(&pool->sleepers) > 0){
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+/* waits until every task submitted to the pool, and every task they
+   submitted in turn, has finished */
+void pool_wait(thread_pool* pool){
+    pthread_mutex_lock(&pool->idle_lock);
+    while(atomic_load(&pool->pending) > 0){
+        pthread_cond_wait(&pool->done, &pool->idle_lock);
+    }
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/* returns the index of the calling worker in pool, or -1 if it is not one */
+int pool_worker_index(thread_pool* pool){
+    return own_pool == pool ? own_index : -1;
+}
+
+/* stops the workers and frees pool. the pool must be idle */
+void pool_destroy(thread_pool* pool){
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    for(int i=0; i<pool->num_threads; i++){
+        pthread_join(pool->threads[i], NULL);
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->done);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,70 @@
+/* DESCRIPTION: A work-stealing thread pool. Each worker owns a deque of
+        tasks: it pushes the tasks it creates onto the back of its own
+        deque and takes its next task from the back too, so it works
+        depth first through what it has just found. A worker whose
+        deque is empty steals from the front of another's, where the
+        oldest (and usually largest) pieces of work are.             */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define DEQUE_INITIAL_SIZE 64
+
+//a piece of work: fn is called with arg
+typedef struct
+{
+    void (*fn)(void* arg);
+    void* arg;
+} task;
+
+//a worker's tasks. the owner uses the back, thieves the front
+typedef struct
+{
+    pthread_mutex_t lock;
+    task* tasks;            //circular buffer of tasks
+    size_t mask;            //size of tasks - 1, a power of two minus one
+    size_t front;           //position of the oldest task
+    size_t back;            //position after the newest task
+} task_deque;
+
+typedef struct thread_pool
+{
+    int num_threads;
+    pthread_t* threads;
+    task_deque* deques;     //one per worker
+    atomic_uint next_deque; //deque the next task submitted from outside goes to
+    atomic_long pending;    //tasks submitted but not yet finished
+    atomic_int sleepers;    //workers waiting for tasks
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;    //signalled when tasks are added
+    pthread_cond_t done;    //signalled when the last pending task finishes
+    bool stop;
+} thread_pool;
+
+/* creates a pool of num_threads workers */
+thread_pool* pool_create(int num_threads);
+
+/* adds a task to the pool. called from a worker, the task goes on that
+   worker's own deque */
+void pool_submit(thread_pool* pool, void (*fn)(void*), void* arg);
+
+/* waits until every task submitted to the pool, and every task they
+   submitted in turn, has finished */
+void pool_wait(thread_pool* pool);
+
+/* returns the index of the calling worker in pool, or -1 if it is not one */
+int pool_worker_index(thread_pool* pool);
+
+/* stops the workers and frees pool. the pool must be idle */
+void pool_destroy(thread_pool* pool);
+
+#endif /* THREAD_POOL_H */
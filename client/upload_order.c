@@ -0,0 +1,178 @@
+#include "client.h"
+
+//the names of the orders, as given to --order
+static const char* order_names[NUM_ORDERS] = {"server", "size", "mtime", "extent"};
+
+/* orders files by key, then tie */
+static int compare_files(const void* a, const void* b){
+    const ordered_file* fa = (const ordered_file*)a;
+    const ordered_file* fb = (const ordered_file*)b;
+    if(fa->key != fb->key) return fa->key < fb->key ? -1 : 1;
+    if(fa->tie != fb->tie) return fa->tie < fb->tie ? -1 : 1;
+    return 0;
+}
+
+/* returns the physical offset of the first extent of the file at path,
+   or UINT64_MAX if the filesystem cannot say */
+static uint64_t first_extent(char* path){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) return UINT64_MAX;
+
+    //room for the header and a single extent
+    union {
+        struct fiemap map;
+        uint8_t bytes[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } fm;
+    memset(&fm, 0, sizeof(fm));
+    fm.map.fm_start = 0;
+    fm.map.fm_length = FIEMAP_MAX_OFFSET;
+    fm.map.fm_extent_count = 1;
+
+    uint64_t physical = UINT64_MAX;
+    if(ioctl(fd, FS_IOC_FIEMAP, &fm.map) == 0 && fm.map.fm_mapped_extents > 0){
+        physical = fm.map.fm_extents[0].fe_physical;
+    }
+    close(fd);
+    return physical;
+}
+
+/* returns the order called name, or -1 if there is none */
+int order_parse(char* name){
+    for(int i=0; i<NUM_ORDERS; i++){
+        if(strcmp(name, order_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+/* returns the name of order */
+const char* order_name(int order){
+    return order_names[order];
+}
+
+/* splits the list of requested files into an array in the given order,
+   setting count. the filenames are copied, and freed with the array by
+   order_free() */
+ordered_file* order_files(char* requested_files, file_index* files, char* root_dir, int order, int* count){
+    int size = 64;
+    ordered_file* ordered = (ordered_file*)malloc(size*sizeof(ordered_file));
+    *count = 0;
+
+    //every requested filename ends with a '\n'
+    char* start = requested_files;
+    char* end;
+    while((end = strchr(start, '\n')) != NULL){
+        if(end == start){
+            start++;
+            continue;
+        }
+        if(*count == size){
+            size *= 2;
+            ordered = (ordered_file*)realloc(ordered, size*sizeof(ordered_file));
+        }
+        ordered_file* file = &ordered[(*count)++];
+        file->filename = strndup(start, end - start);
+        file->key = *count;
+        file->tie = 0;
+        start = end + 1;
+    }
+    if(order == ORDER_SERVER) return ordered;
+
+    //find each file's key. a file the key cannot be found for goes last
+    for(int i=0; i<*count; i++){
+        ordered_file* file = &ordered[i];
+        char* abs_path;
+        struct stat st;
+        asprintf(&abs_path, "%s/%s", root_dir, file->filename);
+        bool found = stat(abs_path, &st) == 0;
+        file->tie = file->key;
+
+        if(order == ORDER_SIZE){
+            size_t record = index_find(files, file->filename);
+            file->key = record != INDEX_NONE ? files->sizes[record] : UINT64_MAX;
+        }else if(order == ORDER_MTIME){
+            //newest first, so the key counts back from the end of time
+            file->key = found ? UINT64_MAX - ((uint64_t)st.st_mtim.tv_sec*1000000000ULL + st.st_mtim.tv_nsec) : UINT64_MAX;
+        }else if(order == ORDER_EXTENT){
+            //files without extents, such as empty ones or those on
+            //filesystems which cannot map them, go by inode number
+            file->key = first_extent(abs_path);
+            if(file->key == UINT64_MAX && found){
+                file->key = UINT64_MAX - 1;
+                file->tie = st.st_ino;
+            }
+        }
+        free(abs_path);
+    }
+
+    qsort(ordered, *count, sizeof(ordered_file), compare_files);
+    return ordered;
+}
+
+/* frees an array returned by order_files() */
+void order_free(ordered_file* ordered, int count){
+    for(int i=0; i<count; i++){
+        free(ordered[i].filename);
+    }
+    free(ordered);
+}
+
+/* returns the path of the history of uploads for username's root_dir */
+char* order_history_path(char* username, char* root_dir){
+    //kept next to the scan cache, with its own extension
+    char* path = cache_path(username, root_dir);
+    strcpy(path + strlen(path) - strlen("idx"), "ord");
+    return path;
+}
+
+/* adds a run which uploaded bytes in seconds in the given order to the
+   history at path, and logs the order which has been fastest */
+void order_record(char* path, int order, uint64_t files, uint64_t bytes, double seconds){
+    syslog(LOG_INFO, "Uploaded %lu file(s), %.1f MB in %.2f s in %s order",
+           (unsigned long)files, bytes/1e6, seconds, order_name(order));
+    if(files == 0) return;
+
+    //each line of the history is a run: order, files, bytes and seconds
+    make_parent_dirs(path);
+    FILE* f = fopen(path, "a+");
+    if(f == NULL){
+        syslog(LOG_WARNING, "Could not write upload history %s", path);
+        return;
+    }
+    fprintf(f, "%s %lu %lu %.6f\n", order_name(order), (unsigned long)files, (unsigned long)bytes, seconds);
+    fflush(f);
+
+    //total the runs of each order
+    double total_bytes[NUM_ORDERS] = {0};
+    double total_seconds[NUM_ORDERS] = {0};
+    int runs[NUM_ORDERS] = {0};
+    char name[16];
+    unsigned long run_files, run_bytes;
+    double run_seconds;
+    rewind(f);
+    while(fscanf(f, "%15s %lu %lu %lf", name, &run_files, &run_bytes, &run_seconds) == 4){
+        int i = order_parse(name);
+        if(i == -1 || run_seconds <= 0) continue;
+        total_bytes[i] += run_bytes;
+        total_seconds[i] += run_seconds;
+        runs[i]++;
+    }
+    fclose(f);
+
+    //the fastest order is the one which moved the most bytes a second
+    int best = -1;
+    for(int i=0; i<NUM_ORDERS; i++){
+        if(runs[i] == 0) continue;
+        if(best == -1 || total_bytes[i]/total_seconds[i] > total_bytes[best]/total_seconds[best]){
+            best = i;
+        }
+    }
+    if(best != -1){
+        syslog(LOG_INFO, "Fastest order for this directory so far: %s, %.1f MB/s over %d run(s)",
+               order_name(best), total_bytes[best]/total_seconds[best]/1e6, runs[best]);
+    }
+    for(int i=0; i<NUM_ORDERS; i++){
+        if(runs[i] > 0){
+            syslog(LOG_DEBUG, "  %s: %.1f MB/s over %d run(s)", order_name(i), total_bytes[i]/total_seconds[i]/1e6, runs[i]);
+        }
+    }
+}
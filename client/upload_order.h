@@ -0,0 +1,65 @@
+/* DESCRIPTION: Chooses the order in which requested files are uploaded.
+        The server's order is the scan's. Smallest first uploads the
+        most files soonest, newest first uploads the latest changes
+        soonest, and extent order reads the files in the order they
+        lie on the disk, so the reads are sequential rather than
+        random. Each run's upload rate is kept in a history file for
+        the directory, so the order which uploads it fastest can be
+        found by trying each.                                        */
+
+#ifndef UPLOAD_ORDER_H
+#define UPLOAD_ORDER_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "file_index.h"
+
+//the orders files can be uploaded in
+#define ORDER_SERVER 0          //as the hmds requested them
+#define ORDER_SIZE 1            //smallest first
+#define ORDER_MTIME 2           //most recently modified first
+#define ORDER_EXTENT 3          //by where their data starts on the disk
+#define NUM_ORDERS 4
+
+//a requested file and where it goes in the order
+typedef struct
+{
+    char* filename;
+    uint64_t key;               //files are uploaded by increasing key
+    uint64_t tie;               //then by increasing tie
+} ordered_file;
+
+/* returns the order called name, or -1 if there is none */
+int order_parse(char* name);
+
+/* returns the name of order */
+const char* order_name(int order);
+
+/* splits the list of requested files into an array in the given order,
+   setting count. the filenames are copied, and freed with the array by
+   order_free() */
+ordered_file* order_files(char* requested_files, file_index* files, char* root_dir, int order, int* count);
+
+/* frees an array returned by order_files() */
+void order_free(ordered_file* ordered, int count);
+
+/* returns the path of the history of uploads for username's root_dir */
+char* order_history_path(char* username, char* root_dir);
+
+/* adds a run which uploaded bytes in seconds in the given order to the
+   history at path, and logs the order which has been fastest */
+void order_record(char* path, int order, uint64_t files, uint64_t bytes, double seconds);
+
+#endif /* UPLOAD_ORDER_H */
@@ -0,0 +1,123 @@
+/* DESCRIPTION: Uploads batches of files to the hftpd on a thread of its
+        own.                                                          */
+
+#include "client.h"
+
+/* the body of the upload thread: sends each batch as it is queued */
+static void* upload_thread(void* arg){
+    uploader* up = (uploader*)arg;
+
+    while(1){
+        pthread_mutex_lock(&up->lock);
+        while(up->head == NULL && !up->closed){
+            pthread_cond_wait(&up->ready, &up->lock);
+        }
+        upload_batch* batch = up->head;
+        if(batch == NULL){
+            //closed, and every batch is sent
+            pthread_mutex_unlock(&up->lock);
+            break;
+        }
+        up->head = batch->next;
+        if(up->head == NULL){
+            up->tail = NULL;
+        }
+        up->queued--;
+        pthread_cond_signal(&up->taken);
+        pthread_mutex_unlock(&up->lock);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        up->stats.files += send_files(up->session, batch->requested, batch->files, up->token, up->root_dir, up->order, &up->stats.bytes, up->learned);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        up->stats.seconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+        index_free(batch->files);
+        free(batch->requested);
+        free(batch);
+    }
+
+    return NULL;
+}
+
+/* opens an hftp session with the hftpd at fserver:fport, whose large files
+   are striped over flows flows */
+hftp_session* hftp_open(char* fserver, char* fport, int flows){
+    hftp_session* session = (hftp_session*)calloc(1, sizeof(hftp_session));
+    session->sockfd = create_client_socket(fserver, fport, &session->server);
+    session->others = stripes_open(fserver, fport, flows - 1);
+    return session;
+}
+
+/* ends session, closes its flows and frees it */
+void hftp_close(hftp_session* session){
+    //the hftpd does not check the token of a CONTROL_TERM
+    char token[TOKEN_SIZE] = {0};
+    message* msg = compose_control_message(CONTROL_TERM, session->next_seq, NULL, 0, 0, token, 0, 0);
+    free(send_until_valid_ack(msg->buffer[1], msg, session->sockfd, &session->server, POLL_TIME));
+    free(msg);
+    close(session->sockfd);
+    stripes_close(session->others);
+    free(session);
+}
+
+/* starts a thread which uploads files from root_dir over session under
+   token, in the given order. the checksums of files hashed as they are
+   sent are added to learned, if it is not NULL */
+uploader* uploader_start(hftp_session* session, char* token, char* root_dir, int order, cache_writer* learned){
+    uploader* up = (uploader*)calloc(1, sizeof(uploader));
+    up->session = session;
+    up->token = token;
+    up->root_dir = root_dir;
+    up->order = order;
+    up->learned = learned;
+    pthread_mutex_init(&up->lock, NULL);
+    pthread_cond_init(&up->ready, NULL);
+    pthread_cond_init(&up->taken, NULL);
+
+    if(pthread_create(&up->thread, NULL, upload_thread, up) != 0){
+        syslog(LOG_ERR, "Could not start upload thread");
+        exit(EXIT_FAILURE);
+    }
+    return up;
+}
+
+/* queues the requested files of files for upload, first waiting while
+   the queue is full. the uploader frees both once they are sent */
+void uploader_push(uploader* up, file_index* files, char* requested){
+    upload_batch* batch = (upload_batch*)malloc(sizeof(upload_batch));
+    batch->files = files;
+    batch->requested = requested;
+    batch->next = NULL;
+
+    pthread_mutex_lock(&up->lock);
+    while(up->queued >= UPLOAD_QUEUE_MAX){
+        pthread_cond_wait(&up->taken, &up->lock);
+    }
+    if(up->tail != NULL){
+        up->tail->next = batch;
+    }else{
+        up->head = batch;
+    }
+    up->tail = batch;
+    up->queued++;
+    pthread_cond_signal(&up->ready);
+    pthread_mutex_unlock(&up->lock);
+}
+
+/* waits for every queued batch to be uploaded, then frees up. if stats
+   is not NULL, it is set to what was sent */
+void uploader_finish(uploader* up, upload_stats* stats){
+    pthread_mutex_lock(&up->lock);
+    up->closed = true;
+    pthread_cond_signal(&up->ready);
+    pthread_mutex_unlock(&up->lock);
+
+    pthread_join(up->thread, NULL);
+    if(stats != NULL){
+        *stats = up->stats;
+    }
+    pthread_mutex_destroy(&up->lock);
+    pthread_cond_destroy(&up->ready);
+    pthread_cond_destroy(&up->taken);
+    free(up);
+}
@@ -0,0 +1,95 @@
+/* DESCRIPTION: Uploads batches of files to the hftpd on a thread of its
+        own, so the next batches can be scanned and sent to the hmds
+        while the files of earlier ones are still being uploaded.
+        Batches are uploaded in the order they are queued, over the
+        hftp session the uploader is given, which may outlive it and
+        carry the files of other users too. Only a few batches may
+        wait at once, so a sync faster than its uploads does not fill
+        memory.                                                       */
+
+#ifndef UPLOADER_H
+#define UPLOADER_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "file_index.h"
+#include "scan_cache.h"
+#include "stripe.h"
+
+#define UPLOAD_QUEUE_MAX 8 //batches waiting before uploader_push() waits too
+
+//an hftp session with the hftpd. each CONTROL_INIT carries the token of
+//the file's owner, so files of any user may be uploaded over it
+typedef struct hftp_session
+{
+    int sockfd;                 //the socket connected to the hftpd
+    host server;                //address of the hftpd
+    uint8_t next_seq;           //the next sequence number for RDT
+    int server_version;         //the version the hftpd speaks, 0 until it has replied
+    stripes* others;            //the other flows a large file is striped over, NULL if none
+} hftp_session;
+
+//files waiting to be uploaded
+typedef struct upload_batch
+{
+    file_index* files;          //the files of a LIST request
+    char* requested;            //the ones the hmds requested
+    struct upload_batch* next;
+} upload_batch;
+
+//what an uploader sent
+typedef struct
+{
+    uint64_t files;
+    uint64_t bytes;
+    double seconds;             //time spent sending
+} upload_stats;
+
+//an upload thread and its queue
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       //signalled when a batch is queued or the queue closes
+    pthread_cond_t taken;       //signalled when a batch is taken from the queue
+    upload_batch* head;         //next batch to upload
+    upload_batch* tail;
+    int queued;                 //batches in the queue
+    bool closed;                //no more batches will be queued
+
+    hftp_session* session;      //the session files are sent over
+    char* token;                //token of the user
+    char* root_dir;             //directory the files are read from
+    int order;                  //the order files are sent in
+    cache_writer* learned;      //where checksums found while sending are cached, or NULL
+    upload_stats stats;         //what has been sent so far
+} uploader;
+
+/* opens an hftp session with the hftpd at fserver:fport, whose large files
+   are striped over flows flows */
+hftp_session* hftp_open(char* fserver, char* fport, int flows);
+
+/* ends session, closes its flows and frees it */
+void hftp_close(hftp_session* session);
+
+/* starts a thread which uploads files from root_dir over session under
+   token, in the given order. the checksums of files hashed as they are
+   sent are added to learned, if it is not NULL */
+uploader* uploader_start(hftp_session* session, char* token, char* root_dir, int order, cache_writer* learned);
+
+/* queues the requested files of files for upload, first waiting while
+   the queue is full. the uploader frees both once they are sent */
+void uploader_push(uploader* up, file_index* files, char* requested);
+
+/* waits for every queued batch to be uploaded, then frees up. if stats
+   is not NULL, it is set to what was sent */
+void uploader_finish(uploader* up, upload_stats* stats);
+
+#endif /* UPLOADER_H */
@@ -0,0 +1,311 @@
+/* DESCRIPTION: Keeps the Hooli directory in sync as it changes, sending
+        batches of the paths named by inotify events.                 */
+
+#include "client.h"
+
+//set by SIGINT and SIGTERM
+static volatile sig_atomic_t stop_watching = 0;
+
+/* stops the watch once the current batch is done */
+static void stop_handler(int signal){
+    stop_watching = 1;
+}
+
+/* returns the current time in ms */
+static int64_t now_ms(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+/* adds path to the paths changed since the last batch, taking ownership of it */
+static void touch(watch* w, char* path){
+    w->last_ms = now_ms();
+    if(w->touched->count == 0){
+        w->first_ms = w->last_ms;
+    }
+    index_put(w->touched, path, 0, 0);
+    free(path);
+}
+
+/* watches the directory at relative_dir and every directory below it
+   which is not left out by the rules of ignore, which is freed. if
+   touch_files is set, the files found in them are touched, as they may
+   have been written before the watch began */
+static void add_watch(watch* w, char* root_dir, char* relative_dir, bool touch_files, ignore_context* ignore){
+    char* path;
+    asprintf(&path, "%s/%s", root_dir, relative_dir);
+
+    int wd = inotify_add_watch(w->fd, path, WATCH_EVENTS | IN_ONLYDIR);
+    if(wd == -1){
+        if(errno == ENOSPC){
+            syslog(LOG_WARNING, "Cannot watch '%s': raise fs.inotify.max_user_watches", path);
+        }else{
+            syslog(LOG_WARNING, "Cannot watch '%s'", path);
+        }
+        ignore_context_free(ignore);
+        free(path);
+        return;
+    }
+
+    //remember the directory under its watch descriptor
+    if(wd >= w->num_dirs){
+        int num_dirs = w->num_dirs ? w->num_dirs : 64;
+        while(num_dirs <= wd) num_dirs *= 2;
+        w->dirs = (char**)realloc(w->dirs, num_dirs*sizeof(char*));
+        memset(w->dirs + w->num_dirs, 0, (num_dirs - w->num_dirs)*sizeof(char*));
+        w->num_dirs = num_dirs;
+    }
+    free(w->dirs[wd]);
+    w->dirs[wd] = strdup(relative_dir);
+
+    DIR* d = opendir(path);
+    if(!d){
+        syslog(LOG_WARNING, "Cannot open directory '%s'", path);
+        ignore_context_free(ignore);
+        free(path);
+        return;
+    }
+    ignore = ignore_enter(ignore, dirfd(d));
+
+    struct dirent* entry;
+    while((entry = readdir(d))){
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        //links are followed, as they are by the scan
+        unsigned char type = entry->d_type;
+        if(type == DT_UNKNOWN || type == DT_LNK){
+            char* entry_path;
+            struct stat st;
+            asprintf(&entry_path, "%s/%s", path, entry->d_name);
+            type = DT_UNKNOWN;
+            if(stat(entry_path, &st) == 0){
+                if(S_ISDIR(st.st_mode)) type = DT_DIR;
+                else if(S_ISREG(st.st_mode)) type = DT_REG;
+            }
+            free(entry_path);
+        }
+
+        //ignored directories are not watched, as they are not scanned
+        ignore_context* child = NULL;
+        if((type == DT_DIR || type == DT_REG) && ignore_match(ignore, entry->d_name, type == DT_DIR, &child)) continue;
+
+        char* relative_path;
+        if(type == DT_DIR){
+            asprintf(&relative_path, "%s%s/", relative_dir, entry->d_name);
+            add_watch(w, root_dir, relative_path, touch_files, child);
+            free(relative_path);
+        }else if(type == DT_REG && touch_files){
+            asprintf(&relative_path, "%s%s", relative_dir, entry->d_name);
+            touch(w, relative_path);
+        }
+    }
+
+    closedir(d);
+    ignore_context_free(ignore);
+    free(path);
+}
+
+/* stops watching the directory at relative_dir and every directory below it */
+static void remove_watches(watch* w, char* relative_dir){
+    size_t len = strlen(relative_dir);
+    for(int wd=0; wd<w->num_dirs; wd++){
+        if(w->dirs[wd] != NULL && strncmp(w->dirs[wd], relative_dir, len) == 0){
+            inotify_rm_watch(w->fd, wd);
+            free(w->dirs[wd]);
+            w->dirs[wd] = NULL;
+        }
+    }
+}
+
+/* reads the pending events of w, touching the paths they name */
+static void read_events(watch* w, char* root_dir){
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(w->fd, buf, sizeof(buf));
+    if(len == -1){
+        if(errno == EINTR || errno == EAGAIN) return;
+        syslog(LOG_ERR, "Could not read inotify events");
+        exit(EXIT_FAILURE);
+    }
+
+    for(char* ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len){
+        struct inotify_event* event = (struct inotify_event*)ptr;
+
+        if(event->mask & IN_Q_OVERFLOW){
+            syslog(LOG_WARNING, "Too many changes at once, the directory will be scanned again");
+            w->overflow = true;
+            w->last_ms = now_ms();
+            continue;
+        }
+        if(event->wd < 0 || event->wd >= w->num_dirs || w->dirs[event->wd] == NULL) continue;
+
+        //the watch is gone, because its directory was removed
+        if(event->mask & IN_IGNORED){
+            if(w->dirs[event->wd][0] == '\0'){
+                syslog(LOG_ERR, "The Hooli directory was removed");
+                stop_watching = 1;
+            }
+            free(w->dirs[event->wd]);
+            w->dirs[event->wd] = NULL;
+            continue;
+        }
+
+        //events about the directory itself are also seen by its parent
+        if(event->len == 0) continue;
+
+        char* path;
+        if(event->mask & IN_ISDIR){
+            asprintf(&path, "%s%s/", w->dirs[event->wd], event->name);
+            ignore_context* ignore;
+            if(event->mask & (IN_CREATE | IN_MOVED_TO) && !ignore_path(root_dir, path, &ignore)){
+                add_watch(w, root_dir, path, true, ignore);
+            }else if(event->mask & IN_MOVED_FROM){
+                remove_watches(w, path);
+            }
+            touch(w, path);
+        }else if(!(event->mask & IN_CREATE)){
+            //a new file is sent once it is closed
+            asprintf(&path, "%s%s", w->dirs[event->wd], event->name);
+            touch(w, path);
+        }
+    }
+}
+
+/* checksums the paths touched since the last batch, and syncs the ones
+   which are new or changed. the index is updated once the hmds has
+   taken them */
+static void send_batch(watch* w, sync_config* config, file_index** index, int threads, char* cache_file){
+    //events were lost, so nothing but a new scan can say what changed
+    if(w->overflow){
+        file_index* fresh = index_create((*index)->count);
+        iterate_dirs(config->root_dir, fresh, threads, cache_file);
+        index_free(w->touched);
+        w->touched = index_create(0);
+
+        if(sync_tree(config, fresh)){
+            index_free(*index);
+            *index = fresh;
+            w->overflow = false;
+        }else{
+            index_free(fresh);
+            w->retry_ms = now_ms() + WATCH_RETRY_MS;
+        }
+        return;
+    }
+
+    file_index* batch = index_create(0);
+    file_index* touched = w->touched;
+    w->touched = index_create(0);
+    for(size_t i=0; i<touched->count; i++){
+        char* path = index_path(touched, i);
+        char* abs_path;
+        struct stat st;
+        asprintf(&abs_path, "%s/%s", config->root_dir, path);
+        bool is_dir = path[strlen(path)-1] == '/';
+
+        if(stat(abs_path, &st) != 0 || (is_dir ? !S_ISDIR(st.st_mode) : !S_ISREG(st.st_mode) || access(abs_path, R_OK) != 0)
+           || ignore_path(config->root_dir, path, NULL)){
+            //the path is gone, or is now left out. the server keeps its copy
+            index_remove_path(*index, path);
+        }else if(!is_dir){
+            //the files of a new directory were touched when it was watched
+            uint64_t size;
+            uint32_t checksum = crc(abs_path, &size);
+            size_t record = index_find(*index, path);
+            if(record == INDEX_NONE || (*index)->checksums[record] != checksum){
+                index_put(batch, path, checksum, size);
+            }
+        }
+        free(abs_path);
+    }
+    index_free(touched);
+
+    if(batch->count > 0){
+        syslog(LOG_INFO, "Syncing %lu changed file(s)", (unsigned long)batch->count);
+        if(sync_files(config, batch)){
+            index_merge(*index, batch);
+        }else{
+            //try again later. the files are checksummed again then, in case
+            //they changed in the meantime
+            for(size_t i=0; i<batch->count; i++){
+                touch(w, strdup(index_path(batch, i)));
+            }
+            w->retry_ms = now_ms() + WATCH_RETRY_MS;
+        }
+    }
+    index_free(batch);
+}
+
+/* watches config->root_dir, syncing whatever changes in it until SIGINT
+   or SIGTERM. files is the index found by the scan, and is freed when
+   watching stops. threads and cache_file are used to scan again if
+   events are lost */
+void watch_dir(sync_config* config, file_index* files, int threads, char* cache_file){
+    watch w = {
+        .fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC),
+        .touched = index_create(0)
+    };
+    if(w.fd == -1){
+        syslog(LOG_ERR, "Could not start watching '%s'", config->root_dir);
+        exit(EXIT_FAILURE);
+    }
+
+    //stop between batches rather than part way through an upload
+    struct sigaction action;
+    action.sa_handler = stop_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    //changes made between the scan and the watch are missed, so the root
+    //is watched before anything in it is read again
+    add_watch(&w, config->root_dir, "", false, NULL);
+    syslog(LOG_INFO, "Watching %s for changes", config->root_dir);
+
+    struct pollfd pfd = {
+        .fd = w.fd,
+        .events = POLLIN
+    };
+    while(!stop_watching){
+        //send a batch once the directory has been quiet for a moment, or
+        //the oldest change has waited long enough
+        int timeout = -1;
+        if(w.touched->count > 0 || w.overflow){
+            int64_t deadline = w.last_ms + WATCH_QUIET_MS;
+            if(deadline > w.first_ms + WATCH_MAX_DELAY_MS){
+                deadline = w.first_ms + WATCH_MAX_DELAY_MS;
+            }
+            if(deadline < w.retry_ms){
+                deadline = w.retry_ms;
+            }
+
+            int64_t now = now_ms();
+            if(now >= deadline){
+                send_batch(&w, config, &files, threads, cache_file);
+                continue;
+            }
+            timeout = deadline - now;
+        }
+
+        //sleep until something changes
+        int ready = poll(&pfd, 1, timeout);
+        if(ready == -1){
+            if(errno == EINTR) continue;
+            syslog(LOG_ERR, "Could not wait for changes");
+            exit(EXIT_FAILURE);
+        }
+        if(ready > 0){
+            read_events(&w, config->root_dir);
+        }
+    }
+
+    syslog(LOG_INFO, "Stopped watching %s", config->root_dir);
+    index_free(w.touched);
+    for(int wd=0; wd<w.num_dirs; wd++){
+        free(w.dirs[wd]);
+    }
+    free(w.dirs);
+    close(w.fd);
+    index_free(files);
+}
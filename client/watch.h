@@ -0,0 +1,75 @@
+/* DESCRIPTION: Keeps the Hooli directory in sync as it changes. Every
+        directory is watched with inotify, and the paths named by its
+        events are collected until the directory has been quiet for a
+        moment. Only those paths are then checksummed, and only the
+        ones which changed are sent to the hmds in a LIST request and
+        uploaded. The index of files found by the first scan stays in
+        memory, so the directory is never scanned again unless events
+        were lost.                                                    */
+
+#ifndef WATCH_H
+#define WATCH_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "file_index.h"
+#include "ignore.h"
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_DELETE_SELF)
+#define WATCH_QUIET_MS 200      //how long the directory must be quiet before a batch is sent
+#define WATCH_MAX_DELAY_MS 2000 //longest a change waits while the directory stays busy
+#define WATCH_RETRY_MS 5000     //wait before a batch the hmds refused is sent again
+
+//the servers and account a directory is synced to
+typedef struct
+{
+    char* hostname;         //hostname of the hmds
+    char* port;             //port of the hmds
+    char* fserver;          //hostname of the hftpd
+    char* fport;            //port of the hftpd
+    char* username;
+    char* password;
+    char* root_dir;         //the Hooli directory
+    int order;              //the order files are uploaded in
+    int flows;              //flows a large file is striped over
+    char* history_file;     //where upload rates are kept, NULL if they are not
+    char* cache_file;       //the scan cache, NULL if there is none
+    char* token_file;       //where the hmds token is kept, NULL if it is not
+    int hmds_fd;            //a connection to the hmds kept between syncs, -1 if each opens its own
+    struct hftp_session* session; //an hftp session kept between syncs, NULL if each opens its own
+} sync_config;
+
+//a directory being watched
+typedef struct
+{
+    int fd;                 //the inotify instance
+    char** dirs;            //relative path of each watched directory, by watch descriptor
+    int num_dirs;           //size of dirs
+    file_index* touched;    //paths changed since the last batch. a directory's ends with a '/'
+    int64_t first_ms;       //when the oldest of them changed
+    int64_t last_ms;        //when the newest of them changed
+    int64_t retry_ms;       //when a refused batch may be sent again
+    bool overflow;          //events were lost, so the directory must be scanned again
+} watch;
+
+/* watches config->root_dir, syncing whatever changes in it until SIGINT
+   or SIGTERM. files is the index found by the scan, and is freed when
+   watching stops. threads and cache_file are used to scan again if
+   events are lost */
+void watch_dir(sync_config* config, file_index* files, int threads, char* cache_file);
+
+#endif /* WATCH_H */
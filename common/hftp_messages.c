@@ -0,0 +1,75 @@
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "hftp_messages.h"
+
+/* appends the version 2 and 3 fields to msg, after its filename, and sets
+   the 32-bit filesize for version 1 peers. a message whose filename leaves
+   no room for them stays a version 1 message, and false is returned */
+bool control_set_ext(control_message* msg, uint64_t filesize, uint64_t offset, uint8_t flags){
+    //a version 1 peer sees as much of the size as fits
+    msg->filesize = htonl(filesize > UINT32_MAX ? UINT32_MAX : (uint32_t)filesize);
+    if(ntohs(msg->filename_len) > MAX_FILENAME_SIZE - CONTROL_EXT_SIZE) return false;
+
+    uint8_t* ext = msg->filename + ntohs(msg->filename_len);
+    uint64_t be_filesize = htobe64(filesize);
+    uint64_t be_offset = htobe64(offset);
+
+    ext[0] = HFTP_VERSION;
+    memcpy(ext + 1, &be_filesize, sizeof(be_filesize));
+    memcpy(ext + 9, &be_offset, sizeof(be_offset));
+    ext[17] = flags;
+    msg->length = CONTROL_STATIC_SIZE + ntohs(msg->filename_len) + CONTROL_EXT_SIZE;
+    return true;
+}
+
+/* returns the version of msg, reading its filesize, offset and, if flags
+   is not NULL, its flags. a version 1 message has only its 32-bit
+   filesize, offset 0 and no flags, as does a version 2 message no flags */
+int control_get_ext(control_message* msg, uint64_t* filesize, uint64_t* offset, uint8_t* flags){
+    uint16_t filename_len = ntohs(msg->filename_len);
+    uint8_t* ext = msg->filename + filename_len;
+    if(flags != NULL){
+        *flags = 0;
+    }
+
+    if(filename_len > MAX_FILENAME_SIZE - CONTROL_EXT_V2_SIZE ||
+       msg->length < CONTROL_STATIC_SIZE + filename_len + CONTROL_EXT_V2_SIZE || ext[0] < 2){
+        *filesize = ntohl(msg->filesize);
+        *offset = 0;
+        return 1;
+    }
+
+    uint64_t be_filesize, be_offset;
+    memcpy(&be_filesize, ext + 1, sizeof(be_filesize));
+    memcpy(&be_offset, ext + 9, sizeof(be_offset));
+    *filesize = be64toh(be_filesize);
+    *offset = be64toh(be_offset);
+    if(flags != NULL && ext[0] >= 3 && msg->length >= CONTROL_STATIC_SIZE + filename_len + CONTROL_EXT_SIZE){
+        *flags = ext[17];
+    }
+    return ext[0] < HFTP_VERSION ? ext[0] : HFTP_VERSION;
+}
+
+/* returns the version the peer which sent response speaks */
+int response_version(response_message* response){
+    response_ext_message* ext = (response_ext_message*)response;
+    if(response->length < RESPONSE_EXT_LENGTH || ext->version < 2){
+        return 1;
+    }
+    return ext->version < HFTP_VERSION ? ext->version : HFTP_VERSION;
+}
+
+/* returns the CRC-32 crc extended by len zero bytes, without reading them */
+uint32_t crc32_zeros(uint32_t crc, uint64_t len){
+    //the checksum of 2^i zeros is found for each bit i of len by doubling
+    //the one before, and those of the bits which are set are appended
+    uint8_t zero = 0;
+    uLong power = crc32(0L, &zero, 1);
+    for(int i=0; i<64 && (len >> i) != 0; i++){
+        if((len >> i) & 1){
+            crc = crc32_combine(crc, power, (z_off_t)1 << i);
+        }
+        power = crc32_combine(power, power, (z_off_t)1 << i);
+    }
+    return crc;
+}
@@ -2,6 +2,10 @@
 #define CLIENT_MESSAGES_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <endian.h>
+#include <stddef.h>
 
 #define TOKEN_SIZE 16
 #define MAX_DATA_SIZE 1468 
@@ -11,13 +15,66 @@
 
 #define CONTROL_INIT 1
 #define CONTROL_TERM 2
+#define CONTROL_GET 4
+#define CONTROL_TRAILER 6
 #define CONTROL_STATIC_SIZE 28
 
 #define DATA_TYPE 3
 #define DATA_STATIC_SIZE 4
 
+// Version 2 of the protocol carries 64-bit sizes and offsets. A version 2
+// control message has CONTROL_EXT_SIZE more bytes after its filename: the
+// version, the 64-bit filesize, and the 64-bit offset the transfer starts
+// at. A version 1 peer ignores them and answers with a plain response, so
+// the sender falls back to version 1. A version 2 peer answers with an
+// extended response, and the data messages which follow carry their file
+// offset, which replaces the alternating bit as their sequence number.
+// The extended response is RESPONSE_EXT_LENGTH bytes: the four of a plain
+// one, the version, three reserved bytes, and at bytes 8 to 15 the 64-bit
+// offset of how much of the file the receiver has.
+//
+// Version 3 adds a flags byte after the version 2 fields, which a version
+// 2 peer does not read. A CONTROL_INIT with CONTROL_FLAG_TRAILER set does
+// not know its file's checksum: the sender checksums the data as it sends
+// it, and a CONTROL_TRAILER after the last data message carries the
+// checksum, which the receiver verifies the file against. A sender which
+// finds its peer speaks an older version sends the CONTROL_INIT again
+// with the checksum in it.
+//
+// Version 4 adds DATA_ZERO_TYPE messages, which stand for a run of zero
+// bytes at an offset, however long, in place of the data messages which
+// would carry them. The receiver stores the run as a hole. They are only
+// sent to a version 4 peer.
+//
+// Version 5 lets an upload be striped over several flows, each from a
+// socket of its own, so a large file is not held to the one receive
+// queue and core a single flow is hashed to. The CONTROL_INIT which
+// begins it has CONTROL_FLAG_STRIPED set. Every other flow sends a
+// CONTROL_INIT with CONTROL_FLAG_JOIN set, for the same file under the
+// same token from the same address, and is answered with
+// UPLOAD_NOT_FOUND if there is no such upload. Data messages of the
+// upload then come over any of the flows at any offset, and each flow's
+// alternating bit, rather than the offset, tells a retransmission
+// apart. Its trailer is sent over the first flow once every flow's data
+// has been acknowledged. A sender which finds its peer speaks an older
+// version sends the whole file over the first flow.
+#define HFTP_VERSION 5
+#define CONTROL_EXT_SIZE 18
+#define CONTROL_EXT_V2_SIZE 17
+#define CONTROL_FLAG_TRAILER 1
+#define CONTROL_FLAG_STRIPED 2
+#define CONTROL_FLAG_JOIN 4
+#define DATA_EXT_TYPE 5
+#define DATA_EXT_STATIC_SIZE 12
+#define MAX_DATA_EXT_SIZE 1460
+#define DATA_ZERO_TYPE 7
+#define DATA_ZERO_SIZE 20
+#define RESPONSE_EXT_LENGTH 16
+
 #define RESPONSE_TYPE 255
 #define AUTHENTICATION_ERROR 1
+#define FILE_NOT_FOUND 2
+#define UPLOAD_NOT_FOUND 3
 #define RESPONSE_LENGTH 4
 #define ACK 0
 
@@ -43,6 +100,26 @@ typedef struct
    uint8_t data[MAX_DATA_SIZE];
 } data_message;
 
+typedef struct
+{
+   int length;
+   uint8_t type;
+   uint8_t seq;
+   uint16_t data_len;
+   uint64_t offset;
+   uint8_t data[MAX_DATA_EXT_SIZE];
+} data_ext_message;
+
+typedef struct
+{
+   int length;
+   uint8_t type;
+   uint8_t seq;
+   uint16_t reserved;
+   uint64_t offset;
+   uint64_t zero_len;
+} data_zero_message;
+
 typedef struct
 {
     int length;
@@ -52,4 +129,38 @@ typedef struct
     uint8_t padding[RESPONSE_PADDING];
 } response_message;
 
+//packed, so offset follows reserved on the wire with no padding between.
+//aligned as a message is, which it is cast to and from
+typedef struct __attribute__((packed, aligned(4)))
+{
+    int length;
+    uint8_t type;
+    uint8_t seq;
+    uint16_t err_code;
+    uint8_t version;
+    uint8_t reserved[3];
+    uint64_t offset;
+} response_ext_message;
+
+_Static_assert(offsetof(response_ext_message, offset) - offsetof(response_ext_message, type) == 8,
+               "the offset of an extended response is at bytes 8 to 15");
+_Static_assert(offsetof(response_ext_message, offset) + sizeof(uint64_t) - offsetof(response_ext_message, type) == RESPONSE_EXT_LENGTH,
+               "an extended response ends with its offset");
+
+/* appends the version 2 and 3 fields to msg, after its filename, and sets
+   the 32-bit filesize for version 1 peers. a message whose filename leaves
+   no room for them stays a version 1 message, and false is returned */
+bool control_set_ext(control_message* msg, uint64_t filesize, uint64_t offset, uint8_t flags);
+
+/* returns the version of msg, reading its filesize, offset and, if flags
+   is not NULL, its flags. a version 1 message has only its 32-bit
+   filesize, offset 0 and no flags, as does a version 2 message no flags */
+int control_get_ext(control_message* msg, uint64_t* filesize, uint64_t* offset, uint8_t* flags);
+
+/* returns the version the peer which sent response speaks */
+int response_version(response_message* response);
+
+/* returns the CRC-32 crc extended by len zero bytes, without reading them */
+uint32_t crc32_zeros(uint32_t crc, uint64_t len);
+
 #endif
@@ -0,0 +1,48 @@
+/* DESCRIPTION: The hashes the client and the hdb keep of the Hooli
+        directory, so they can find where it differs without comparing
+        every file. Each file hashes its path and checksum into a
+        leaf, and each directory's hash is the sum of the leaves of
+        every file below it. A sum can be kept up to date one file at
+        a time, by adding the difference between the file's new leaf
+        and its old one to each directory above it, and the hdb does
+        that with HINCRBY. Leaves are 40 bits, so the sums of millions
+        of files still fit in a Redis integer.                       */
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define MERKLE_ROOT "/"             //how the Hooli directory itself is named
+#define MERKLE_LEAF_BITS 40         //bits in the hash of each file
+
+/* returns the leaf of the file at path whose checksum is the hex string checksum */
+static inline uint64_t merkle_leaf(const char* path, const char* checksum){
+    //FNV-1a over the path, a '\0' and the checksum
+    uint64_t hash = 14695981039346656037ULL;
+    for(const unsigned char* c = (const unsigned char*)path; *c; c++){
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    hash *= 1099511628211ULL;
+    for(const unsigned char* c = (const unsigned char*)checksum; *c; c++){
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+
+    //fold the high bits in, as they are the best mixed
+    return (hash ^ (hash >> MERKLE_LEAF_BITS)) & ((1ULL << MERKLE_LEAF_BITS) - 1);
+}
+
+/* returns the length of the path of the directory holding the first len
+   bytes of path. a directory's path ends with a '/', so this is the
+   length of its parent's. 0 is the Hooli directory itself */
+static inline size_t merkle_parent(const char* path, size_t len){
+    //skip a directory's own '/'
+    if(len > 0 && path[len-1] == '/') len--;
+    while(len > 0 && path[len-1] != '/') len--;
+    return len;
+}
+
+#endif /* MERKLE_H */
@@ -13,6 +13,8 @@
 
 #include "socketutils.h"
 
+__thread tcp_counters tcp_counts;
+
 /*  gets the socket address info for a client or server
     to get a socket for a server, set hostname to NULL*/
 struct addrinfo* get_sockaddr(const char* hostname, const char* port){
@@ -46,6 +48,7 @@ char* recv_message(int fd){
     {   
         //peek message and store to buffer
         bytes_read = recv(fd, buffer, sizeof(buffer) - 1, MSG_PEEK);
+        tcp_counts.calls++;
 
         if(bytes_read>0){
             eom = find_eom(buffer, bytes_read, &flag);
@@ -55,6 +58,8 @@ char* recv_message(int fd){
                 //add buffer and null character to message and return the message
                 message_size+=eom;
                 recv(fd, buffer, eom, 0);
+                tcp_counts.calls++;
+                tcp_counts.bytes += eom;
                 bytes_read = asprintf(&message, "%s%s", message, buffer);
                 message[message_size] = '\0';
                 return message;
@@ -63,6 +68,8 @@ char* recv_message(int fd){
                 //end of message not found
                 //add buffer to message and keep on searching for the end of the message
                 message_size += recv(fd, buffer, bytes_read, 0);
+                tcp_counts.calls++;
+                tcp_counts.bytes += bytes_read;
                 asprintf(&message, "%s%s", message, buffer);
             }
         }
@@ -74,18 +81,19 @@ char* recv_message(int fd){
 
 /* calls recv() until a message of length len is formed */
 char* recv_message_len(int fd, int len){
-    char* msg = "";
+    char* msg = (char*)malloc(len + 1);
     int msg_len = 0;
-    char buffer[4096];
     int bytes_read;
-    int bytes_to_read = sizeof(buffer) - 1 < len ? sizeof(buffer) - 1 : len;
 
-    do{
-        bytes_read = recv(fd, buffer, bytes_to_read, 0);
-        asprintf(&msg, "%s%s", msg, buffer);
+    //read no further than the end of the message, so the next one is left
+    //on the socket
+    while(msg_len<len){
+        bytes_read = recv(fd, msg + msg_len, len - msg_len, 0);
+        tcp_counts.calls++;
+        if(bytes_read <= 0) break;
         msg_len += bytes_read;
-
-    }while(msg_len<len && bytes_read > 0);
+        tcp_counts.bytes += bytes_read;
+    }
 
     //return the message
     if(msg_len!=len){
@@ -122,13 +130,12 @@ int find_eom(char* message, int message_len, int* flag){
     returns what was read and 
     index i via pointer, which will be place after char end */
 char* readuntil(char* str, char end, int* i){
-    char* buf = "";
+    int start = *i;
     char c;
 
-    for(c=str[*i]; c!=end && c!='\0'; (*i)++, c=str[*i]){
-        asprintf(&buf, "%s%c", buf, c);
-    }
+    for(c=str[*i]; c!=end && c!='\0'; (*i)++, c=str[*i]);
 
+    char* buf = strndup(str+start, *i-start);
     if(c!='\0') (*i)++; //read past the specified character
     return buf;
 }
\ No newline at end of file
@@ -23,6 +23,17 @@
 #include <err.h>
 #include <stdlib.h>
 #include <syslog.h>
+#include <stdint.h>
+
+//the calls the calling thread has made on TCP sockets, and the bytes they
+//moved, so a client can profile its requests
+typedef struct
+{
+    uint64_t calls;
+    uint64_t bytes;
+} tcp_counters;
+
+extern __thread tcp_counters tcp_counts;
 
 /*  gets the socket address info for a client or server
     to get a socket for a server, set hostname to NULL*/
@@ -42,7 +53,7 @@ char* recv_message_len(int fd, int len);
 int find_eom(char* message, int message_len, int* flag);
 
 /* reads a str until end. 
-	returns what was read and 
+	returns what was read (to be freed by the caller) and 
 	index i via pointer, which will be place after char end */
 char* readuntil(char* str, char end, int* i);
 
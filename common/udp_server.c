@@ -6,7 +6,10 @@
 #include "udp_server.h"
 #include "udp_sockets.h"
 
-int bind_socket(struct addrinfo* addr_list)
+// Binds a socket to the first address of addr_list it can. If reuseport is
+// set, other sockets may be bound to the same address/port, and the kernel
+// spreads the incoming flows over them
+static int bind_socket_shared(struct addrinfo* addr_list, int reuseport)
 {
   struct addrinfo* addr;
   int sockfd;
@@ -22,6 +25,13 @@ int bind_socket(struct addrinfo* addr_list)
     if (sockfd == -1)
       continue;
 
+    // Let the other sockets share the port
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof(reuseport)) == -1)
+    {
+      close(sockfd);
+      continue;
+    }
+
     // Try to bind the socket to the address/port
     if (bind(sockfd, addr->ai_addr, addr->ai_addrlen) == -1)
     {
@@ -54,6 +64,11 @@ int bind_socket(struct addrinfo* addr_list)
 
 }
 
+int bind_socket(struct addrinfo* addr_list)
+{
+  return bind_socket_shared(addr_list, 0);
+}
+
 int create_server_socket(char* port)
 {
   struct addrinfo* results = get_udp_sockaddr(NULL, port, AI_PASSIVE);
@@ -62,3 +77,19 @@ int create_server_socket(char* port)
   return sockfd;
 }
 
+void create_server_sockets(char* port, int count, int* sockfds)
+{
+  // A single socket is bound alone, so no other can take its port
+  if (count == 1)
+  {
+    sockfds[0] = create_server_socket(port);
+    return;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    struct addrinfo* results = get_udp_sockaddr(NULL, port, AI_PASSIVE);
+    sockfds[i] = bind_socket_shared(results, 1);
+  }
+}
+
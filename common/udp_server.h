@@ -6,5 +6,10 @@
 int bind_socket(struct addrinfo* addr_list);
 int create_server_socket(char* port);
 
+// Binds count sockets to port, sharing it with SO_REUSEPORT if there is more
+// than one, so the kernel spreads incoming flows over them. Their descriptors
+// are put in sockfds
+void create_server_sockets(char* port, int count, int* sockfds);
+
 #endif
 
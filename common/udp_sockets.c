@@ -1,4 +1,6 @@
 #include "udp_sockets.h"
+
+__thread udp_counters udp_counts;
                                                                                     
 struct addrinfo* get_udp_sockaddr(const char* node, const char* port, int flags)
 {
@@ -32,6 +34,23 @@ message* receive_message(int sockfd, host* source)
 {
   message* msg = create_message();                                                                          
 
+  // If a message was read, return it
+  if (receive_message_into(sockfd, msg, source) > 0)
+  {
+    return msg;                                                               
+  }
+  else
+  {
+    // Otherwise, free the allocated memory and return NULL
+    free(msg);                                                               
+    return NULL;                                                               
+  }
+}
+
+// Reads a message into the caller's msg rather than a newly allocated one.
+// Returns the length of the message
+int receive_message_into(int sockfd, message* msg, host* source)
+{
   // Length of the remote IP structure
   source->addr_len = sizeof(source->addr);
 
@@ -40,32 +59,49 @@ message* receive_message(int sockfd, host* source)
   msg->length = recvfrom(sockfd, msg->buffer, sizeof(msg->buffer), 0,                  
                          (struct sockaddr*)&source->addr,                           
                          &source->addr_len);
+  udp_counts.calls++;
 
   // If a message was read
   if (msg->length > 0)
   {
+    udp_counts.bytes += msg->length;
     // Convert the source address to a human-readable form,
     // storing it in source->friendly_ip
     inet_ntop(source->addr.sin_family, &source->addr.sin_addr,                  
               source->friendly_ip, sizeof(source->friendly_ip));                  
-
-    // Return the message received
-    return msg;                                                               
-  }
-  else
-  {
-    // Otherwise, free the allocated memory and return NULL
-    free(msg);                                                               
-    return NULL;                                                               
   }
+
+  return msg->length;
 }
 
 int send_message(int sockfd, message* msg, host* dest)
 {
+    udp_counts.calls++;
+    udp_counts.bytes += msg->length;
     return sendto(sockfd, msg->buffer, msg->length, 0,
                 (struct sockaddr*)&dest->addr, dest->addr_len);
 }
 
+// Sends a datagram made of header followed by payload without first copying
+// them into one buffer (payload may point straight into a mapped file)
+int send_message_parts(int sockfd, void* header, size_t header_len, void* payload, size_t payload_len, host* dest)
+{
+    struct iovec iov[2] = {
+        { .iov_base = header,  .iov_len = header_len  },
+        { .iov_base = payload, .iov_len = payload_len }
+    };
+    struct msghdr mh = {
+        .msg_name    = &dest->addr,
+        .msg_namelen = dest->addr_len,
+        .msg_iov     = iov,
+        .msg_iovlen  = payload_len > 0 ? 2 : 1
+    };
+
+    udp_counts.calls++;
+    udp_counts.bytes += header_len + payload_len;
+    return sendmsg(sockfd, &mh, 0);
+}
+
 message* send_until_valid_ack(uint8_t seq, message* msg, int sockfd, host* connected_to, int timeout){
     message* response;
     int poll_ret = 0;
@@ -76,14 +112,20 @@ message* send_until_valid_ack(uint8_t seq, message* msg, int sockfd, host* conne
 	.events = POLLIN
     };
     
+    bool first = true;
     do{
 	//send the message until there is a response waiting
 	while(poll_ret == 0){
+	    if(!first){
+		udp_counts.retransmits++;
+	    }
+	    first = false;
 	    if(send_message(sockfd, msg, connected_to)==-1){
 		syslog(LOG_DEBUG, "Error sending message"); 
 		exit(EXIT_FAILURE);
 	    }
 	    poll_ret = poll(&fd, 1, timeout);
+	    udp_counts.calls++;
 	}
 	poll_ret = 0;
 	response = receive_message(sockfd, connected_to);
@@ -7,6 +7,9 @@
 #include <string.h>
 #include <poll.h>
 #include <syslog.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #ifndef UDP_SOCKETS_H
 #define UDP_SOCKETS_H
@@ -26,11 +29,24 @@ typedef struct
   socklen_t addr_len;
   char friendly_ip[INET_ADDRSTRLEN];
 } host;
+
+// The calls the calling thread has made on UDP sockets, the bytes they
+// moved, and the messages it sent again for want of an ACK
+typedef struct
+{
+  uint64_t calls;
+  uint64_t bytes;
+  uint64_t retransmits;
+} udp_counters;
+
+extern __thread udp_counters udp_counts;
                                                                                     
 struct addrinfo* get_udp_sockaddr(const char* node, const char* port, int flags);
 message* create_message();
 message* receive_message(int sockfd, host* source);
+int receive_message_into(int sockfd, message* msg, host* source);
 int send_message(int sockfd, message* msg, host* dest);
+int send_message_parts(int sockfd, void* header, size_t header_len, void* payload, size_t payload_len, host* dest);
 message* send_until_valid_ack(uint8_t, message*, int, host*, int timeout);
 #endif
 
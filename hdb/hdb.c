@@ -43,20 +43,159 @@ void hdb_disconnect(hdb_connection* con) {
   redisFree(concast(con));
 }
 
+//returns the key of the hash holding the directory sums of user username
+static char* tree_key(const char* username) {
+    char* key;
+    asprintf(&key, "%s:%s", TREE, username);
+    return key;
+}
+
+//returns the key of the sorted set indexing the files of user username
+static char* files_key(const char* username) {
+    char* key;
+    asprintf(&key, "%s:%s", FILES, username);
+    return key;
+}
+
+//returns true if key, the directory sums or index of a user, has been built
+static bool key_exists(hdb_connection* con, const char* key) {
+    char* cmd; //Redis command
+    asprintf(&cmd, "EXISTS %s", key);
+    int exists = redis_cmd_int(con, cmd);
+    free(cmd);
+    return exists;
+}
+
+//reads and frees the replies of count pipelined commands
+static void read_replies(hdb_connection* con, int count) {
+    redisReply* reply;
+    for(int i=0; i<count; i++){
+        if(redisGetReply(concast(con), (void**)&reply) == REDIS_OK){
+            freeReplyObject(reply);
+        }
+    }
+}
+
+//pipelines commands adding delta to the sum of every directory above
+//filename, under key. returns the number of commands
+static int append_tree_delta(hdb_connection* con, const char* key, const char* filename, int64_t delta) {
+    int commands = 1;
+    redisAppendCommand(concast(con), "HINCRBY %s %s %lld", key, MERKLE_ROOT, (long long)delta);
+
+    size_t len = strlen(filename);
+    while((len = merkle_parent(filename, len)) > 0){
+        char* dir = strndup(filename, len);
+        redisAppendCommand(concast(con), "HINCRBY %s %s %lld", key, dir, (long long)delta);
+        free(dir);
+        commands++;
+    }
+    return commands;
+}
+
+//pipelines a command adding filename with checksum to the index under key.
+//returns the number of commands
+static int append_index_add(hdb_connection* con, const char* key, const char* filename, const char* checksum) {
+    //the checksum follows the name in the member, so members sort by name
+    redisAppendCommand(concast(con), "ZADD %s 0 %s\n%s", key, filename, checksum);
+    return 1;
+}
+
+//pipelines the command adding the leaf of filename with checksum to the
+//sums under key. returns the number of commands
+static int append_tree_add(hdb_connection* con, const char* key, const char* filename, const char* checksum) {
+    return append_tree_delta(con, key, filename, merkle_leaf(filename, checksum));
+}
+
+//calls append with key for every file of user username and its checksum,
+//reading the files a page at a time, and reads the replies of the commands
+//it pipelines after each page
+static void scan_files(hdb_connection* con, const char* username, const char* key,
+                       int (*append)(hdb_connection*, const char*, const char*, const char*)) {
+    char* cursor = strdup("0");
+    do{
+        redisReply* reply = redisCommand(concast(con), "HSCAN %s %s COUNT %d", username, cursor, INDEX_PAGE);
+        free(cursor);
+        if(reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2){
+            if(reply != NULL) freeReplyObject(reply);
+            return;
+        }
+        cursor = strdup(reply->element[0]->str);
+
+        redisReply* items = reply->element[1];
+        int pending = 0;
+        for(size_t i=0; i+1<items->elements; i+=2){
+            pending += append(con, key, items->element[i]->str, items->element[i+1]->str);
+        }
+        read_replies(con, pending);
+        freeReplyObject(reply);
+    }while(strcmp(cursor, "0") != 0);
+    free(cursor);
+}
+
 //stores recrod in the Redis server
 void hdb_store_file(hdb_connection* con, hdb_record* record) {
+    //the file's old checksum is needed to take it out of the sums and index
+    char* key = tree_key(record->username);
+    char* index = files_key(record->username);
+    bool tree = key_exists(con, key);
+    bool indexed = key_exists(con, index);
+    char* old_checksum = tree || indexed ? hdb_file_checksum(con, record->username, record->filename) : NULL;
+
     char* cmd; //the Redis command as a string
     asprintf(&cmd, "HSET %s %s %s", record->username, record->filename, record->checksum);
     redis_cmd_null(con, cmd);
     free(cmd);
+
+    int pending = 0;
+    if(tree){
+        int64_t delta = merkle_leaf(record->filename, record->checksum);
+        if(old_checksum != NULL){
+            delta -= merkle_leaf(record->filename, old_checksum);
+        }
+        if(delta != 0){
+            pending += append_tree_delta(con, key, record->filename, delta);
+        }
+    }
+    if(indexed){
+        if(old_checksum != NULL){
+            redisAppendCommand(concast(con), "ZREM %s %s\n%s", index, record->filename, old_checksum);
+            pending++;
+        }
+        pending += append_index_add(con, index, record->filename, record->checksum);
+    }
+    read_replies(con, pending);
+    free(old_checksum);
+    free(index);
+    free(key);
 }
 
 //removes file from the Redis server
 int hdb_remove_file(hdb_connection* con, const char* username, const char* filename) {
+    char* key = tree_key(username);
+    char* index = files_key(username);
+    bool tree = key_exists(con, key);
+    bool indexed = key_exists(con, index);
+    char* old_checksum = tree || indexed ? hdb_file_checksum(con, username, filename) : NULL;
+
     char* cmd; //Redis command as a string
     asprintf(&cmd, "HDEL %s %s", username, filename);
     int removed = redis_cmd_int(con, cmd);
     free(cmd);
+
+    if(removed && old_checksum != NULL){
+        int pending = 0;
+        if(tree){
+            pending += append_tree_delta(con, key, filename, -(int64_t)merkle_leaf(filename, old_checksum));
+        }
+        if(indexed){
+            redisAppendCommand(concast(con), "ZREM %s %s\n%s", index, filename, old_checksum);
+            pending++;
+        }
+        read_replies(con, pending);
+    }
+    free(old_checksum);
+    free(index);
+    free(key);
     return removed;
 }
 
@@ -74,6 +213,50 @@ char* hdb_file_checksum(hdb_connection* con, const char* username, const char* f
     return checksum;
 }
 
+//returns an array of the checksums of count of user username's files, each
+//NULL if the file is not stored. a batch of files is asked for by each HMGET,
+//and every HMGET of a batch of commands before the replies are read, so a
+//list of files costs a round trip per TREE_BATCH*CHECKSUM_BATCH of them
+char** hdb_file_checksums(hdb_connection* con, const char* username, char** filenames, int count) {
+    char** checksums = (char**)calloc(count ? count : 1, sizeof(char*));
+    const char* argv[2 + CHECKSUM_BATCH];
+    argv[0] = "HMGET";
+    argv[1] = username;
+
+    int step = TREE_BATCH*CHECKSUM_BATCH;
+    for(int start=0; start<count; start+=step){
+        int end = start + step < count ? start + step : count;
+        for(int i=start; i<end; i+=CHECKSUM_BATCH){
+            int n = i + CHECKSUM_BATCH < end ? CHECKSUM_BATCH : end - i;
+            for(int j=0; j<n; j++){
+                argv[2 + j] = filenames[i + j];
+            }
+            redisAppendCommandArgv(concast(con), 2 + n, argv, NULL);
+        }
+        for(int i=start; i<end; i+=CHECKSUM_BATCH){
+            redisReply* reply;
+            if(redisGetReply(concast(con), (void**)&reply) != REDIS_OK) continue;
+            if(reply->type == REDIS_REPLY_ARRAY){
+                for(size_t j=0; j<reply->elements && i + j < (size_t)end; j++){
+                    if(reply->element[j]->type == REDIS_REPLY_STRING){
+                        checksums[i + j] = strdup(reply->element[j]->str);
+                    }
+                }
+            }
+            freeReplyObject(reply);
+        }
+    }
+    return checksums;
+}
+
+//frees the array returned by hdb_file_checksums()
+void hdb_free_checksums(char** checksums, int count) {
+    for(int i=0; i<count; i++){
+        free(checksums[i]);
+    }
+    free(checksums);
+}
+
 //retruns the number of files uploaded to the Redis server under the name username
 int hdb_file_count(hdb_connection* con, const char* username) {
     char *cmd; //Redis command
@@ -159,12 +342,137 @@ void hdb_free_result(hdb_record* record) {
     }
 }
 
-/*authenticates a user by password, and exchanges his/her
-username and password for a randomly-generated, 16-byte token that
-will be passed by the client in subsequent requests made after authentication*/
-char* hdb_authenticate(hdb_connection* con, const char* username, const char* password){
+//sums the leaves of user username's files into the directories above them,
+//if that has not been done. the sums are kept up to date from then on
+void hdb_build_tree(hdb_connection* con, const char* username) {
+    char* key = tree_key(username);
+    if(key_exists(con, key)){
+        free(key);
+        return;
+    }
+    syslog(LOG_INFO, "Building directory sums for %s", username);
+
+    //the root is set first, so the tree exists even if there are no files.
+    //a file stored while the sums are built may leave its directories'
+    //sums wrong, which only means their files are always listed
+    redisReply* reply = redisCommand(concast(con), "HSET %s %s 0", key, MERKLE_ROOT);
+    freeReplyObject(reply);
+
+    scan_files(con, username, key, append_tree_add);
+    free(key);
+}
+
+//indexes user username's files by name, if that has not been done. the
+//index is kept up to date from then on
+void hdb_build_index(hdb_connection* con, const char* username) {
+    char* key = files_key(username);
+    if(key_exists(con, key)){
+        free(key);
+        return;
+    }
+    syslog(LOG_INFO, "Indexing files of %s", username);
+
+    //as with the sums, the marker makes the index exist even if there are
+    //no files. it sorts before every file
+    redisReply* reply = redisCommand(concast(con), "ZADD %s 0 %s", key, INDEX_BUILT);
+    freeReplyObject(reply);
+
+    scan_files(con, username, key, append_index_add);
+    free(key);
+}
+
+//starts a walk through user username's indexed files in order of name, from
+//the first named filename or after it
+//NOTE: allocated memory is not released in this function
+hdb_cursor* hdb_files_from(hdb_connection* con, const char* username, const char* filename) {
+    hdb_cursor* cursor = (hdb_cursor*)calloc(1, sizeof(hdb_cursor));
+    cursor->con = con;
+    cursor->key = files_key(username);
+    asprintf(&cursor->from, "[%s", filename);
+    return cursor;
+}
+
+//sets filename and checksum to the next file of cursor, returning false once
+//there are none. both are valid until the next call
+bool hdb_cursor_next(hdb_cursor* cursor, char** filename, char** checksum) {
+    while(1){
+        redisReply* page = (redisReply*)cursor->page;
+        if(page != NULL && cursor->next < page->elements){
+            //each member is the name, a '\n' and the checksum
+            char* member = page->element[cursor->next++]->str;
+            char* split = strrchr(member, '\n');
+            if(split == NULL || split == member) continue; //the marker
+            *split = '\0';
+            *filename = member;
+            *checksum = split + 1;
+            return true;
+        }
+        if(page != NULL){
+            freeReplyObject(page);
+            cursor->page = NULL;
+            if(cursor->last_page) return false;
+        }
+
+        page = redisCommand(concast(cursor->con), "ZRANGEBYLEX %s %s + LIMIT 0 %d", cursor->key, cursor->from, INDEX_PAGE);
+        if(page == NULL || page->type != REDIS_REPLY_ARRAY){
+            if(page != NULL) freeReplyObject(page);
+            return false;
+        }
+        cursor->page = page;
+        cursor->next = 0;
+        cursor->last_page = page->elements < INDEX_PAGE;
+
+        //the next page starts after this one's last member, before it is split
+        if(page->elements > 0){
+            free(cursor->from);
+            asprintf(&cursor->from, "(%s", page->element[page->elements - 1]->str);
+        }
+    }
+}
+
+//frees a cursor returned by hdb_files_from()
+void hdb_cursor_free(hdb_cursor* cursor) {
+    if(cursor->page != NULL){
+        freeReplyObject((redisReply*)cursor->page);
+    }
+    free(cursor->key);
+    free(cursor->from);
+    free(cursor);
+}
+
+//returns an array of the sums of user username's directories, each named
+//by a path ending with a '/', or MERKLE_ROOT. a directory with no files
+//has a sum of 0
+//NOTE: allocated memory is not released in this function
+int64_t* hdb_dir_sums(hdb_connection* con, const char* username, char** dirs, int count) {
+    char* key = tree_key(username);
+    int64_t* sums = (int64_t*)calloc(count ? count : 1, sizeof(int64_t));
+
+    //every directory is asked for before the replies are read, a batch at a time
+    for(int start=0; start<count; start+=TREE_BATCH){
+        int end = start + TREE_BATCH < count ? start + TREE_BATCH : count;
+        for(int i=start; i<end; i++){
+            redisAppendCommand(concast(con), "HGET %s %s", key, dirs[i]);
+        }
+        for(int i=start; i<end; i++){
+            redisReply* reply;
+            if(redisGetReply(concast(con), (void**)&reply) != REDIS_OK) continue;
+            if(reply->type == REDIS_REPLY_STRING){
+                sums[i] = strtoll(reply->str, NULL, 10);
+            }
+            freeReplyObject(reply);
+        }
+    }
+
+    free(key);
+    return sums;
+}
+
+/*returns true if password is the password of user username. an account
+which does not exist is created with password*/
+static bool check_password(hdb_connection* con, const char* username, const char* password){
     int account_exists;
-    char *cmd, *actual_password, *token;
+    char *cmd, *actual_password;
 
     //check if the user exists
     asprintf(&cmd, "HEXISTS %s %s", PASS, username);
@@ -178,24 +486,36 @@ char* hdb_authenticate(hdb_connection* con, const char* username, const char* pa
         syslog(LOG_DEBUG, "Account exitsts! Password is %s", actual_password);
 
         //password correctness
-        if(strcmp(actual_password, password)==0){
-            //password is correct
-            token = store_unique_token(con, username);
-        }else{
-            //password is incorrect
-            return NULL;
-        }
+        return strcmp(actual_password, password)==0;
 
     //account does not exist
     }else{
         syslog(LOG_DEBUG, "Account does not exist. Creating new account");
-        //store the new username, password, and token
+        //store the new username and password
         asprintf(&cmd, "HSET %s %s %s", PASS, username, password);
         redis_cmd_int(con,cmd);
-        token = store_unique_token(con, username);
+        return true;
     }
+}
 
-    return token;
+/*authenticates a user by password, and exchanges his/her
+username and password for a randomly-generated, 16-byte token that
+will be passed by the client in subsequent requests made after authentication*/
+char* hdb_authenticate(hdb_connection* con, const char* username, const char* password){
+    if(!check_password(con, username, password)) return NULL;
+    return store_unique_token(con, username);
+}
+
+/*authenticates a user by password as hdb_authenticate() does, but gives
+back kept, a token the user was given before, if it is still theirs,
+rather than storing another*/
+char* hdb_authenticate_kept(hdb_connection* con, const char* username, const char* password, const char* kept){
+    if(!check_password(con, username, password)) return NULL;
+
+    char* token_user = hdb_verify_token(con, kept);
+    bool theirs = token_user != NULL && strcmp(token_user, username)==0;
+    free(token_user);
+    return theirs ? strdup(kept) : store_unique_token(con, username);
 }
 
 /*Verify the specified token, returning the username associated with the token,
@@ -217,6 +537,15 @@ int hdb_delete_user(hdb_connection* con, const char* username) {
     asprintf(&cmd, "DEL %s", username);
     int usr_deleted = redis_cmd_int(con, cmd);
     free(cmd);
+
+    //the directory sums and index go with the files
+    char* key = tree_key(username);
+    char* index = files_key(username);
+    asprintf(&cmd, "DEL %s %s", key, index);
+    redis_cmd_int(con, cmd);
+    free(cmd);
+    free(index);
+    free(key);
     return usr_deleted;
 }
 
@@ -256,6 +585,15 @@ char* redis_cmd_str(hdb_connection *con, const char *cmd){
     return str;
 }
 
+static pthread_once_t token_seed = PTHREAD_ONCE_INIT;
+
+//seeds the tokens' random numbers. seeded once, rather than for every
+//token, so tokens made in the same second, such as by two of the hmds's
+//connections at once, still differ
+static void seed_tokens(){
+    srand(time(NULL) ^ getpid());
+}
+
 //randomly generates a 16-byte alphanumeric token
 //NOTE: malloc in this function is never freed
 char* generate_token(){
@@ -267,7 +605,7 @@ char* generate_token(){
     token[TOKEN_SIZE] = '\0';
 
     //generate the token
-    srand(time(NULL));
+    pthread_once(&token_seed, seed_tokens);
     for(i=0; i<TOKEN_SIZE; i++){
         token[i] = alphanum[rand() % ALPHANUM_SIZE];
     }
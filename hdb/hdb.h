@@ -14,6 +14,7 @@
 
 #define _GNU_SOURCE
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -22,9 +23,19 @@
 #include <time.h>
 #include <syslog.h>
 #include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../common/merkle.h"
 
 #define PASS "password" //the hash under which passwords are stored on Redis
 #define TOKEN "token" //the hash under which tokens are stored on Redis
+#define TREE "tree" //the hashes under which users' directory sums are stored on Redis
+#define TREE_BATCH 1024 //commands pipelined before their replies are read
+#define CHECKSUM_BATCH 256 //files looked up by each HMGET
+#define FILES "files" //the sorted sets under which users' files are indexed by name on Redis
+#define INDEX_BUILT "\n" //the member marking an index as built
+#define INDEX_PAGE 1024 //files read from Redis at a time when they are walked
 #define STR_MAX 256
 
 //constants for tokens
@@ -37,12 +48,23 @@
 // Connection to the Hooli database
 typedef void* hdb_connection;
 
+// A walk through a user's files in order of name, a page at a time
+typedef struct hdb_cursor {
+  hdb_connection* con;
+  char* key;          // the user's index
+  char* from;         // where the next page starts, as ZRANGEBYLEX takes it
+  void* page;         // the page being read, a redisReply*
+  size_t next;        // the next member of page
+  bool last_page;     // no members follow page
+} hdb_cursor;
+
 // A record stored in the Hooli database
 typedef struct hdb_record {
   char* username;
   char* filename;
   char* checksum;
   char* abs_path;
+  uint64_t size;      // size of the file, as found by the client's scan
   struct hdb_record* next;
 } hdb_record;
 
@@ -63,6 +85,14 @@ int hdb_remove_file(hdb_connection* con, const char* username, const char* filen
 // Otherwise, return NULL.
 char* hdb_file_checksum(hdb_connection* con, const char* username, const char* filename);
 
+// Return an array of the checksums of count of the specified user's files,
+// each NULL if the file is not stored. The files are looked up by pipelined
+// HMGETs rather than a round trip each. Free it with hdb_free_checksums()
+char** hdb_file_checksums(hdb_connection* con, const char* username, char** filenames, int count);
+
+// Free the array returned by hdb_file_checksums()
+void hdb_free_checksums(char** checksums, int count);
+
 // Get the number of files stored in the Hooli database for the specified user.
 int hdb_file_count(hdb_connection* con, const char* username);
 
@@ -81,11 +111,41 @@ hdb_record* hdb_user_files(hdb_connection* con, const char* username);
 // Free the linked list returned by hdb_user_files()
 void hdb_free_result(hdb_record* record);
 
+// Sum the leaves of the specified user's files into the directories above
+// them, if that has not been done. The sums are kept up to date as files
+// are stored and removed from then on
+void hdb_build_tree(hdb_connection* con, const char* username);
+
+// Return an array of the sums of the specified user's directories, each
+// named by a path ending with a '/', or MERKLE_ROOT. A directory with no
+// files has a sum of 0
+int64_t* hdb_dir_sums(hdb_connection* con, const char* username, char** dirs, int count);
+
+// Index the specified user's files by name, if that has not been done. The
+// index is kept up to date as files are stored and removed from then on
+void hdb_build_index(hdb_connection* con, const char* username);
+
+// Start a walk through the specified user's indexed files in order of name,
+// from the first named filename or after it
+hdb_cursor* hdb_files_from(hdb_connection* con, const char* username, const char* filename);
+
+// Set filename and checksum to the next file of cursor, returning false once
+// there are none. Both are valid until the next call
+bool hdb_cursor_next(hdb_cursor* cursor, char** filename, char** checksum);
+
+// Free a cursor returned by hdb_files_from()
+void hdb_cursor_free(hdb_cursor* cursor);
+
 /*authenticates a user by password, and exchanges his/her
 username and password for a randomly-generated, 16-byte token that
 will be passed by the client in subsequent requests made after authentication*/
 char* hdb_authenticate(hdb_connection* con, const char* username, const char* password);
 
+/*authenticates a user by password as hdb_authenticate() does, but gives
+back kept, a token the user was given before, if it is still theirs,
+rather than storing another*/
+char* hdb_authenticate_kept(hdb_connection* con, const char* username, const char* password, const char* kept);
+
 /*Verify the specified token, returning the username associated with the token,
  if it is a valid token, or NULL, if it is not valid*/
 char* hdb_verify_token(hdb_connection* con, const char* token);
@@ -13,29 +13,6 @@ message* create_response_message(uint8_t seq, uint16_t error){
    return (message*)response;
 }
 
-/* creates unexistant dirs, erases the files, then opens the file stored at root_dir/username/filename */
-FILE* open_file(char* root_dir, char* username, char* filename){
-	//get the filepath
-	char* file_location;
-	asprintf(&file_location, "%s/%s/%s", root_dir, username, filename);
-
-	//create necessary dirs
-	char* mkdirp;
-	asprintf(&mkdirp, "mkdir -p `dirname %s`", file_location);
-	system(mkdirp);
-	free(mkdirp);
-
-	//erase the file
-	FILE* f = fopen(file_location, "w");
-	fclose(f);
-
-	//open the file
-	f = fopen(file_location, "ab");
-	free(file_location);
-
-	return f;
-}
-
 /* converts a string to an integer, exits program if string is not an integer */
 int strtoi(char* str, char* strerr){
     char* strp = str;
@@ -54,6 +31,576 @@ int strtoi(char* str, char* strerr){
     return i;
 }
 
+/* sends a response to the client of s, keeping it to be resent on duplicates */
+void send_response(int sockfd, session* s, uint8_t seq, uint16_t error){
+    free(s->last_response);
+    s->last_response = create_response_message(seq, error);
+
+    //a version 2 client is told our version and how much of its file we have
+    if(s->version >= 2){
+        response_ext_message* response = (response_ext_message*)s->last_response;
+        response->version = HFTP_VERSION;
+        memset(response->reserved, 0, sizeof(response->reserved));
+        response->offset = htobe64(s->bytes_recvd);
+        response->length = RESPONSE_EXT_LENGTH;
+    }
+    send_message(sockfd, s->last_response, &s->client);
+}
+
+/* resends the last response sent to the client of s */
+void resend_response(int sockfd, session* s){
+    if(s->last_response != NULL){
+        send_message(sockfd, s->last_response, &s->client);
+    }
+}
+
+/* returns the user owning the token of request, or NULL if the token is invalid */
+char* request_user(hdb_connection* con, control_message* request){
+    char token[TOKEN_SIZE + 1];
+    memcpy(token, request->token, TOKEN_SIZE);
+    token[TOKEN_SIZE] = '\0';
+    return get_token_user(con, token);
+}
+
+/* returns the filename carried by request, or NULL if its length runs
+   past the end of the message */
+char* request_filename(control_message* request){
+    uint16_t filename_len = ntohs(request->filename_len);
+    if(filename_len > MAX_FILENAME_SIZE || request->length < CONTROL_STATIC_SIZE + filename_len){
+        return NULL;
+    }
+    char* filename = (char*)malloc(sizeof(char)*filename_len + 1);
+    memcpy(filename, request->filename, filename_len);
+    filename[filename_len] = '\0';
+    return filename;
+}
+
+/* hands the upload in progress in s back to the pipeline, unfinished */
+void abort_upload(pipeline* p, session* s){
+    if(s->upload != NULL){
+        syslog(LOG_WARNING, "Upload of %s abandoned", s->filename);
+        pipeline_abort(p, s->upload);
+        s->upload = NULL;
+    }
+}
+
+/* makes username, which the caller allocated, the owner of s, and gives s
+   the user's weight */
+void set_user(session* s, char* username, share_table* shares){
+    free(s->username);
+    s->username = username;
+    s->share = get_share(shares, username);
+    s->flow.weight = s->share->weight;
+}
+
+/* returns the session of the flow a striped upload of filename by username
+   from the address of s began on, or NULL if there is none */
+session* find_striped(session* sessions, session* s, char* username, char* filename){
+    for(session* t = sessions; t != NULL; t = t->next){
+        if(t != s && t->upload != NULL && t->striped && t->primary == NULL &&
+           t->client.addr.sin_addr.s_addr == s->client.addr.sin_addr.s_addr &&
+           strcmp(t->username, username) == 0 && strcmp(t->filename, filename) == 0){
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/* returns the session holding the upload the data of s belongs to: s
+   itself, or the session of the flow the striped upload s joined began
+   on. returns NULL if there is no such upload, or it has finished */
+session* upload_owner(session* s){
+    if(s->primary == NULL){
+        return s->upload != NULL ? s : NULL;
+    }
+    if(s->primary->upload == NULL || s->primary->upload_id != s->upload_id){
+        return NULL;
+    }
+    return s->primary;
+}
+
+/* handles a CONTROL_INIT: starts an upload of the file named in the
+   request, or joins this flow to a striped upload of it begun on another */
+void handle_control_init(int sockfd, session* s, control_message* request, hdb_connection* con, pipeline* p, share_table* shares, session* sessions){
+    static uint32_t next_upload_id = 0;
+
+    //a retransmission of a request we already answered
+    if(request->seq != s->expected_seq){
+        resend_response(sockfd, s);
+        return;
+    }
+
+    //a malformed request is ignored, leaving the session as it was
+    char* filename = request_filename(request);
+    if(filename == NULL){
+        syslog(LOG_WARNING, "Malformed CONTROL_INIT from %s, ignoring it", s->client.friendly_ip);
+        return;
+    }
+
+    //the client's version decides the form of our replies. uploads always
+    //start at offset 0
+    uint64_t filesize, offset;
+    uint8_t flags;
+    s->version     = control_get_ext(request, &filesize, &offset, &flags);
+    s->bytes_recvd = 0;
+
+    //get the username
+    char* username = request_user(con, request);
+    if(username == NULL){
+        free(filename);
+        send_response(sockfd, s, request->seq, AUTHENTICATION_ERROR);
+        return;
+    }
+
+    abort_upload(p, s);
+    reset_session(s);
+    set_user(s, username, shares);
+    s->filename = filename;
+    s->primary  = NULL;
+    s->striped  = s->version >= 5 && (flags & (CONTROL_FLAG_STRIPED | CONTROL_FLAG_JOIN));
+
+    //another flow of a striped upload only points to the session holding it
+    if(s->version >= 5 && (flags & CONTROL_FLAG_JOIN)){
+        session* primary = find_striped(sessions, s, username, s->filename);
+        if(primary == NULL){
+            syslog(LOG_INFO, "No striped upload of %s to join", s->filename);
+            send_response(sockfd, s, request->seq, UPLOAD_NOT_FOUND);
+            s->expected_seq = (s->expected_seq+1)%2;
+            return;
+        }
+        s->primary   = primary;
+        s->upload_id = primary->upload_id;
+        syslog(LOG_DEBUG, "Port %d joined the upload of %s", ntohs(s->client.addr.sin_port), s->filename);
+        send_response(sockfd, s, request->seq, ACK);
+        s->expected_seq = (s->expected_seq+1)%2;
+        return;
+    }
+
+    //get the filesize from the request
+    s->filesize    = filesize;
+    s->upload      = pipeline_upload(p, s->share, s->filename, ntohl(request->checksum));
+    s->upload->trailer = s->version >= 3 && (flags & CONTROL_FLAG_TRAILER);
+    s->upload->striped = s->striped;
+    s->upload_id   = next_upload_id++;
+
+    //send an ack
+    syslog(LOG_INFO, "Transferring file %s", s->filename);
+    send_response(sockfd, s, request->seq, ACK);
+    s->expected_seq = (s->expected_seq+1)%2;
+}
+
+/* returns true if the data message msg carries the next payload of the
+   upload in s. a version 2 payload or version 4 run of zeros is identified
+   by its offset, a version 1 payload or one of a striped upload, which may
+   come at any offset, by its seq */
+bool expected_data(session* s, message* msg){
+    session* o = upload_owner(s);
+    if(o == NULL) return false;
+
+    if(o->striped){
+        return (msg->buffer[0] == DATA_EXT_TYPE || msg->buffer[0] == DATA_ZERO_TYPE) &&
+               msg->buffer[1] == s->expected_seq;
+    }
+    if(msg->buffer[0] == DATA_EXT_TYPE){
+        return s->version >= 2 && be64toh(((data_ext_message*)msg)->offset) == s->bytes_recvd;
+    }
+    if(msg->buffer[0] == DATA_ZERO_TYPE){
+        return s->version >= 4 && be64toh(((data_zero_message*)msg)->offset) == s->bytes_recvd;
+    }
+    return msg->buffer[1] == s->expected_seq;
+}
+
+/* handles a data message: passes its payload on to be written.
+   returns true if the pipeline took ownership of pkt */
+bool handle_data(int sockfd, session* s, packet* pkt, pipeline* p){
+    data_message* data = (data_message*)pkt;
+
+    //a retransmission of data we already passed on
+    if(!expected_data(s, &pkt->msg)){
+        resend_response(sockfd, s);
+        return false;
+    }
+
+    //the upload may be held by the session of another flow. a striped
+    //payload lands at its own offset, any other after the last one
+    session* o = upload_owner(s);
+    uint64_t offset = o->bytes_recvd;
+    if(o->striped){
+        //a run of zeros carries its offset in the same place
+        offset = be64toh(((data_ext_message*)pkt)->offset);
+    }
+
+    //assemble the file. once submitted, pkt belongs to the later stages and
+    //may already be back in the pool, so keep what is needed from it
+    uint8_t seq = data->seq;
+    uint16_t len = ntohs(data->data_len);
+    uint64_t hole = 0;
+    bool last;
+    if(data->type == DATA_ZERO_TYPE){
+        //a run of zeros has no payload, only its length, which is cut off
+        //at the end of the file
+        hole = be64toh(((data_zero_message*)pkt)->zero_len);
+        uint64_t remaining = offset < o->filesize ? o->filesize - offset : 0;
+        if(hole > remaining) hole = remaining;
+        len = 0;
+        last = o->bytes_recvd + hole >= o->filesize;
+    }else if(data->type == DATA_EXT_TYPE){
+        if(o->striped && (offset > o->filesize || len > o->filesize - offset)){
+            syslog(LOG_WARNING, "Data past the end of %s, ignoring it", o->filename);
+            resend_response(sockfd, s);
+            return false;
+        }
+        last = o->bytes_recvd + len >= o->filesize;
+    }else{
+        last = len < MAX_DATA_SIZE; //a short message is the last one of the file
+    }
+    //an upload whose checksum follows the data is closed by its trailer
+    bool trailer = o->upload->trailer;
+    pkt->up     = o->upload;
+    pkt->offset = offset;
+    pkt->len    = len;
+    pkt->hole   = hole;
+    pkt->last   = last && !trailer;
+
+    //count the payload against the user's share before the disk writer can
+    //count it off again
+    share_charge(s->share, len);
+    if(!pipeline_submit(p, pkt)){
+        //session_ready() holds payloads while the stage is full, so this is
+        //not expected. withhold the ACK so the client retransmits later
+        syslog(LOG_DEBUG, "Pipeline full, deferring data for %s", o->filename);
+        share_refund(s->share, len);
+        return false;
+    }
+    o->bytes_recvd += len + hole;
+    syslog(LOG_DEBUG, "Successfully received data. Seq %d. File %s. %" PRIu64 "/%" PRIu64 " bytes received. %f percent complete ", seq, o->filename, o->bytes_recvd, o->filesize, (float)o->bytes_recvd/(float)o->filesize);
+
+    //send an ACK
+    send_response(sockfd, s, seq, ACK);
+    s->expected_seq = (s->expected_seq+1)%2;
+
+    if(last && !trailer){
+        syslog(LOG_INFO, "File uploaded");
+        o->upload = NULL;
+    }
+    return true;
+}
+
+/* handles a CONTROL_TRAILER: the checksum of an upload whose CONTROL_INIT
+   left it to follow the data. returns true if the pipeline took ownership
+   of pkt */
+bool handle_control_trailer(int sockfd, session* s, packet* pkt, pipeline* p){
+    control_message* request = (control_message*)pkt;
+
+    //a retransmission, or a trailer before the last of the data
+    if(request->seq != s->expected_seq || s->upload == NULL || !s->upload->trailer || s->bytes_recvd < s->filesize){
+        resend_response(sockfd, s);
+        return false;
+    }
+
+    //pkt may be back in the pool once it is passed on
+    uint8_t seq = request->seq;
+    if(!pipeline_trailer(p, pkt, s->upload, ntohl(request->checksum))){
+        //session_ready() holds trailers while the stage is full, so this is
+        //not expected. withhold the ACK so the client retransmits later
+        syslog(LOG_DEBUG, "Pipeline full, deferring trailer for %s", s->filename);
+        return false;
+    }
+
+    syslog(LOG_INFO, "File uploaded");
+    s->upload = NULL;
+    send_response(sockfd, s, seq, ACK);
+    s->expected_seq = (s->expected_seq+1)%2;
+    return true;
+}
+
+/* handles a CONTROL_TERM: the client has no more requests */
+void handle_control_term(int sockfd, session* s, control_message* request, pipeline* p){
+    if(request->seq != s->expected_seq){
+        resend_response(sockfd, s);
+        return;
+    }
+
+    abort_upload(p, s);
+    reset_session(s);
+
+    //send a final ACK, and keep the session to re-ACK retransmissions for timewait
+    syslog(LOG_INFO, "All files transferred, waiting for timeout to ensure client has terminated");
+    send_response(sockfd, s, request->seq, ACK);
+    s->expected_seq = (s->expected_seq+1)%2;
+    s->closed = true;
+}
+
+/* sends the data message of the file being restored which starts at s->send_offset.
+   the payload is sent straight out of the file's mapping */
+void send_restore_data(int sockfd, session* s){
+    size_t remaining = s->map_len - s->send_offset;
+
+    if(s->version >= 2){
+        data_ext_message header;
+        s->send_len = remaining < MAX_DATA_EXT_SIZE ? remaining : MAX_DATA_EXT_SIZE;
+        header.type = DATA_EXT_TYPE;
+        header.seq = s->send_seq;
+        header.data_len = htons(s->send_len);
+        header.offset = htobe64(s->send_offset);
+        send_message_parts(sockfd, &header.type, DATA_EXT_STATIC_SIZE, s->map + s->send_offset, s->send_len, &s->client);
+    }else{
+        data_message header;
+        s->send_len = remaining < MAX_DATA_SIZE ? remaining : MAX_DATA_SIZE;
+        header.type = DATA_TYPE;
+        header.seq = s->send_seq;
+        header.data_len = htons(s->send_len);
+        send_message_parts(sockfd, &header.type, DATA_STATIC_SIZE, s->map + s->send_offset, s->send_len, &s->client);
+    }
+    s->awaiting_ack = true;
+    s->last_send = now_ms();
+}
+
+/* handles a CONTROL_GET: replies with the size and checksum of the requested
+   file and starts sending it */
+void handle_get(int sockfd, session* s, control_message* request, hdb_connection* con, pipeline* p, char* root_dir, share_table* shares){
+    if(request->seq != s->expected_seq){
+        resend_response(sockfd, s);
+        return;
+    }
+
+    //a malformed request is ignored, leaving the session as it was
+    char* filename = request_filename(request);
+    if(filename == NULL){
+        syslog(LOG_WARNING, "Malformed CONTROL_GET from %s, ignoring it", s->client.friendly_ip);
+        return;
+    }
+
+    //a version 2 client may ask for the file from an offset
+    uint64_t filesize, offset;
+    s->version     = control_get_ext(request, &filesize, &offset, NULL);
+    s->bytes_recvd = 0;
+
+    char* username = request_user(con, request);
+    if(username == NULL){
+        free(filename);
+        send_response(sockfd, s, request->seq, AUTHENTICATION_ERROR);
+        return;
+    }
+
+    //a new request ends whatever the session was doing before
+    abort_upload(p, s);
+    reset_session(s);
+    set_user(s, username, shares);
+    s->filename = filename;
+
+    //map the file. a name outside the user's directory, or of anything but
+    //a regular file, is not found
+    struct stat st;
+    int fd = open_stored(root_dir, username, s->filename);
+    if(fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)){
+        syslog(LOG_INFO, "Requested file %s not found", s->filename);
+        if(fd != -1) close(fd);
+        send_response(sockfd, s, request->seq, FILE_NOT_FOUND);
+        s->expected_seq = (s->expected_seq+1)%2;
+        return;
+    }
+    s->map_len = st.st_size;
+    if(s->map_len > 0){
+        s->map = mmap(NULL, s->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(s->map == MAP_FAILED){
+            //one request failing must not end the others
+            syslog(LOG_WARNING, "Unable to map %s: %s", s->filename, strerror(errno));
+            s->map = NULL;
+            s->map_len = 0;
+            close(fd);
+            send_response(sockfd, s, request->seq, FILE_NOT_FOUND);
+            s->expected_seq = (s->expected_seq+1)%2;
+            return;
+        }
+        madvise(s->map, s->map_len, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    //reply with the file's size and checksum
+    char* checksum = hdb_file_checksum(con, username, s->filename);
+    control_message* reply = (control_message*)create_message();
+    uint16_t filename_len = strlen(s->filename);
+    reply->type         = CONTROL_INIT;
+    reply->seq          = request->seq;
+    reply->filename_len = htons(filename_len);
+    reply->filesize     = htonl(s->map_len);
+    reply->checksum     = htonl(checksum != NULL ? strtoul(checksum, NULL, 16) : 0);
+    memcpy(reply->token, request->token, TOKEN_SIZE);
+    memcpy(reply->filename, s->filename, filename_len);
+    reply->length       = CONTROL_STATIC_SIZE + filename_len;
+    free(checksum);
+    if(s->version >= 2){
+        if(offset > s->map_len) offset = s->map_len;
+        control_set_ext(reply, s->map_len, offset, 0);
+    }else{
+        offset = 0;
+        if(s->map_len > UINT32_MAX){
+            syslog(LOG_WARNING, "%s is too large for a version 1 client", s->filename);
+        }
+    }
+
+    syslog(LOG_INFO, "Restoring file %s", s->filename);
+    free(s->last_response);
+    s->last_response = (message*)reply;
+    send_message(sockfd, s->last_response, &s->client);
+    s->expected_seq = (s->expected_seq+1)%2;
+
+    //send the first data message
+    s->send_offset = offset;
+    s->send_seq = 0;
+    send_restore_data(sockfd, s);
+}
+
+/* handles an ACK from a client restoring a file: sends the next data message */
+void handle_ack(int sockfd, session* s, response_message* ack){
+    if(!s->awaiting_ack || ack->seq != s->send_seq){
+        return;
+    }
+
+    //the last message of the file reaches its end. in version 1 it is short
+    s->send_offset += s->send_len;
+    if(s->version >= 2 ? s->send_offset >= s->map_len : s->send_len < MAX_DATA_SIZE){
+        syslog(LOG_INFO, "File restored");
+        reset_session(s);
+        return;
+    }
+
+    s->send_seq = (s->send_seq+1)%2;
+    send_restore_data(sockfd, s);
+}
+
+/* dispatches a packet received from the client of s.
+   returns true if the pipeline took ownership of pkt */
+bool handle_packet(int sockfd, session* s, packet* pkt, hdb_connection* con, pipeline* p, char* root_dir, share_table* shares, session* sessions){
+    uint8_t type = pkt->msg.buffer[0];
+
+    //a closed session being reused by a new client starts a new exchange, as
+    //does a new one, such as a flow which comes back after it timed out
+    if((s->closed || s->last_response == NULL) && (type == CONTROL_INIT || type == CONTROL_GET)){
+        s->closed = false;
+        s->expected_seq = pkt->msg.buffer[1];
+    }
+
+    switch(type){
+        case CONTROL_INIT:
+            handle_control_init(sockfd, s, (control_message*)pkt, con, p, shares, sessions);
+            break;
+
+        case DATA_TYPE:
+        case DATA_EXT_TYPE:
+        case DATA_ZERO_TYPE:
+            return handle_data(sockfd, s, pkt, p);
+
+        case CONTROL_TRAILER:
+            return handle_control_trailer(sockfd, s, pkt, p);
+
+        case CONTROL_TERM:
+            handle_control_term(sockfd, s, (control_message*)pkt, p);
+            break;
+
+        case CONTROL_GET:
+            handle_get(sockfd, s, (control_message*)pkt, con, p, root_dir, shares);
+            break;
+
+        case RESPONSE_TYPE:
+            handle_ack(sockfd, s, (response_message*)pkt);
+            break;
+    }
+
+    return false;
+}
+
+/* returns true if the datagram at the head of flow may be handled now.
+   context is a hold_state, which learns why it is held back. the payload of
+   an upload waits while its user is over their share of the disk or their
+   bandwidth cap, which withholds the ACK and so slows them. a payload or
+   trailer also waits while the checksum stage is full, queued on its
+   session rather than dropped */
+bool session_ready(drr_flow* flow, void* context){
+    session* s = (session*)flow->owner;
+    data_message* data = (data_message*)flow->head;
+    hold_state* hold = (hold_state*)context;
+
+    uint8_t type = data->type;
+    if((type == DATA_TYPE || type == DATA_EXT_TYPE || type == DATA_ZERO_TYPE || type == CONTROL_TRAILER) &&
+       !pipeline_has_room(hold->p)){
+        atomic_fetch_add(&hold->p->stalls, 1);
+        hold->disk = true;
+        return false;
+    }
+
+    if((data->type != DATA_TYPE && data->type != DATA_EXT_TYPE) || !expected_data(s, &flow->head->msg)){
+        return true;
+    }
+    long wait = share_wait(s->share, ntohs(data->data_len));
+    if(wait < 0){
+        hold->disk = true;
+    }else if(wait > 0 && wait < hold->wait){
+        hold->wait = wait;
+    }
+    return wait == 0;
+}
+
+/* queues pkt to be handled in its session's turn. returns false if the
+   session already has too many datagrams waiting */
+bool queue_packet(drr* sched, session** sessions, packet* pkt){
+    session* s = get_session(sessions, &pkt->source);
+    s->last_active = now_ms();
+    if(s->flow.length >= SESSION_QUEUE){
+        return false;
+    }
+    drr_enqueue(sched, &s->flow, pkt);
+    return true;
+}
+
+/* drops s, releasing the datagrams it had waiting */
+void drop_session(session** sessions, session* s, drr* sched, pipeline* p){
+    packet* pkt = drr_remove(sched, &s->flow);
+    while(pkt != NULL){
+        packet* next = pkt->next;
+        pipeline_release(p, pkt);
+        pkt = next;
+    }
+
+    //flows which joined its upload have nothing left to send it to
+    for(session* t = *sessions; t != NULL; t = t->next){
+        if(t->primary == s){
+            t->primary = NULL;
+        }
+    }
+    remove_session(sessions, s);
+}
+
+/* resends unacknowledged restore data and drops sessions which have
+   been closed for timewait seconds or idle for SESSION_TIMEOUT */
+void service_sessions(int sockfd, session** sessions, drr* sched, pipeline* p, int timewait){
+    long now = now_ms();
+    session* s = *sessions;
+
+    while(s != NULL){
+        session* next = s->next;
+
+        if(s->closed && now - s->last_active > timewait*1000L){
+            syslog(LOG_INFO, "Connection with %s closed", s->username != NULL ? s->username : s->client.friendly_ip);
+            drop_session(sessions, s, sched, p);
+        }else if(now - s->last_active > SESSION_TIMEOUT){
+            syslog(LOG_WARNING, "Session with %s timed out", s->client.friendly_ip);
+            abort_upload(p, s);
+            drop_session(sessions, s, sched, p);
+        }else if(s->awaiting_ack && now - s->last_send > RESEND_TIMEOUT){
+            send_restore_data(sockfd, s);
+        }
+
+        s = next;
+    }
+}
+
+/* handles SIGUSR1: asks the main loop to log the pipeline's queue depths */
+void stats_handler(int signal){
+    show_stats = true;
+}
+
 int main(int argc, char *argv[]){
 
     openlog("hftpd", LOG_PERROR | LOG_PID | LOG_NDELAY, LOG_USER);
@@ -63,8 +610,12 @@ int main(int argc, char *argv[]){
     char* port = "10000";
     char* redis_hostname = "localhost";
     char* root_dir = "/tmp/hftpd";
-    int timewait = 10;
+    int timewait = 10; //seconds a closed session is kept to re-ACK retransmissions
     int verbose_flag = 0;
+    int direct_flag = 0;
+    int writers = 2;
+    int rx_threads = 1; //network threads, each with a socket sharing the port
+    char* weights = NULL; //file of per-user weights and caps
 
     //create the array of long optional args
     struct option long_options[] =
@@ -74,6 +625,10 @@ int main(int argc, char *argv[]){
         {"redis",    required_argument, 0,            'r'},
         {"dir",      required_argument, 0,            'd'},
         {"timewait", required_argument, 0,            't'},
+        {"direct",   no_argument,       &direct_flag,  1 },
+        {"writers",  required_argument, 0,            'w'},
+        {"rx-threads", required_argument, 0,          'R'},
+        {"weights",  required_argument, 0,            'W'},
         {0,0,0,0}
     };
 
@@ -81,7 +636,7 @@ int main(int argc, char *argv[]){
     while(1){
 
         int option_index = 0;
-        c = getopt_long(argc, argv, "p:r:d:t:v", long_options, &option_index);
+        c = getopt_long(argc, argv, "p:r:d:t:w:W:R:v", long_options, &option_index);
         //if we've reached the end of the options, stop iterating
         if (c==-1) break;
 
@@ -103,6 +658,26 @@ int main(int argc, char *argv[]){
                 timewait = strtoi(optarg, "-t / --timewait");
                 break;
 
+            case 'w':
+                writers = strtoi(optarg, "-w / --writers");
+                if(writers < 1){
+                    syslog(LOG_ERR, "-w / --writers: at least one writer required");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'W':
+                weights = optarg;
+                break;
+
+            case 'R':
+                rx_threads = strtoi(optarg, "-R / --rx-threads");
+                if(rx_threads < 1){
+                    syslog(LOG_ERR, "-R / --rx-threads: at least one network thread required");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
             case 'v':
                 verbose_flag = 1;
                 break;
@@ -121,149 +696,96 @@ int main(int argc, char *argv[]){
     }
 
     //set up variables for the main program loop
-    control_message* request;		//message received
-    data_message* data;			//data message received
-    message* response;			//message to send
-    host client;			//client of this server
+    packet* pkt;			//packet received
+    session* sessions = NULL;		//one session per client
+    drr sched = {			//sessions with datagrams waiting, served in weighted fair order
+	.eligible = session_ready
+    };
     int sockfd;				//the socket id of this server
-    uint8_t expected_seq = 0;		//expected seq value of next message
-    FILE* file = NULL;	    		//file that we are writing to
-    char* username;			//username of whos uploading the files
-    char* filename;
-    char* checksum;
-    char* token;
-
-    //set up a udp socket to listen
-    sockfd = create_server_socket(port);
+
+    //set up udp sockets to listen, one per network thread. replies all go
+    //out of the first, from the same port
+    int* sockfds = (int*)malloc(rx_threads*sizeof(int));
+    create_server_sockets(port, rx_threads, sockfds);
+    sockfd = sockfds[0];
     syslog(LOG_INFO, "Listening on port %s", port);
 
     //set up a connection with the redis server
     hdb_connection* redis_connection = hdb_connect(redis_hostname);
-    
-    while(!terminate){
-	//wait for a type 1 control message
-	syslog(LOG_DEBUG, "Waiting for control init message");
-	request = (control_message*)receive_message(sockfd, &client);
-	while(request->type != CONTROL_INIT){
-	    request = (control_message*)receive_message(sockfd, &client);
-	}
-	syslog(LOG_DEBUG, "Control init message received");
-
-	//main program loop
-	while(request->type == CONTROL_INIT){
-
-	    //get the token
-	    token = (char*)malloc(sizeof(char)*TOKEN_SIZE + 1);
-	    memcpy(token, request->token, TOKEN_SIZE);
-	    token[TOKEN_SIZE] = '\0';
-
-	    //get the username
-	    username = get_token_user(redis_connection, token);
-	    if(username == NULL){
-		response = create_response_message(expected_seq, AUTHENTICATION_ERROR);
-		send_message(sockfd, response, &client);
-		free(request);
-		continue;
-	    }
-	    free(token); 
-
-	    //close the previous file and update the metadata
-	    if(file != NULL){
-		fclose(file);
-
-		//update metadata
-		hdb_record hdb_entry = {
-		    .username = username,
-		    .filename = filename, 
-		    .checksum = checksum, 
-		};
-		hdb_store_file(redis_connection, &hdb_entry);
-	    }
 
+    //start the network, checksum and disk stages. this thread is the protocol stage
+    install_termination_handler();
+    signal(SIGUSR1, stats_handler);
+    share_table* shares = load_shares(weights, writers);
+    pipeline* p = pipeline_start(sockfds, rx_threads, root_dir, redis_hostname, direct_flag, writers);
+    hold_state hold = {
+	.p = p,
+	.wait = POLL_INTERVAL
+    };
+    sched.context = &hold;
 
-	    //get the filename and  filesize from the request
-	    uint32_t filesize     = ntohl(request->filesize);
-	    uint16_t filename_len = ntohs(request->filename_len);
-	    filename = (char*)malloc(sizeof(char*)*filename_len + 1);
-	    memcpy(filename, request->filename, filename_len);
-	    checksum = ulong_to_hexstr(ntohl(request->checksum));
-	    filename[filename_len] = '\0';
-
-	    syslog(LOG_DEBUG, "Writing file %s", filename);
-
-	    //open the file
-	    file = open_file(root_dir, username, filename); 
-
-	    //send an ack
-	    response = create_response_message(expected_seq, ACK);
-	    syslog(LOG_DEBUG, "Sending ack for control init. Seq %d", response->buffer[1]);
-	    send_message(sockfd, response, &client);
-	    expected_seq = (expected_seq+1)%2;
-
-	    //get the first data message
-	    syslog(LOG_DEBUG, "Waiting for first data message. Seq %d", expected_seq);
-	    data = (data_message*)receive_message(sockfd, &client);
-
-	    //assemble the file's data
-	    int bytes_recvd = 0;
-	    syslog(LOG_INFO, "Transferring file %s", filename); 
-	    while(data->type == DATA_TYPE){
-	       
-		//sned an ACK
-		response = create_response_message(expected_seq, ACK);
-		send_message(sockfd, response, &client);
-
-		//assemble the file if the request seq was expected
-		if(data->seq == expected_seq){
-		    bytes_recvd+= data->data_len;
-		    syslog(LOG_DEBUG, "Successfully received data. Seq %d. File %s. %d/%d bytes received. %f percent complete ", expected_seq, filename,bytes_recvd, filesize, (float)bytes_recvd/(float)filesize );
-		    expected_seq = (expected_seq+1)%2;
-		    uint8_t* data_ptr = data->data;
-		    fwrite(data_ptr, sizeof(uint8_t), ntohs(data->data_len), file);
-		}
-
-		//get the next request
-		data  = (data_message*)receive_message(sockfd, &client);
+    while(!terminate){
+	//queue whatever has arrived behind its session's earlier datagrams
+	while((pkt = (packet*)ring_pop(p->rx)) != NULL){
+	    if(!queue_packet(&sched, &sessions, pkt)){
+		pipeline_release(p, pkt);
 	    }
-	    
+	}
 
-	    syslog(LOG_INFO, "File uploaded");
-	    //get the next control message
-	    request = (control_message*) data;
-	    
+	//a pass which found every session held back for the pipeline asks it
+	//to wake this thread once a payload moves on. it asks before looking,
+	//so one which moves on while it looks still wakes it
+	bool asked = hold.disk;
+	if(asked){
+	    pipeline_wake_on_progress(p);
+	}
+	hold.wait = POLL_INTERVAL;
+	hold.disk = false;
+
+	//handle a batch of datagrams, taking the sessions in turn
+	int handled = 0;
+	while(handled < RX_BATCH && (pkt = drr_dequeue(&sched)) != NULL){
+	    session* s = get_session(&sessions, &pkt->source);
+	    if(!handle_packet(sockfd, s, pkt, redis_connection, p, root_dir, shares, sessions)){
+		pipeline_release(p, pkt);
+	    }
+	    handled++;
 	}
 
-	//close the file
-	fclose(file);
-
-	//send a final ACK
-	response = create_response_message(expected_seq, ACK);
-	expected_seq = (expected_seq+1)%2;
-
-	//set up a final poll to ensure the connection is closed
-	struct pollfd pfd = {
-	    .fd = sockfd,
-	    .events = POLLIN
-	};
-
-	//run the poll until there are no messages for timewait
-	syslog(LOG_INFO, "All files transferred, waiting for timeout to ensure client has terminated");
-	int poll_ret = 0;
-	do{
-	    //send a message if the client hasnt terminated
-	    if(poll_ret = 1){
-		send_message(sockfd, response, &client);
+	//nothing could be handled, wait for more. datagrams held back by a cap
+	//are retried once it lets the soonest of them go on, and those held
+	//for the pipeline once it wakes this thread, having been asked to on
+	//the next pass if not on this one
+	if(handled == 0){
+	    long wait = hold.disk && !asked ? 0 : hold.wait;
+	    pkt = (packet*)ring_pop_wait(p->rx, (int)wait);
+	    if(pkt != NULL && !queue_packet(&sched, &sessions, pkt)){
+		pipeline_release(p, pkt);
 	    }
-	    poll_ret = poll(&pfd, 1, timewait);
-	}while(poll_ret == 1);
+	}
 
-	syslog(LOG_INFO, "Connection with %s closed", username);
-	expected_seq = 0;   
-	file = NULL; 
+	//resend lost restore data and close finished sessions
+	service_sessions(sockfd, &sessions, &sched, p, timewait);
+
+	if(show_stats){
+	    show_stats = false;
+	    pipeline_log_stats(p, LOG_INFO);
+	    log_shares(shares, LOG_INFO);
+	}
     }
     
     syslog(LOG_INFO, "Termination requested");
     //clean up
-    close(sockfd);
+    while(sessions != NULL){
+	abort_upload(p, sessions);
+	drop_session(&sessions, sessions, &sched, p);
+    }
+    pipeline_log_stats(p, LOG_DEBUG);
+    pipeline_stop(p);
+    hdb_disconnect(redis_connection);
+    for(int i=0; i<rx_threads; i++){
+	close(sockfds[i]);
+    }
+    free(sockfds);
 
 }
@@ -5,11 +5,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <getopt.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "../common/socketutils.h"
 #include "../common/udp_server.h"
@@ -18,10 +22,48 @@
 #include "../hdb/hdb.h"
 #include "../common/termination_handler.h"
 #include "../common/checksum_utils.h"
+#include "write_buffer.h"
+#include "session.h"
+#include "pipeline.h"
+#include "scheduler.h"
+
+#define POLL_INTERVAL 100 //ms to wait for a message before servicing sessions
+#define RX_BATCH 64       //datagrams handled between checks for new ones
+
+static volatile bool show_stats = false; //set by SIGUSR1
+
+//why the sessions passed over by the protocol stage were held back
+typedef struct
+{
+    pipeline* p;
+    long wait;                  //ms until the soonest held by a cap may go on
+    bool disk;                  //one waits for a payload to move on through the pipeline
+} hold_state;
 
 message* create_response_message(uint8_t, uint16_t); 
-FILE* open_file(char*, char*, char*);
 int strtoi(char* str, char* strerr);
+void send_response(int sockfd, session* s, uint8_t seq, uint16_t error);
+void resend_response(int sockfd, session* s);
+char* request_user(hdb_connection* con, control_message* request);
+char* request_filename(control_message* request);
+void abort_upload(pipeline* p, session* s);
+void set_user(session* s, char* username, share_table* shares);
+session* find_striped(session* sessions, session* s, char* username, char* filename);
+session* upload_owner(session* s);
+void handle_control_init(int sockfd, session* s, control_message* request, hdb_connection* con, pipeline* p, share_table* shares, session* sessions);
+bool expected_data(session* s, message* msg);
+bool handle_data(int sockfd, session* s, packet* pkt, pipeline* p);
+bool handle_control_trailer(int sockfd, session* s, packet* pkt, pipeline* p);
+void handle_control_term(int sockfd, session* s, control_message* request, pipeline* p);
+void send_restore_data(int sockfd, session* s);
+void handle_get(int sockfd, session* s, control_message* request, hdb_connection* con, pipeline* p, char* root_dir, share_table* shares);
+void handle_ack(int sockfd, session* s, response_message* ack);
+bool handle_packet(int sockfd, session* s, packet* pkt, hdb_connection* con, pipeline* p, char* root_dir, share_table* shares, session* sessions);
+bool session_ready(drr_flow* flow, void* context);
+bool queue_packet(drr* sched, session** sessions, packet* pkt);
+void drop_session(session** sessions, session* s, drr* sched, pipeline* p);
+void service_sessions(int sockfd, session** sessions, drr* sched, pipeline* p, int timewait);
+void stats_handler(int signal);
 
 
 #endif //HFTPD_H
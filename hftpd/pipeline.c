@@ -0,0 +1,521 @@
+#include "pipeline.h"
+
+//what a network or disk writer thread needs to know about itself
+typedef struct
+{
+    pipeline* p;
+    int index;
+} stage_arg;
+
+/* returns the payload carried by pkt */
+static uint8_t* payload(packet* pkt){
+    if(pkt->msg.buffer[0] == DATA_EXT_TYPE){
+        return ((data_ext_message*)pkt)->data;
+    }
+    return ((data_message*)pkt)->data;
+}
+
+/* returns true if filename, as a client names it, lies beneath the directory
+   of username: the username is a single path component, and the filename is
+   not empty, not absolute, and has no ".." component */
+bool filename_allowed(const char* username, const char* filename){
+    if(username[0] == '\0' || strchr(username, '/') != NULL ||
+       strcmp(username, ".") == 0 || strcmp(username, "..") == 0){
+        return false;
+    }
+    if(filename[0] == '\0' || filename[0] == '/'){
+        return false;
+    }
+    for(const char* c = filename; c != NULL; c = strchr(c, '/')){
+        if(*c == '/') c++;
+        if(strncmp(c, "..", 2) == 0 && (c[2] == '/' || c[2] == '\0')){
+            return false;
+        }
+    }
+    return true;
+}
+
+/* opens the file stored at root_dir/username/filename for reading, resolving
+   filename beneath the user's directory, so it cannot name a file outside it.
+   returns the file descriptor, or -1 if it could not be opened */
+int open_stored(char* root_dir, char* username, char* filename){
+    if(!filename_allowed(username, filename)){
+        syslog(LOG_WARNING, "%s asked for %s, outside their directory", username, filename);
+        return -1;
+    }
+
+    char* user_dir;
+    asprintf(&user_dir, "%s/%s", root_dir, username);
+    int dirfd = open(user_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    free(user_dir);
+    if(dirfd == -1) return -1;
+
+    //a kernel without openat2() leaves only the check of the name above
+    struct open_how how = {
+        .flags = O_RDONLY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH
+    };
+    int fd = syscall(SYS_openat2, dirfd, filename, &how, sizeof(how));
+    if(fd == -1 && errno == ENOSYS){
+        fd = openat(dirfd, filename, O_RDONLY | O_CLOEXEC);
+    }
+    close(dirfd);
+    return fd;
+}
+
+/* creates the directories above path which do not exist */
+static void make_parent_dirs(char* path){
+    for(char* slash = strchr(path+1, '/'); slash != NULL; slash = strchr(slash+1, '/')){
+        *slash = '\0';
+        if(mkdir(path, 0755) == -1 && errno != EEXIST){
+            syslog(LOG_WARNING, "Could not create %s: %s", path, strerror(errno));
+        }
+        *slash = '/';
+    }
+}
+
+/* creates unexistant dirs, erases the files, then opens the file stored at root_dir/username/filename
+   if direct is set, the file is written with O_DIRECT where possible.
+   returns NULL if the file could not be opened, or is not the user's to write */
+write_buffer* open_file(char* root_dir, char* username, char* filename, bool direct){
+    if(!filename_allowed(username, filename)){
+        syslog(LOG_WARNING, "%s sent %s, outside their directory", username, filename);
+        return NULL;
+    }
+
+    //get the filepath
+    char* file_location;
+    asprintf(&file_location, "%s/%s/%s", root_dir, username, filename);
+
+    //create necessary dirs. the name is never handed to a shell
+    make_parent_dirs(file_location);
+
+    //erase and open the file
+    write_buffer* f = wb_open(file_location, direct);
+    free(file_location);
+
+    return f;
+}
+
+/* wakes the protocol stage if it asked to be once a payload moved on */
+static void progress(pipeline* p){
+    if(atomic_load_explicit(&p->wake_protocol, memory_order_relaxed) &&
+       atomic_exchange(&p->wake_protocol, false)){
+        ring_wake(p->rx);
+    }
+}
+
+/* pushes pkt onto r, waiting for room if r is full */
+static void push_blocking(ring* r, packet* pkt){
+    while(!ring_push(r, pkt)){
+        sched_yield();
+    }
+}
+
+/* a network stage: receives datagrams from its socket into pooled buffers */
+static void* net_stage(void* arg){
+    pipeline* p = ((stage_arg*)arg)->p;
+    int sockfd = p->sockfds[((stage_arg*)arg)->index];
+    struct pollfd pfd = {
+        .fd = sockfd,
+        .events = POLLIN
+    };
+    free(arg);
+
+    while(!atomic_load(&p->stop_net)){
+        if(poll(&pfd, 1, STAGE_WAIT) != 1) continue;
+
+        //a datagram is waiting. while every buffer is in use it stays in
+        //the socket's receive queue
+        packet* pkt = (packet*)ring_pop_wait(p->free_packets, STAGE_WAIT);
+        if(pkt == NULL) continue;
+
+        if(receive_message_into(sockfd, &pkt->msg, &pkt->source) <= 0){
+            pipeline_release(p, pkt);
+            continue;
+        }
+
+        //the protocol stage is behind. the datagram waits for room rather
+        //than being dropped, which would stall its client until it
+        //retransmits, and those behind it wait in the socket's receive queue
+        if(!ring_push(p->rx, pkt)){
+            atomic_fetch_add(&p->waits, 1);
+            while(!ring_push(p->rx, pkt)){
+                if(atomic_load(&p->stop_net)){
+                    pipeline_release(p, pkt);
+                    break;
+                }
+                sched_yield();
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* returns the CRC-32 crc extended by the payload or run of zeros of pkt */
+static uint32_t crc_extend(uint32_t crc, packet* pkt){
+    if(pkt->kind == PACKET_ZERO){
+        return crc32_zeros(crc, pkt->hole);
+    }
+    return crc32(crc, payload(pkt), pkt->len);
+}
+
+/* adds the payload or run of zeros of pkt, which belongs to a striped
+   upload, to the upload's checksum. one which follows crc_len extends the
+   checksum of the file so far, and one which follows a piece extends the
+   piece. any other starts a piece of its own, kept until the ranges
+   before it have come. contiguous pieces are merged, so there are about
+   as many as there are flows */
+static void crc_add(upload* up, packet* pkt){
+    uint64_t len = pkt->kind == PACKET_ZERO ? pkt->hole : pkt->len;
+    crc_piece** link = &up->pieces;
+    while(*link != NULL && (*link)->offset + (*link)->len < pkt->offset){
+        link = &(*link)->next;
+    }
+
+    if(pkt->offset == up->crc_len){
+        up->crc = crc_extend(up->crc, pkt);
+        up->crc_len += len;
+    }else if(*link != NULL && (*link)->offset + (*link)->len == pkt->offset){
+        (*link)->crc = crc_extend((*link)->crc, pkt);
+        (*link)->len += len;
+    }else{
+        crc_piece* piece = (crc_piece*)malloc(sizeof(crc_piece));
+        piece->offset = pkt->offset;
+        piece->len = len;
+        piece->crc = crc_extend(crc32(0L, Z_NULL, 0), pkt);
+        piece->next = *link;
+        *link = piece;
+    }
+
+    //merge whatever the range has made contiguous
+    crc_piece** prev = &up->pieces;
+    while(*prev != NULL){
+        crc_piece* piece = *prev;
+        if(piece->offset == up->crc_len){
+            up->crc = crc32_combine(up->crc, piece->crc, piece->len);
+            up->crc_len += piece->len;
+            *prev = piece->next;
+            free(piece);
+        }else if(piece->next != NULL && piece->offset + piece->len == piece->next->offset){
+            crc_piece* next = piece->next;
+            piece->crc = crc32_combine(piece->crc, next->crc, next->len);
+            piece->len += next->len;
+            piece->next = next->next;
+            free(next);
+        }else{
+            prev = &piece->next;
+        }
+    }
+}
+
+/* the checksum stage: keeps a running CRC-32 of every upload and checks
+   it against the client's checksum once the last payload has passed, or
+   once its trailer has if the checksum came after the payloads */
+static void* checksum_stage(void* arg){
+    pipeline* p = (pipeline*)arg;
+
+    while(1){
+        packet* pkt = (packet*)ring_pop_wait(p->work, STAGE_WAIT);
+        if(pkt == NULL){
+            if(atomic_load(&p->stop_checksum) && ring_depth(p->work) == 0) break;
+            continue;
+        }
+
+        //there is room on the ring again for a payload held back for it
+        progress(p);
+
+        upload* up = pkt->up;
+        if(pkt->kind == PACKET_DATA || pkt->kind == PACKET_ZERO){
+            if(up->striped){
+                crc_add(up, pkt);
+            }else{
+                up->crc = crc_extend(up->crc, pkt);
+            }
+        }
+        if(pkt->last){
+            //a striped file with a range missing cannot be what was sent
+            up->verified = up->crc == up->expected_crc && up->pieces == NULL;
+            if(!up->verified){
+                syslog(LOG_WARNING, "Checksum mismatch for %s, not recording it", up->filename);
+            }
+        }
+
+        //a full disk queue holds this stage up, and in turn the protocol stage.
+        //the writers empty their queues quickly, so this is rare
+        push_blocking(p->disk[up->writer], pkt);
+    }
+
+    return NULL;
+}
+
+/* closes the file of up, records its metadata if it was received intact,
+   and frees up */
+static void close_upload(hdb_connection* con, upload* up, bool complete){
+    if(up->file != NULL && wb_close(up->file) == -1){
+        syslog(LOG_ERR, "Unable to write %s", up->filename);
+        up->failed = true;
+    }
+
+    if(complete && up->verified && !up->failed){
+        hdb_record hdb_entry = {
+            .username = up->username,
+            .filename = up->filename,
+            .checksum = up->checksum,
+        };
+        hdb_store_file(con, &hdb_entry);
+    }
+
+    while(up->pieces != NULL){
+        crc_piece* next = up->pieces->next;
+        free(up->pieces);
+        up->pieces = next;
+    }
+    free(up->username);
+    free(up->filename);
+    free(up->checksum);
+    free(up);
+}
+
+/* writes the payload of pkt to its file, closing the file after the last one */
+static void write_packet(pipeline* p, hdb_connection* con, packet* pkt){
+    upload* up = pkt->up;
+    if((pkt->kind == PACKET_DATA || pkt->kind == PACKET_ZERO) && !up->failed){
+        //open the file on its first payload
+        if(up->file == NULL){
+            up->file = open_file(p->root_dir, up->username, up->filename, p->direct);
+            up->failed = up->file == NULL;
+        }
+        if(pkt->kind == PACKET_ZERO){
+            if(up->file != NULL) wb_zero(up->file, pkt->offset, pkt->hole);
+        }else if(up->file != NULL && wb_write(up->file, pkt->offset, payload(pkt), pkt->len) == -1){
+            syslog(LOG_ERR, "Unable to write %s", up->filename);
+            up->failed = true;
+        }
+    }
+    if(pkt->kind == PACKET_DATA){
+        atomic_fetch_sub(&up->share->in_flight, pkt->len);
+    }
+
+    if(pkt->kind == PACKET_CLOSE || pkt->last){
+        close_upload(con, up, pkt->kind != PACKET_CLOSE);
+    }
+}
+
+/* a disk writer stage: writes payloads to their files. payloads are taken
+   off the ring as they arrive and queued per user, and the users' queues
+   are served in weighted fair order */
+static void* writer_stage(void* arg){
+    pipeline* p = ((stage_arg*)arg)->p;
+    int index = ((stage_arg*)arg)->index;
+    ring* r = p->disk[index];
+    hdb_connection* con = hdb_connect(p->redis_hostname);
+    drr sched = {0};
+    free(arg);
+
+    while(1){
+        //queue everything which has arrived behind its user's earlier payloads
+        packet* pkt;
+        while((pkt = (packet*)ring_pop(r)) != NULL){
+            drr_enqueue(&sched, &pkt->up->share->disk_flows[index], pkt);
+        }
+
+        pkt = drr_dequeue(&sched);
+        if(pkt == NULL){
+            if(atomic_load(&p->stop_writers) && ring_depth(r) == 0) break;
+            pkt = (packet*)ring_pop_wait(r, STAGE_WAIT);
+            if(pkt != NULL){
+                drr_enqueue(&sched, &pkt->up->share->disk_flows[index], pkt);
+            }
+            continue;
+        }
+
+        write_packet(p, con, pkt);
+        pipeline_release(p, pkt);
+
+        //its user has less waiting for the disk
+        progress(p);
+    }
+
+    hdb_disconnect(con);
+    return NULL;
+}
+
+/* creates the pipeline and starts a network thread for each of the num_rx
+   sockets in sockfds, and the checksum and disk writer threads */
+pipeline* pipeline_start(int* sockfds, int num_rx, char* root_dir, char* redis_hostname, bool direct, int num_writers){
+    pipeline* p = (pipeline*)calloc(1, sizeof(pipeline));
+    p->sockfds = sockfds;
+    p->num_rx = num_rx;
+    p->root_dir = root_dir;
+    p->redis_hostname = redis_hostname;
+    p->direct = direct;
+    p->num_writers = num_writers;
+
+    //fill the pool
+    p->packets = (packet*)calloc(POOL_SIZE, sizeof(packet));
+    p->free_packets = ring_create(POOL_SIZE);
+    for(int i=0; i<POOL_SIZE; i++){
+        p->packets[i].pooled = true;
+        ring_push(p->free_packets, &p->packets[i]);
+    }
+
+    //connect the stages
+    p->rx = ring_create(RX_RING_SIZE);
+    p->work = ring_create(WORK_RING_SIZE);
+    p->disk = (ring**)malloc(num_writers*sizeof(ring*));
+    for(int i=0; i<num_writers; i++){
+        p->disk[i] = ring_create(DISK_RING_SIZE);
+    }
+
+    //start the threads with signals blocked, so they are handled by the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    p->net_threads = (pthread_t*)malloc(num_rx*sizeof(pthread_t));
+    for(int i=0; i<num_rx; i++){
+        stage_arg* arg = (stage_arg*)malloc(sizeof(stage_arg));
+        arg->p = p;
+        arg->index = i;
+        pthread_create(&p->net_threads[i], NULL, net_stage, arg);
+    }
+    pthread_create(&p->checksum_thread, NULL, checksum_stage, p);
+    p->writer_threads = (pthread_t*)malloc(num_writers*sizeof(pthread_t));
+    for(int i=0; i<num_writers; i++){
+        stage_arg* arg = (stage_arg*)malloc(sizeof(stage_arg));
+        arg->p = p;
+        arg->index = i;
+        pthread_create(&p->writer_threads[i], NULL, writer_stage, arg);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return p;
+}
+
+/* drains the stages after the protocol stage, stops every thread, and frees p */
+void pipeline_stop(pipeline* p){
+    //stop receiving, and discard whatever the protocol stage did not get to
+    atomic_store(&p->stop_net, true);
+    for(int i=0; i<p->num_rx; i++){
+        pthread_join(p->net_threads[i], NULL);
+    }
+    packet* pkt;
+    while((pkt = (packet*)ring_pop(p->rx)) != NULL){
+        pipeline_release(p, pkt);
+    }
+
+    //let the checksum stage and then the disk writers finish their queues
+    atomic_store(&p->stop_checksum, true);
+    pthread_join(p->checksum_thread, NULL);
+    atomic_store(&p->stop_writers, true);
+    for(int i=0; i<p->num_writers; i++){
+        pthread_join(p->writer_threads[i], NULL);
+        ring_destroy(p->disk[i]);
+    }
+
+    ring_destroy(p->rx);
+    ring_destroy(p->work);
+    ring_destroy(p->free_packets);
+    free(p->disk);
+    free(p->net_threads);
+    free(p->writer_threads);
+    free(p->packets);
+    free(p);
+}
+
+/* returns a received packet to the pool once the protocol stage is done with it */
+void pipeline_release(pipeline* p, packet* pkt){
+    if(pkt->pooled){
+        ring_push(p->free_packets, pkt);
+    }else{
+        free(pkt);
+    }
+}
+
+/* creates an upload of filename for the owner of share, assigning it a disk writer */
+upload* pipeline_upload(pipeline* p, user_share* share, char* filename, uint32_t checksum){
+    upload* up = (upload*)calloc(1, sizeof(upload));
+    up->username = strdup(share->username);
+    up->share = share;
+    up->filename = strdup(filename);
+    asprintf(&up->checksum, "%X", checksum);
+    up->expected_crc = checksum;
+    up->crc = crc32(0L, Z_NULL, 0);
+
+    //spread uploads over the writers; every payload of an upload goes to the same one
+    up->writer = p->next_writer;
+    p->next_writer = (p->next_writer+1) % p->num_writers;
+
+    return up;
+}
+
+/* asks the checksum and disk writer stages to wake the protocol stage,
+   through the rx ring, once they next move a payload on */
+void pipeline_wake_on_progress(pipeline* p){
+    atomic_store(&p->wake_protocol, true);
+}
+
+/* returns true if the checksum stage has room for another payload or
+   trailer. only the protocol stage adds to it, so the room is still there
+   when it does */
+bool pipeline_has_room(pipeline* p){
+    return ring_depth(p->work) < ring_capacity(p->work);
+}
+
+/* passes a payload, or a run of zeros, on to be checksummed and written.
+   returns false if the stage is full and the payload must be retried later */
+bool pipeline_submit(pipeline* p, packet* pkt){
+    pkt->kind = pkt->msg.buffer[0] == DATA_ZERO_TYPE ? PACKET_ZERO : PACKET_DATA;
+    if(!ring_push(p->work, pkt)){
+        atomic_fetch_add(&p->stalls, 1);
+        return false;
+    }
+    return true;
+}
+
+/* passes pkt on as the trailer of up, which carries its checksum and
+   closes it. returns false if the stage is full and it must be retried later */
+bool pipeline_trailer(pipeline* p, packet* pkt, upload* up, uint32_t checksum){
+    //the checksum stage reads these only once it has taken pkt off the ring
+    free(up->checksum);
+    asprintf(&up->checksum, "%X", checksum);
+    up->expected_crc = checksum;
+
+    pkt->kind = PACKET_TRAILER;
+    pkt->up   = up;
+    pkt->len  = 0;
+    pkt->last = true;
+    if(!ring_push(p->work, pkt)){
+        atomic_fetch_add(&p->stalls, 1);
+        return false;
+    }
+    return true;
+}
+
+/* abandons up: its file is closed without recording metadata */
+void pipeline_abort(pipeline* p, upload* up){
+    packet* pkt = (packet*)calloc(1, sizeof(packet));
+    pkt->kind = PACKET_CLOSE;
+    pkt->up = up;
+    pkt->pooled = false;
+    push_blocking(p->work, pkt);
+}
+
+/* logs the depth of every stage's queue */
+void pipeline_log_stats(pipeline* p, int priority){
+    char disk[64*p->num_writers + 1];
+    int len = 0;
+    disk[0] = '\0';
+    for(int i=0; i<p->num_writers; i++){
+        len += snprintf(disk + len, sizeof(disk) - len, " disk%d %zu/%zu (peak %zu)", i,
+                        ring_depth(p->disk[i]), ring_capacity(p->disk[i]), atomic_load(&p->disk[i]->peak));
+    }
+
+    syslog(priority, "Queues: rx %zu/%zu (peak %zu), checksum %zu/%zu (peak %zu),%s; free buffers %zu/%d; waited %lu, stalled %lu",
+           ring_depth(p->rx), ring_capacity(p->rx), atomic_load(&p->rx->peak),
+           ring_depth(p->work), ring_capacity(p->work), atomic_load(&p->work->peak),
+           disk, ring_depth(p->free_packets), POOL_SIZE,
+           atomic_load(&p->waits), atomic_load(&p->stalls));
+}
@@ -0,0 +1,178 @@
+/* DESCRIPTION: The stages hftpd's work is split into. Network threads
+        receive datagrams into buffers taken from a preallocated pool,
+        each from a socket of its own sharing the port, so the kernel
+        spreads the flows over them, and pass them to the protocol
+        stage (the main thread), which
+        runs the hftp exchange and sends ACKs. Payloads to be stored
+        go on to a checksum thread, which verifies each upload against
+        the checksum given in its CONTROL_INIT, and then to one of the
+        disk writer threads. The stages are connected by lock-free
+        rings carrying pointers to the pooled buffers, so a payload is
+        never copied between stages. Each disk writer serves its users'
+        payloads in weighted fair order (see scheduler.h), and the
+        protocol stage withholds ACKs from a user with too much waiting
+        for the disk, so a slow disk slows that user's senders first.  */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <zlib.h>
+#include <syslog.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "../common/udp_sockets.h"
+#include "../common/hftp_messages.h"
+#include "../hdb/hdb.h"
+#include "write_buffer.h"
+#include "ring.h"
+#include "scheduler.h"
+
+#define POOL_SIZE 4096      //number of datagram buffers in the pool
+#define RX_RING_SIZE 1024   //network -> protocol stage
+#define WORK_RING_SIZE 1024 //protocol -> checksum stage
+#define DISK_RING_SIZE 1024 //checksum -> each disk writer
+#define STAGE_WAIT 100      //ms an idle stage sleeps before checking for shutdown
+
+#define PACKET_DATA 0       //a payload to be stored
+#define PACKET_CLOSE 1      //an upload abandoned before its last payload
+#define PACKET_TRAILER 2    //the checksum of an upload, sent after its last payload
+#define PACKET_ZERO 3       //a run of zeros to be stored as a hole
+
+//a range of a striped upload checksummed apart from what comes before it
+typedef struct crc_piece
+{
+    uint64_t offset;
+    uint64_t len;
+    uint32_t crc;           //CRC-32 of the range alone
+    struct crc_piece* next; //next range, by offset
+} crc_piece;
+
+//an upload in progress. created by the protocol stage, freed by its disk writer
+typedef struct upload
+{
+    char* username;         //owner of the file
+    user_share* share;      //the owner's share of the disk
+    char* filename;         //name of the file
+    char* checksum;         //checksum given by the client, as a hex string
+    uint32_t expected_crc;  //checksum given by the client
+    bool trailer;           //the checksum follows the last payload, in a PACKET_TRAILER
+    bool striped;           //payloads come over several flows, out of order
+    uint32_t crc;           //checksum of the payloads so far (checksum stage only)
+    uint64_t crc_len;       //bytes crc covers, from the start of a striped file
+    crc_piece* pieces;      //ranges of a striped file past crc_len, by offset
+    bool verified;          //set by the checksum stage if the checksums matched
+    int writer;             //disk writer which stores the file
+    write_buffer* file;     //the file being written (disk writer only)
+    bool failed;            //set if the file could not be written
+} upload;
+
+//a pooled datagram buffer, and where its payload belongs
+typedef struct packet
+{
+    message msg;            //the datagram; first so a packet* is a message*
+    host source;            //who sent the datagram
+    int kind;               //PACKET_DATA, PACKET_CLOSE, PACKET_TRAILER or PACKET_ZERO
+    upload* up;             //upload the payload belongs to
+    uint64_t offset;        //file offset of the payload
+    uint16_t len;           //length of the payload
+    uint64_t hole;          //length of the run of zeros of a PACKET_ZERO
+    bool last;              //set on the last payload of the upload
+    bool pooled;            //false for packets allocated outside the pool
+    struct packet* next;    //next packet in the same scheduler queue
+} packet;
+
+typedef struct
+{
+    int* sockfds;           //sockets the network threads read, one each
+    int num_rx;             //number of network threads
+    char* root_dir;         //directory files are stored under
+    char* redis_hostname;   //Redis server the disk writers record metadata in
+    bool direct;            //write files with O_DIRECT
+    int num_writers;        //number of disk writer threads
+
+    packet* packets;        //the buffer pool
+    ring* free_packets;     //unused buffers
+    ring* rx;               //network -> protocol
+    ring* work;             //protocol -> checksum
+    ring** disk;            //checksum -> disk writer i
+
+    int next_writer;        //disk writer the next upload is assigned to
+
+    pthread_t* net_threads;
+    pthread_t checksum_thread;
+    pthread_t* writer_threads;
+    atomic_bool stop_net;
+    atomic_bool stop_checksum;
+    atomic_bool stop_writers;
+    atomic_bool wake_protocol; //set while the protocol stage waits for a payload to move on
+    atomic_ulong waits;     //datagrams a network stage held because the protocol stage was behind
+    atomic_ulong stalls;    //times a payload was held back because the checksum stage was full
+} pipeline;
+
+/* returns true if filename, as a client names it, lies beneath the directory
+   of username: the username is a single path component, and the filename is
+   not empty, not absolute, and has no ".." component */
+bool filename_allowed(const char* username, const char* filename);
+
+/* opens the file stored at root_dir/username/filename for reading, resolving
+   filename beneath the user's directory, so it cannot name a file outside it.
+   returns the file descriptor, or -1 if it could not be opened */
+int open_stored(char* root_dir, char* username, char* filename);
+
+/* creates unexistant dirs, erases the files, then opens the file stored at root_dir/username/filename
+   if direct is set, the file is written with O_DIRECT where possible.
+   returns NULL if the file could not be opened, or is not the user's to write */
+write_buffer* open_file(char* root_dir, char* username, char* filename, bool direct);
+
+/* creates the pipeline and starts a network thread for each of the num_rx
+   sockets in sockfds, and the checksum and disk writer threads */
+pipeline* pipeline_start(int* sockfds, int num_rx, char* root_dir, char* redis_hostname, bool direct, int num_writers);
+
+/* drains the stages after the protocol stage, stops every thread, and frees p */
+void pipeline_stop(pipeline* p);
+
+/* returns a received packet to the pool once the protocol stage is done with it */
+void pipeline_release(pipeline* p, packet* pkt);
+
+/* creates an upload of filename for the owner of share, assigning it a disk writer */
+upload* pipeline_upload(pipeline* p, user_share* share, char* filename, uint32_t checksum);
+
+/* asks the checksum and disk writer stages to wake the protocol stage,
+   through the rx ring, once they next move a payload on */
+void pipeline_wake_on_progress(pipeline* p);
+
+/* returns true if the checksum stage has room for another payload or
+   trailer. only the protocol stage adds to it, so the room is still there
+   when it does */
+bool pipeline_has_room(pipeline* p);
+
+/* passes a payload, or a run of zeros, on to be checksummed and written.
+   returns false if the stage is full and the payload must be retried later */
+bool pipeline_submit(pipeline* p, packet* pkt);
+
+/* passes pkt on as the trailer of up, which carries its checksum and
+   closes it. returns false if the stage is full and it must be retried later */
+bool pipeline_trailer(pipeline* p, packet* pkt, upload* up, uint32_t checksum);
+
+/* abandons up: its file is closed without recording metadata */
+void pipeline_abort(pipeline* p, upload* up);
+
+/* logs the depth of every stage's queue */
+void pipeline_log_stats(pipeline* p, int priority);
+
+#endif //PIPELINE_H
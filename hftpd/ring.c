@@ -0,0 +1,158 @@
+#include "ring.h"
+
+/* creates a ring holding up to capacity pointers (rounded up to a power of two) */
+ring* ring_create(size_t capacity){
+    size_t size = 2;
+    while(size < capacity){
+        size *= 2;
+    }
+
+    ring* r;
+    if(posix_memalign((void**)&r, 64, sizeof(ring)) != 0){
+        syslog(LOG_ERR, "Could not allocate ring");
+        exit(EXIT_FAILURE);
+    }
+    r->cells = (ring_cell*)malloc(size*sizeof(ring_cell));
+    for(size_t i=0; i<size; i++){
+        atomic_init(&r->cells[i].seq, i);
+        r->cells[i].data = NULL;
+    }
+    r->mask = size - 1;
+    r->eventfd = eventfd(0, EFD_NONBLOCK);
+    atomic_init(&r->sleeping, false);
+    atomic_init(&r->peak, 0);
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+
+    return r;
+}
+
+/* frees r. the ring must no longer be in use */
+void ring_destroy(ring* r){
+    close(r->eventfd);
+    free(r->cells);
+    free(r);
+}
+
+/* adds data to r. returns false if r is full */
+bool ring_push(ring* r, void* data){
+    size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    ring_cell* cell;
+
+    while(1){
+        cell = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if(diff == 0){
+            //the cell is free, claim it
+            if(atomic_compare_exchange_weak_explicit(&r->head, &pos, pos+1,
+                                                     memory_order_relaxed, memory_order_relaxed)){
+                break;
+            }
+        }else if(diff < 0){
+            //the cell has not been popped yet: the ring is full
+            return false;
+        }else{
+            //another producer claimed the cell, retry at the new head
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+        }
+    }
+
+    cell->data = data;
+    atomic_store_explicit(&cell->seq, pos+1, memory_order_release);
+
+    //track the deepest the ring has been
+    size_t depth = ring_depth(r);
+    size_t peak = atomic_load_explicit(&r->peak, memory_order_relaxed);
+    while(depth > peak &&
+          !atomic_compare_exchange_weak_explicit(&r->peak, &peak, depth,
+                                                 memory_order_relaxed, memory_order_relaxed));
+
+    //wake the consumer if it went to sleep
+    if(atomic_load(&r->sleeping)){
+        uint64_t one = 1;
+        write(r->eventfd, &one, sizeof(one));
+    }
+
+    return true;
+}
+
+/* removes and returns the oldest pointer in r, or NULL if r is empty */
+void* ring_pop(ring* r){
+    size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    ring_cell* cell;
+
+    while(1){
+        cell = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos+1);
+
+        if(diff == 0){
+            //the cell is filled, claim it
+            if(atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos+1,
+                                                     memory_order_relaxed, memory_order_relaxed)){
+                break;
+            }
+        }else if(diff < 0){
+            //the cell has not been pushed yet: the ring is empty
+            return NULL;
+        }else{
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+
+    void* data = cell->data;
+    atomic_store_explicit(&cell->seq, pos + r->mask + 1, memory_order_release);
+    return data;
+}
+
+/* like ring_pop(), but waits up to timeout ms for r to become non-empty */
+void* ring_pop_wait(ring* r, int timeout){
+    void* data;
+
+    //spin briefly, data usually follows closely behind
+    for(int i=0; i<RING_SPIN; i++){
+        if((data = ring_pop(r)) != NULL) return data;
+        sched_yield();
+    }
+
+    //announce that we are going to sleep, then check once more so a push
+    //which missed the announcement is not slept through
+    atomic_store(&r->sleeping, true);
+    if((data = ring_pop(r)) == NULL){
+        struct pollfd pfd = {
+            .fd = r->eventfd,
+            .events = POLLIN
+        };
+        if(poll(&pfd, 1, timeout) == 1){
+            uint64_t count;
+            read(r->eventfd, &count, sizeof(count));
+        }
+        data = ring_pop(r);
+    }
+    atomic_store(&r->sleeping, false);
+
+    return data;
+}
+
+/* wakes the consumer sleeping on r without pushing anything, or if none
+   is, the next one to sleep */
+void ring_wake(ring* r){
+    //the eventfd keeps its count until it is read, so a consumer about to
+    //sleep does not miss it
+    uint64_t one = 1;
+    write(r->eventfd, &one, sizeof(one));
+}
+
+/* returns the number of pointers in r */
+size_t ring_depth(ring* r){
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    return head > tail ? head - tail : 0;
+}
+
+/* returns the capacity of r */
+size_t ring_capacity(ring* r){
+    return r->mask + 1;
+}
@@ -0,0 +1,68 @@
+/* DESCRIPTION: A bounded lock-free queue of pointers used to connect the
+        stages of the hftpd pipeline. Each cell carries a sequence
+        number, so any number of threads may push and pop without
+        locks (a ring is used as SPSC between two stages and as MPSC
+        for the buffer pool's free list). A consumer with nothing to
+        do can sleep on the ring's eventfd instead of spinning; only
+        then do producers pay for a write() to wake it.              */
+
+#ifndef RING_H
+#define RING_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+
+#define RING_SPIN 256 //times a consumer polls an empty ring before sleeping
+
+typedef struct
+{
+    atomic_size_t seq;          //position this cell is ready for
+    void* data;
+} ring_cell;
+
+typedef struct
+{
+    ring_cell* cells;
+    size_t mask;                //capacity - 1, capacity is a power of two
+    int eventfd;                //wakes a sleeping consumer
+    atomic_bool sleeping;       //set while a consumer sleeps on eventfd
+    atomic_size_t peak;         //highest depth observed by a producer
+    _Alignas(64) atomic_size_t head;  //next position to push to
+    _Alignas(64) atomic_size_t tail;  //next position to pop from
+} ring;
+
+/* creates a ring holding up to capacity pointers (rounded up to a power of two) */
+ring* ring_create(size_t capacity);
+
+/* frees r. the ring must no longer be in use */
+void ring_destroy(ring* r);
+
+/* adds data to r. returns false if r is full */
+bool ring_push(ring* r, void* data);
+
+/* removes and returns the oldest pointer in r, or NULL if r is empty */
+void* ring_pop(ring* r);
+
+/* like ring_pop(), but waits up to timeout ms for r to become non-empty */
+void* ring_pop_wait(ring* r, int timeout);
+
+/* wakes the consumer sleeping on r without pushing anything, or if none
+   is, the next one to sleep */
+void ring_wake(ring* r);
+
+/* returns the number of pointers in r */
+size_t ring_depth(ring* r);
+
+/* returns the capacity of r */
+size_t ring_capacity(ring* r);
+
+#endif //RING_H
@@ -0,0 +1,251 @@
+#include "scheduler.h"
+#include "pipeline.h"
+#include "session.h"
+
+/* adds flow to the back of the active list */
+static void activate(drr* sched, drr_flow* flow){
+    flow->next_active = NULL;
+    if(sched->active_tail != NULL){
+        sched->active_tail->next_active = flow;
+    }else{
+        sched->active_head = flow;
+    }
+    sched->active_tail = flow;
+    flow->active = true;
+}
+
+/* removes the flow at the front of the active list */
+static drr_flow* pop_active(drr* sched){
+    drr_flow* flow = sched->active_head;
+    sched->active_head = flow->next_active;
+    if(sched->active_head == NULL){
+        sched->active_tail = NULL;
+    }
+    flow->next_active = NULL;
+    flow->active = false;
+    flow->credited = false;
+    return flow;
+}
+
+/* adds pkt to the back of flow, activating the flow if it was idle */
+void drr_enqueue(drr* sched, drr_flow* flow, packet* pkt){
+    pkt->next = NULL;
+    if(flow->tail != NULL){
+        flow->tail->next = pkt;
+    }else{
+        flow->head = pkt;
+    }
+    flow->tail = pkt;
+    flow->length++;
+
+    if(!flow->active){
+        flow->deficit = 0;
+        activate(sched, flow);
+    }
+}
+
+/* removes and returns the next packet in deficit round robin order,
+   or NULL if no eligible flow has a packet queued */
+packet* drr_dequeue(drr* sched){
+    //flows passed over so far. a flow which can send does so by its second
+    //visit, so once every active flow has been passed over twice none can
+    int skipped = 0;
+    int active = 0;
+    for(drr_flow* f = sched->active_head; f != NULL; f = f->next_active){
+        active++;
+    }
+
+    while(sched->active_head != NULL && skipped < 2*active){
+        drr_flow* flow = sched->active_head;
+
+        //a flow held back keeps its place in the rotation but earns nothing
+        if(sched->eligible != NULL && !sched->eligible(flow, sched->context)){
+            activate(sched, pop_active(sched));
+            skipped++;
+            continue;
+        }
+
+        //each visit to a flow earns it a quantum in proportion to its weight
+        if(!flow->credited){
+            flow->deficit += (long)DRR_QUANTUM * flow->weight;
+            flow->credited = true;
+        }
+
+        packet* pkt = flow->head;
+        if(pkt->msg.length > flow->deficit){
+            //the flow has used up its quantum, move on to the next one
+            activate(sched, pop_active(sched));
+            skipped++;
+            continue;
+        }
+
+        flow->deficit -= pkt->msg.length;
+        flow->head = pkt->next;
+        if(flow->head == NULL){
+            flow->tail = NULL;
+        }
+        flow->length--;
+        pkt->next = NULL;
+
+        //an emptied flow gives up what is left of its quantum
+        if(flow->length == 0){
+            pop_active(sched);
+            flow->deficit = 0;
+        }
+        return pkt;
+    }
+
+    return NULL;
+}
+
+/* deactivates flow, returning its queued packets as a list linked by next */
+packet* drr_remove(drr* sched, drr_flow* flow){
+    if(flow->active){
+        drr_flow** link = &sched->active_head;
+        drr_flow* prev = NULL;
+        while(*link != flow){
+            prev = *link;
+            link = &(*link)->next_active;
+        }
+        *link = flow->next_active;
+        if(sched->active_tail == flow){
+            sched->active_tail = prev;
+        }
+        flow->next_active = NULL;
+        flow->active = false;
+        flow->credited = false;
+    }
+
+    packet* queued = flow->head;
+    flow->head = NULL;
+    flow->tail = NULL;
+    flow->length = 0;
+    flow->deficit = 0;
+    return queued;
+}
+
+/* creates a share for username with the given weight and cap */
+static user_share* add_share(share_table* table, const char* username, int weight, long cap){
+    user_share* share = (user_share*)calloc(1, sizeof(user_share));
+    share->username = strdup(username);
+    share->weight = weight;
+    share->cap = cap;
+    share->refilled = now_ms();
+    atomic_init(&share->in_flight, 0);
+
+    share->disk_flows = (drr_flow*)calloc(table->num_writers, sizeof(drr_flow));
+    for(int i=0; i<table->num_writers; i++){
+        share->disk_flows[i].weight = weight;
+        share->disk_flows[i].owner = share;
+    }
+
+    share->next = table->shares;
+    table->shares = share;
+    return share;
+}
+
+/* creates a table of shares, reading weights and caps from path if it is
+   not NULL. each line of the file is: username weight [bytes per second] */
+share_table* load_shares(char* path, int num_writers){
+    share_table* table = (share_table*)calloc(1, sizeof(share_table));
+    table->num_writers = num_writers;
+    if(path == NULL) return table;
+
+    FILE* f = fopen(path, "r");
+    if(f == NULL){
+        syslog(LOG_ERR, "Unable to open weights file %s", path);
+        exit(EXIT_FAILURE);
+    }
+
+    char* line = NULL;
+    size_t line_size = 0;
+    int line_number = 0;
+    while(getline(&line, &line_size, f) != -1){
+        line_number++;
+
+        //skip blank lines and comments
+        char* start = line + strspn(line, " \t");
+        if(*start == '#' || *start == '\n' || *start == '\0') continue;
+
+        char* username = NULL;
+        int weight;
+        long cap = 0;
+        int fields = sscanf(start, "%ms %d %ld", &username, &weight, &cap);
+        if(fields < 2 || weight < 1 || cap < 0){
+            syslog(LOG_ERR, "%s:%d: expected: username weight [bytes per second]", path, line_number);
+            exit(EXIT_FAILURE);
+        }
+
+        add_share(table, username, weight, cap);
+        syslog(LOG_DEBUG, "User %s has weight %d, cap %ld B/s", username, weight, cap);
+        free(username);
+    }
+
+    free(line);
+    fclose(f);
+    return table;
+}
+
+/* returns username's share, creating one with the default weight if needed */
+user_share* get_share(share_table* table, const char* username){
+    for(user_share* share = table->shares; share != NULL; share = share->next){
+        if(strcmp(share->username, username) == 0){
+            return share;
+        }
+    }
+    return add_share(table, username, DEFAULT_WEIGHT, 0);
+}
+
+/* returns true if the share has room to accept len more bytes for upload */
+bool share_admits(user_share* share, int len){
+    return share_wait(share, len) == 0;
+}
+
+/* returns 0 if the share has room to accept len more bytes for upload, the
+   ms until its cap lets it if that is what holds it, or -1 if it has too
+   much waiting for the disk, which only a write can change */
+long share_wait(user_share* share, int len){
+    //a user may only have so much waiting for the disk, so one user's
+    //backlog cannot fill the pipeline
+    if(atomic_load(&share->in_flight) + len > (long)SHARE_INFLIGHT * share->weight){
+        return -1;
+    }
+    if(share->cap == 0) return 0;
+
+    //top up the bucket for the time passed, allowing bursts of up to 100ms
+    long now = now_ms();
+    double burst = share->cap/10 > DRR_QUANTUM ? share->cap/10 : DRR_QUANTUM;
+    share->tokens += (now - share->refilled) * share->cap / 1000.0;
+    if(share->tokens > burst){
+        share->tokens = burst;
+    }
+    share->refilled = now;
+
+    if(share->tokens >= len) return 0;
+    long wait = (long)((len - share->tokens) * 1000 / share->cap) + 1;
+    return wait;
+}
+
+/* takes len bytes from the share's upload allowance */
+void share_charge(user_share* share, int len){
+    atomic_fetch_add(&share->in_flight, len);
+    if(share->cap != 0){
+        share->tokens -= len;
+    }
+}
+
+/* returns len bytes taken by share_charge() which were not used after all */
+void share_refund(user_share* share, int len){
+    atomic_fetch_sub(&share->in_flight, len);
+    if(share->cap != 0){
+        share->tokens += len;
+    }
+}
+
+/* logs every user's weight, cap and bytes waiting for the disk */
+void log_shares(share_table* table, int priority){
+    for(user_share* share = table->shares; share != NULL; share = share->next){
+        syslog(priority, "User %s: weight %d, cap %ld B/s, %ld bytes waiting for disk",
+               share->username, share->weight, share->cap, atomic_load(&share->in_flight));
+    }
+}
@@ -0,0 +1,103 @@
+/* DESCRIPTION: Weighted fair scheduling of the work hftpd does for its
+        users. Each user has a share: a weight, and optionally a cap on
+        the bytes per second they may upload. Work waiting in a stage
+        is kept in one queue (a flow) per session or per user, and
+        flows are served in deficit round robin order, each receiving a
+        quantum of bytes per round in proportion to its weight. A user
+        pushing a large backup therefore cannot starve others.       */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <stdatomic.h>
+
+#define DRR_QUANTUM 1500         //bytes a flow of weight 1 may send per round
+#define SHARE_INFLIGHT 262144    //bytes a user of weight 1 may have queued for disk
+#define DEFAULT_WEIGHT 1
+
+struct packet;
+
+//a queue of packets served by a deficit round robin scheduler
+typedef struct drr_flow
+{
+    struct packet* head;        //oldest queued packet
+    struct packet* tail;        //newest queued packet
+    int length;                 //number of queued packets
+    int weight;                 //share of the rounds this flow receives
+    long deficit;               //bytes this flow may still send this round
+    bool active;                //set while the flow is in the active list
+    bool credited;              //set once this visit's quantum has been added
+    void* owner;                //what the flow belongs to
+    struct drr_flow* next_active;
+} drr_flow;
+
+//a deficit round robin scheduler over the flows with packets queued
+typedef struct
+{
+    drr_flow* active_head;
+    drr_flow* active_tail;
+    bool (*eligible)(drr_flow*, void*); //if set, flows it rejects are skipped for now
+    void* context;              //passed to eligible
+} drr;
+
+//a user's share of hftpd
+typedef struct user_share
+{
+    char* username;
+    int weight;                 //relative share of each stage
+    long cap;                   //bytes per second the user may upload, 0 for no cap
+    double tokens;              //bytes the user may upload right now, if capped
+    long refilled;              //time tokens was last topped up (ms)
+    atomic_long in_flight;      //bytes accepted but not yet written to disk
+    drr_flow* disk_flows;       //the user's flow at each disk writer
+    struct user_share* next;
+} user_share;
+
+typedef struct
+{
+    user_share* shares;
+    int num_writers;            //number of disk writers, each with its own flows
+} share_table;
+
+/* adds pkt to the back of flow, activating the flow if it was idle */
+void drr_enqueue(drr* sched, drr_flow* flow, struct packet* pkt);
+
+/* removes and returns the next packet in deficit round robin order,
+   or NULL if no eligible flow has a packet queued */
+struct packet* drr_dequeue(drr* sched);
+
+/* deactivates flow, returning its queued packets as a list linked by next */
+struct packet* drr_remove(drr* sched, drr_flow* flow);
+
+/* creates a table of shares, reading weights and caps from path if it is
+   not NULL. each line of the file is: username weight [bytes per second] */
+share_table* load_shares(char* path, int num_writers);
+
+/* returns username's share, creating one with the default weight if needed */
+user_share* get_share(share_table* table, const char* username);
+
+/* returns true if the share has room to accept len more bytes for upload */
+bool share_admits(user_share* share, int len);
+
+/* returns 0 if the share has room to accept len more bytes for upload, the
+   ms until its cap lets it if that is what holds it, or -1 if it has too
+   much waiting for the disk, which only a write can change */
+long share_wait(user_share* share, int len);
+
+/* takes len bytes from the share's upload allowance */
+void share_charge(user_share* share, int len);
+
+/* returns len bytes taken by share_charge() which were not used after all */
+void share_refund(user_share* share, int len);
+
+/* logs every user's weight, cap and bytes waiting for the disk */
+void log_shares(share_table* table, int priority);
+
+#endif //SCHEDULER_H
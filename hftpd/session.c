@@ -0,0 +1,60 @@
+#include "session.h"
+
+/* returns the current monotonic time in ms */
+long now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/* returns the session for client, creating it if there is none */
+session* get_session(session** head, host* client){
+    session* s;
+
+    //look for an existing session with the same address and port
+    for(s = *head; s != NULL; s = s->next){
+        if(s->client.addr.sin_addr.s_addr == client->addr.sin_addr.s_addr &&
+           s->client.addr.sin_port == client->addr.sin_port){
+            return s;
+        }
+    }
+
+    //none found, create a new one at the head of the list
+    s = (session*)calloc(1, sizeof(session));
+    memcpy(&s->client, client, sizeof(host));
+    s->last_active = now_ms();
+    s->flow.weight = DEFAULT_WEIGHT;
+    s->flow.owner = s;
+    s->next = *head;
+    *head = s;
+
+    return s;
+}
+
+/* releases the restore state held by s. an upload in progress must
+   already have been handed back to the pipeline */
+void reset_session(session* s){
+    free(s->filename);
+    s->filename = NULL;
+
+    if(s->map != NULL){
+        munmap(s->map, s->map_len);
+        s->map = NULL;
+    }
+    s->map_len = 0;
+    s->awaiting_ack = false;
+}
+
+/* unlinks s from the list and frees it */
+void remove_session(session** head, session* s){
+    session** link = head;
+    while(*link != s){
+        link = &(*link)->next;
+    }
+    *link = s->next;
+
+    reset_session(s);
+    free(s->username);
+    free(s->last_response);
+    free(s);
+}
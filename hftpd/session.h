@@ -0,0 +1,75 @@
+/* DESCRIPTION: hftpd keeps one session per client address. A session holds
+        the state of the alternating-bit exchange with that client, the
+        file currently being uploaded, and the file currently being
+        restored, so that several clients can be served at once. An
+        upload striped over several flows is held by the session of
+        the flow it began on; the sessions of the flows which joined it
+        only point to that one.                                       */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "../common/udp_sockets.h"
+#include "scheduler.h"
+
+#define SESSION_TIMEOUT 60000  //ms a session may stay idle before it is dropped
+#define RESEND_TIMEOUT 1000    //ms to wait for an ACK before resending restore data
+#define SESSION_QUEUE 32       //datagrams a session may have waiting to be handled
+
+typedef struct session
+{
+    host client;                //address of the client
+    uint8_t expected_seq;       //seq of the next message expected from client
+    message* last_response;     //last response sent, resent on duplicates
+    long last_active;           //time of the last message from client (ms)
+    bool closed;                //set once a CONTROL_TERM has been received
+    uint8_t version;            //protocol version of the current transfer
+    drr_flow flow;              //datagrams from client waiting to be handled
+
+    char* username;             //owner of the files being transferred
+    user_share* share;          //the owner's share of hftpd, NULL until known
+    char* filename;             //file being transferred
+
+    //upload state
+    struct upload* upload;      //file being uploaded, NULL if none
+    uint64_t filesize;          //size of the file being uploaded
+    uint64_t bytes_recvd;       //bytes of the file received so far
+    bool striped;               //its data may come over several flows, at any offset
+    uint32_t upload_id;         //the upload this flow began or joined
+    struct session* primary;    //session holding the upload this flow joined, NULL if none
+
+    //restore state
+    uint8_t* map;               //mapping of the file being restored, NULL if none
+    size_t map_len;             //length of map
+    size_t send_offset;         //offset of the unacknowledged data message
+    uint16_t send_len;          //payload length of the unacknowledged data message
+    uint8_t send_seq;           //seq of the unacknowledged data message
+    bool awaiting_ack;          //set while a data message is unacknowledged
+    long last_send;             //time the unacknowledged data was sent (ms)
+
+    struct session* next;
+} session;
+
+/* returns the current monotonic time in ms */
+long now_ms();
+
+/* returns the session for client, creating it if there is none */
+session* get_session(session** head, host* client);
+
+/* releases the restore state held by s. an upload in progress must
+   already have been handed back to the pipeline */
+void reset_session(session* s);
+
+/* unlinks s from the list and frees it */
+void remove_session(session** head, session* s);
+
+#endif //SESSION_H
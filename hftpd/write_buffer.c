@@ -0,0 +1,225 @@
+#include "write_buffer.h"
+
+#define ALIGN_DOWN(x) ((x) & ~((uint64_t)WRITE_BUFFER_ALIGN - 1))
+
+/* calls pwrite() until all len bytes of buf are written at offset */
+static int pwrite_all(int fd, const uint8_t* buf, size_t len, uint64_t offset){
+    while(len > 0){
+        ssize_t written = pwrite(fd, buf, len, offset);
+        if(written == -1){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        buf    += written;
+        len    -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+/* writes the staged bytes of the file range [start, end) to disk.
+   the aligned part of the range goes through O_DIRECT if it is enabled */
+static int write_range(write_buffer* wb, uint64_t start, uint64_t end){
+    if(wb->direct_fd != -1 && start % WRITE_BUFFER_ALIGN == 0){
+        uint64_t direct_len = ALIGN_DOWN(end - start);
+        if(direct_len > 0){
+            if(pwrite_all(wb->direct_fd, wb->buf + (start - wb->base), direct_len, start) == 0){
+                start += direct_len;
+            }else if(errno == EINVAL){
+                //the file system does not support O_DIRECT after all
+                syslog(LOG_WARNING, "O_DIRECT write rejected, falling back to buffered writes");
+                close(wb->direct_fd);
+                wb->direct_fd = -1;
+            }else{
+                return -1;
+            }
+        }
+    }
+
+    if(start < end){
+        return pwrite_all(wb->fd, wb->buf + (start - wb->base), end - start, start);
+    }
+    return 0;
+}
+
+/* writes staged ranges up to (but not including) file offset limit, and
+   moves whatever is staged past limit to the front of the buffer */
+static int flush_until(write_buffer* wb, uint64_t limit){
+    int kept = 0;
+
+    for(int i=0; i<wb->num_extents; i++){
+        wb_extent* e = &wb->extents[i];
+        if(e->end <= limit){
+            if(write_range(wb, e->start, e->end) == -1) return -1;
+        }else{
+            if(e->start < limit){
+                if(write_range(wb, e->start, limit) == -1) return -1;
+                e->start = limit;
+            }
+            wb->extents[kept++] = *e;
+        }
+    }
+
+    //move the remaining bytes to the front of the buffer
+    if(kept > 0){
+        uint64_t last_end = wb->extents[kept-1].end;
+        memmove(wb->buf, wb->buf + (limit - wb->base), last_end - limit);
+        wb->base = limit;
+    }
+    wb->num_extents = kept;
+
+    return 0;
+}
+
+/* records that the file range [start, end) is now staged,
+   merging it with any ranges it touches */
+static void add_extent(write_buffer* wb, uint64_t start, uint64_t end){
+    int i = 0;
+
+    //find the first range which ends at or after start
+    while(i < wb->num_extents && wb->extents[i].end < start){
+        i++;
+    }
+
+    //merge every range which overlaps or touches [start, end)
+    int j = i;
+    while(j < wb->num_extents && wb->extents[j].start <= end){
+        if(wb->extents[j].start < start) start = wb->extents[j].start;
+        if(wb->extents[j].end > end) end = wb->extents[j].end;
+        j++;
+    }
+
+    //replace ranges i..j-1 with the merged range
+    if(j == i){
+        memmove(&wb->extents[i+1], &wb->extents[i], (wb->num_extents - i)*sizeof(wb_extent));
+        wb->num_extents++;
+    }else if(j > i+1){
+        memmove(&wb->extents[i+1], &wb->extents[j], (wb->num_extents - j)*sizeof(wb_extent));
+        wb->num_extents -= j - i - 1;
+    }
+    wb->extents[i].start = start;
+    wb->extents[i].end   = end;
+}
+
+/* creates (or truncates) the file at path and returns a write buffer for it.
+   if direct is set, aligned blocks are written with O_DIRECT.
+   returns NULL if the file could not be opened */
+write_buffer* wb_open(const char* path, bool direct){
+    write_buffer* wb = (write_buffer*)malloc(sizeof(write_buffer));
+
+    wb->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(wb->fd == -1){
+        syslog(LOG_ERR, "Could not open %s: %s", path, strerror(errno));
+        free(wb);
+        return NULL;
+    }
+
+    wb->direct_fd = -1;
+    if(direct){
+        wb->direct_fd = open(path, O_WRONLY | O_DIRECT);
+        if(wb->direct_fd == -1){
+            syslog(LOG_WARNING, "O_DIRECT unavailable for %s: %s", path, strerror(errno));
+        }
+    }
+
+    if(posix_memalign((void**)&wb->buf, WRITE_BUFFER_ALIGN, WRITE_BUFFER_SIZE) != 0){
+        syslog(LOG_ERR, "Could not allocate write buffer");
+        exit(EXIT_FAILURE);
+    }
+    wb->base = 0;
+    wb->num_extents = 0;
+    wb->size = 0;
+    wb->holes = false;
+
+    return wb;
+}
+
+/* places len bytes of data at offset in the file. data is staged in the
+   buffer and only written once the buffer is flushed.
+   returns 0 on success, -1 on a write error */
+int wb_write(write_buffer* wb, uint64_t offset, const uint8_t* data, size_t len){
+    uint64_t end = offset + len;
+    if(len == 0) return 0;
+    if(end > wb->size) wb->size = end;
+
+    //data behind the staged window was already flushed around; write it in place
+    if(wb->num_extents > 0 && end <= wb->base){
+        return pwrite_all(wb->fd, data, len, offset);
+    }
+
+    //make room if the data does not fit in the current window
+    if(wb->num_extents > 0 &&
+       (offset < wb->base || end > wb->base + WRITE_BUFFER_SIZE ||
+        wb->num_extents == WRITE_BUFFER_MAX_EXTENTS)){
+
+        //sequential data: write the aligned blocks and keep the unaligned tail
+        wb_extent* last = &wb->extents[wb->num_extents-1];
+        if(offset == last->end && ALIGN_DOWN(last->end) > wb->base){
+            if(flush_until(wb, ALIGN_DOWN(last->end)) == -1) return -1;
+        }else if(offset >= wb->base && end > wb->base + WRITE_BUFFER_SIZE){
+            //data a little ahead, such as that of another flow of a striped
+            //upload: slide the window forward only as far as it needs to go,
+            //so the payloads still to come behind it stay staged
+            uint64_t limit = ALIGN_DOWN(end - WRITE_BUFFER_SIZE + WRITE_BUFFER_ALIGN - 1);
+            if(limit <= offset && flush_until(wb, limit) == -1) return -1;
+        }
+
+        if(offset < wb->base || end > wb->base + WRITE_BUFFER_SIZE ||
+           wb->num_extents == WRITE_BUFFER_MAX_EXTENTS){
+            if(wb_flush(wb) == -1) return -1;
+        }
+    }
+
+    if(wb->num_extents == 0){
+        wb->base = ALIGN_DOWN(offset);
+    }
+
+    //data too large to ever be staged is written straight through
+    if(end > wb->base + WRITE_BUFFER_SIZE){
+        return pwrite_all(wb->fd, data, len, offset);
+    }
+
+    memcpy(wb->buf + (offset - wb->base), data, len);
+    add_extent(wb, offset, end);
+    return 0;
+}
+
+/* leaves the len bytes at offset in the file as a hole, which reads as
+   zeros. the file starts out empty, so nothing is written; the range must
+   not have been written to. returns 0 */
+int wb_zero(write_buffer* wb, uint64_t offset, uint64_t len){
+    if(offset + len > wb->size) wb->size = offset + len;
+    wb->holes = true;
+    return 0;
+}
+
+/* writes every staged range to the file. returns 0 on success, -1 on error */
+int wb_flush(write_buffer* wb){
+    for(int i=0; i<wb->num_extents; i++){
+        if(write_range(wb, wb->extents[i].start, wb->extents[i].end) == -1){
+            syslog(LOG_ERR, "Error writing file: %s", strerror(errno));
+            return -1;
+        }
+    }
+    wb->num_extents = 0;
+    return 0;
+}
+
+/* flushes the buffer, closes the file, and frees wb.
+   returns 0 on success, -1 on error */
+int wb_close(write_buffer* wb){
+    int ret = wb_flush(wb);
+
+    //a hole at the end of the file is only there once the file is extended over it
+    if(wb->holes && ftruncate(wb->fd, wb->size) == -1){
+        syslog(LOG_ERR, "Error extending file: %s", strerror(errno));
+        ret = -1;
+    }
+
+    if(wb->direct_fd != -1) close(wb->direct_fd);
+    if(close(wb->fd) == -1) ret = -1;
+    free(wb->buf);
+    free(wb);
+
+    return ret;
+}
@@ -0,0 +1,73 @@
+/* DESCRIPTION: A write-coalescing buffer for files being received by hftpd.
+        Payloads are copied into a large aligned staging buffer at the
+        position given by their file offset, and the buffer is written
+        out with a few large pwrite() calls instead of one small write
+        per datagram. Payloads may arrive in any order; each one lands
+        at its own offset, and one a little past the buffer only slides
+        it forward. Optionally, aligned blocks are written with
+        O_DIRECT so bulk ingest bypasses the page cache. Runs of zeros
+        are left as holes, and the file is extended over a trailing
+        one when it is closed.                                       */
+
+#ifndef WRITE_BUFFER_H
+#define WRITE_BUFFER_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define WRITE_BUFFER_SIZE (1024*1024)  //size of the staging buffer
+#define WRITE_BUFFER_ALIGN 4096        //alignment required by O_DIRECT
+#define WRITE_BUFFER_MAX_EXTENTS 64    //max disjoint ranges held before a flush
+
+//a filled range [start, end) of the file, held in the staging buffer
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+} wb_extent;
+
+typedef struct
+{
+    int fd;                     //descriptor used for unaligned writes
+    int direct_fd;              //O_DIRECT descriptor, -1 if not in use
+    uint8_t* buf;               //aligned staging buffer
+    uint64_t base;              //file offset of buf[0]
+    wb_extent extents[WRITE_BUFFER_MAX_EXTENTS]; //filled ranges, sorted by start
+    int num_extents;            //number of filled ranges in extents
+    uint64_t size;              //end of the furthest range written or left as a hole
+    bool holes;                 //a range was left as a hole
+} write_buffer;
+
+/* creates (or truncates) the file at path and returns a write buffer for it.
+   if direct is set, aligned blocks are written with O_DIRECT.
+   returns NULL if the file could not be opened */
+write_buffer* wb_open(const char* path, bool direct);
+
+/* places len bytes of data at offset in the file. data is staged in the
+   buffer and only written once the buffer is flushed.
+   returns 0 on success, -1 on a write error */
+int wb_write(write_buffer* wb, uint64_t offset, const uint8_t* data, size_t len);
+
+/* leaves the len bytes at offset in the file as a hole, which reads as
+   zeros. the file starts out empty, so nothing is written; the range must
+   not have been written to. returns 0 */
+int wb_zero(write_buffer* wb, uint64_t offset, uint64_t len);
+
+/* writes every staged range to the file. returns 0 on success, -1 on error */
+int wb_flush(write_buffer* wb);
+
+/* flushes the buffer, closes the file, and frees wb.
+   returns 0 on success, -1 on error */
+int wb_close(write_buffer* wb);
+
+#endif //WRITE_BUFFER_H
@@ -101,6 +101,15 @@ void handle_connection(int connectionfd, char* hostname){
 
 }
 
+/*  the body of each connection's thread: handles the connection of arg,
+    a connection_arg, and frees it */
+void* connection_thread(void* arg){
+    connection_arg* conn = (connection_arg*)arg;
+    handle_connection(conn->connectionfd, conn->hostname);
+    free(conn);
+    return NULL;
+}
+
 /*  reads the type of request, and handles request accordingly */
 char* handle_request(int connectionfd, char* request, char* hostname, char* username){
 
@@ -117,30 +126,43 @@ char* handle_request(int connectionfd, char* request, char* hostname, char* user
     //AUTH request handling
     if(strcmp(type, "AUTH")==0){
         username = handle_auth(connectionfd, con, request, i);
-        return username;
 
     //LIST request handling
     }else if(strcmp(type, "LIST")==0){
         handle_list(connectionfd, con, username, request, i);
-        return username;
+
+    //TREE request handling
+    }else if(strcmp(type, "TREE")==0){
+        handle_tree(connectionfd, con, username, request, i);
+
+    //FILES request handling
+    }else if(strcmp(type, "FILES")==0){
+        handle_files(connectionfd, con, username, request, i);
+
+    }else{
+        username = "";
     }
 
-    return "";
+    //a client may send many requests, so each one's connection is closed
+    hdb_disconnect(con);
+    return username;
 
 }
 
 /*  handles the AUTH request:
     reads the username and password from the request,
     attempts to authenticate user in the Redis server,
-    respondes to request according to authentication status
-    returns the username*/
+    respondes to request according to authentication status.
+    a token the client kept is given back while it is still the user's
+    returns the username, or "" if the user was not authenticated */
 char* handle_auth(int connectionfd, hdb_connection* con, char* request, int i){
-    char* username;
-    char* password;
+    char* username = "";
+    char* password = "";
+    char* kept = NULL;
     char* key;
     char* value;
 
-    //get the username and password
+    //get the username, password and the token the client kept, if any
     while(request[i] != '\n'){
         key = readuntil(request, ':', &i);
         value = readuntil(request, '\n', &i);
@@ -152,10 +174,19 @@ char* handle_auth(int connectionfd, hdb_connection* con, char* request, int i){
         if(strcmp(key, "Password")==0){
             password = value;
         }
+        if(strcmp(key, "Token")==0){
+            kept = value;
+        }
     }
 
-    //authenticate user and get token
-    char* token = hdb_authenticate(con, username, password);
+    //authenticate user and get token. a token the client kept is given
+    //back while it is still the user's, rather than another being made
+    char* token;
+    if(kept != NULL){
+        token = hdb_authenticate_kept(con, username, password, kept);
+    }else{
+        token = hdb_authenticate(con, username, password);
+    }
     syslog(LOG_DEBUG, "%s's token is %s", username, token);
 
     //generate response
@@ -174,18 +205,47 @@ char* handle_auth(int connectionfd, hdb_connection* con, char* request, int i){
         syslog(LOG_WARNING, "Unable to send data to client");
     }
 
-    return username;
+    //the requests which follow on the connection are made as the user only
+    //if they were authenticated
+    return token != NULL ? username : "";
+}
+
+/*  returns the user a request with token is made as, or NULL if it is not
+    authorized. a request without a token is made as username, the user
+    authenticated earlier on its connection, so an AUTH and the request
+    after it can be sent in the same flight. one with a token must be made
+    as the user it was given to */
+char* request_user(hdb_connection* con, char* username, char* token){
+    if(strcmp(token, "")==0){
+        return strcmp(username, "")!=0 ? username : NULL;
+    }
+
+    char* token_user = hdb_verify_token(con, token);
+    if(token_user == NULL || (strcmp(username, "")!=0 && strcmp(username, token_user)!=0)){
+        return NULL;
+    }
+    return token_user;
+}
+
+/*  reads and drops a request body of length bytes which will not be
+    handled, so the next request on the connection is read from its start */
+void skip_body(int connectionfd, int length){
+    if(length > 0){
+        free(recv_message_len(connectionfd, length));
+    }
 }
 
 /*  handles the LIST request:
     gets the token and body length from the request
     verifies the token
     if valid, gets the body of the request
-    creates a list of files which are new/updated
+    creates a list of files which are new/updated, joining a list
+    sent in order of name against the user's index of files
     sends that list to the client */
 void handle_list(int connectionfd, hdb_connection* con, char* username, char* request, int i){
     char* token = "";
     int list_length = 0;
+    bool sorted = false;
     char* token_user;
     char* key;
     char* value;
@@ -201,35 +261,51 @@ void handle_list(int connectionfd, hdb_connection* con, char* username, char* re
         if(strcmp(key, "Length")==0){
             list_length = atoi(value);
         }
+        if(strcmp(key, "Sorted")==0){
+            sorted = atoi(value) != 0;
+        }
     }
 
     //verify token
-    token_user = hdb_verify_token(con, token);
+    token_user = request_user(con, username, token);
 
     //generate response//
     char* response;
     int response_size;
-    if(token_user!=NULL && strcmp(username, token_user)==0){
+    if(token_user!=NULL){
         //token is valid. Get the list of changed/new files
+        username = token_user;
         syslog(LOG_INFO, "Receiving file list");
         char* list = recv_message_len(connectionfd, list_length);
         syslog(LOG_DEBUG, "List received:\n%s", list);
-        char* req_list = get_new_file_list(con, username, list);
+        char* req_list;
+        if(sorted){
+            //a tree too large for the client's memory is listed a sorted
+            //chunk at a time, so only the same range of the stored files is read
+            hdb_build_index(con, username);
+            req_list = get_sorted_file_list(con, username, list);
+        }else{
+            req_list = get_new_file_list(con, username, list);
+        }
 
         //compose response
         if(strcmp(req_list,"")!=0){
             syslog(LOG_INFO, "Requesting file(s)");
             syslog(LOG_DEBUG, "The following file(s) are being requested:\n%s", req_list);
-            asprintf(&response, "302 Files requested\nLength:%d\n\n%s", strlen(req_list), req_list);
+            response_size = asprintf(&response, "302 Files requested\nLength:%d\n\n%s", (int)strlen(req_list), req_list);
         }else{
             syslog(LOG_INFO, "No file requests. All files are up to date");
-            asprintf(&response, "204 No files requested\n\n");
+            response_size = asprintf(&response, "204 No files requested\n\n");
         }
 
+        //a sync in sorted chunks may send many lists on one connection
+        free(list);
+        free(req_list);
 
     }else{
         //token is invalid
         syslog(LOG_INFO, "Unauthorized: bad token");
+        skip_body(connectionfd, list_length);
         response_size = asprintf(&response, "401 Unauthorized\n\n");
     }
 
@@ -240,42 +316,283 @@ void handle_list(int connectionfd, hdb_connection* con, char* username, char* re
 
 }
 
-/*  gets the list of files which are new or have been updated */
-char* get_new_file_list(hdb_connection* con, char* username, char* list){
-    char* req_list = "";
-    char* filename;
-    char* checksum;
-    char* hdb_checksum;
-    int i = 0;
-    char c = 1;
-
-    //loop until the end of list
-    while(c){
-        //get the filename and checksum
-        filename = readuntil(list, '\n', &i);
-        checksum = readuntil(list, '\n', &i);
-
-        if(hdb_file_exists(con, username, filename)){
-            //file exists, compare checksums
-            hdb_checksum = hdb_file_checksum(con, username, filename);
-            if(strcmp(checksum, hdb_checksum)!=0){
-                //checksums are different, add file to request list
-                asprintf(&req_list, "%s%s\n", req_list, filename);
-            }
+/*  handles the TREE request:
+    gets the token and body length from the request
+    verifies the token
+    if valid, gets the body of the request
+    creates a list of the directories whose sums differ from the stored ones
+    sends that list to the client */
+void handle_tree(int connectionfd, hdb_connection* con, char* username, char* request, int i){
+    char* token = "";
+    int list_length = 0;
+    char* token_user;
+    char* key;
+    char* value;
+
+    //get the token and list length
+    while(request[i] != '\n'){
+        key = readuntil(request, ':', &i);
+        value = readuntil(request, '\n', &i);
+
+        if(strcmp(key, "Token")==0){
+            token = value;
+        }
+        if(strcmp(key, "Length")==0){
+            list_length = atoi(value);
+        }
+    }
+
+    //verify token
+    token_user = request_user(con, username, token);
+
+    //generate response
+    char* response;
+    int response_size;
+    if(token_user!=NULL){
+        //token is valid. compare the directories with the stored ones
+        username = token_user;
+        char* list = recv_message_len(connectionfd, list_length);
+        syslog(LOG_DEBUG, "Directory sums received:\n%s", list);
+        hdb_build_tree(con, username);
+        char* changed = get_changed_dirs(con, username, list);
+        free(list);
+
+        //compose response
+        if(strcmp(changed, "")!=0){
+            syslog(LOG_DEBUG, "The following directories differ:\n%s", changed);
+            response_size = asprintf(&response, "200 Directories differ\nLength:%d\n\n%s", (int)strlen(changed), changed);
         }else{
-            //file does not exist. add to request list
-            asprintf(&req_list, "%s%s\n", req_list, filename);
+            syslog(LOG_INFO, "All directories are up to date");
+            response_size = asprintf(&response, "204 No directories differ\n\n");
         }
+        free(changed);
 
-        free(filename);
-        free(checksum);
-        c = list[i];
+    }else{
+        //token is invalid
+        syslog(LOG_INFO, "Unauthorized: bad token");
+        skip_body(connectionfd, list_length);
+        response_size = asprintf(&response, "401 Unauthorized\n\n");
     }
 
-    //remove the last blank line in req_list (the last char is currently '\n')
-    req_list[strlen(req_list)] = '\0';
+    //send response
+    if (send(connectionfd, response, response_size, 0) == -1){
+        syslog(LOG_WARNING, "Unable to send data to client");
+    }
+    free(response);
+
+}
+
+/*  handles the FILES request:
+    gets the token from the request
+    verifies the token
+    if valid, sends the client every file stored for the user
+    along with its checksum, so the files can be restored */
+void handle_files(int connectionfd, hdb_connection* con, char* username, char* request, int i){
+    char* token = "";
+    char* token_user;
+    char* key;
+    char* value;
+
+    //get the token
+    while(request[i] != '\n'){
+        key = readuntil(request, ':', &i);
+        value = readuntil(request, '\n', &i);
+
+        if(strcmp(key, "Token")==0){
+            token = value;
+        }
+    }
+
+    //verify token
+    token_user = request_user(con, username, token);
+
+    //generate response
+    char* response;
+    int response_size;
+    if(token_user!=NULL){
+        //token is valid. list the user's files
+        username = token_user;
+        char* list = "";
+        hdb_record* files = hdb_user_files(con, username);
+        for(hdb_record* current = files; current != NULL; current = current->next){
+            asprintf(&list, "%s%s\n%s\n", list, current->filename, current->checksum);
+        }
+        if(files != NULL){
+            hdb_free_result(files);
+        }
+
+        if(strcmp(list, "")!=0){
+            syslog(LOG_INFO, "Sending stored file list");
+            response_size = asprintf(&response, "200 Files\nLength:%d\n\n%s", (int)strlen(list), list);
+        }else{
+            syslog(LOG_INFO, "No files stored");
+            response_size = asprintf(&response, "204 No files stored\n\n");
+        }
+
+    }else{
+        //token is invalid
+        syslog(LOG_INFO, "Unauthorized: bad token");
+        response_size = asprintf(&response, "401 Unauthorized\n\n");
+    }
+
+    //send response
+    if (send(connectionfd, response, response_size, 0) == -1){
+        syslog(LOG_WARNING, "Unable to send data to client");
+    }
+
+}
+
+/*  splits list where it lies into filename and checksum pairs, returning
+    an array of them, a filename followed by its checksum. count is set to
+    the number of pairs, and req_size to the size of a list of every
+    filename, each ending with a '\n', and its '\0' */
+static char** split_pairs(char* list, int* count, size_t* req_size){
+    //the last line has no '\n'
+    int size = 256;
+    char** pairs = (char**)malloc(2*size*sizeof(char*));
+    *count = 0;
+    *req_size = 1;
+    char* start = list;
+    char* end;
+    while(*start != '\0' && (end = strchr(start, '\n')) != NULL){
+        *end = '\0';
+        char* checksum = end + 1;
+        end = checksum + strcspn(checksum, "\n");
+        bool last = *end == '\0';
+        *end = '\0';
+
+        if(*count == size){
+            size *= 2;
+            pairs = (char**)realloc(pairs, 2*size*sizeof(char*));
+        }
+        pairs[2*(*count)] = start;
+        pairs[2*(*count) + 1] = checksum;
+        *req_size += strlen(start) + 1;
+        (*count)++;
+        if(last) break;
+        start = end + 1;
+    }
+    return pairs;
+}
+
+/*  gets the list of files which are new or have been updated. the stored
+    checksums of every listed file are fetched together, a batch of files
+    to each pipelined HMGET, rather than with round trips for each file */
+char* get_new_file_list(hdb_connection* con, char* username, char* list){
+    int count;
+    size_t req_size;
+    char** pairs = split_pairs(list, &count, &req_size);
+
+    char** filenames = (char**)malloc((count ? count : 1)*sizeof(char*));
+    for(int k=0; k<count; k++){
+        filenames[k] = pairs[2*k];
+    }
+    char** stored = hdb_file_checksums(con, username, filenames, count);
+
+    //a file is requested unless one of its name and checksum is stored. every
+    //filename in req_list ends with a '\n', which the client reads up to
+    char* req_list = (char*)malloc(req_size);
+    size_t req_length = 0;
+    for(int k=0; k<count; k++){
+        if(stored[k] == NULL || strcmp(stored[k], pairs[2*k + 1]) != 0){
+            req_length += sprintf(req_list + req_length, "%s\n", pairs[2*k]);
+        }
+    }
+    req_list[req_length] = '\0';
+
+    hdb_free_checksums(stored, count);
+    free(filenames);
+    free(pairs);
+    return req_list;
+}
+
+/*  orders pairs of a filename and its checksum by filename */
+static int compare_pairs(const void* a, const void* b){
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*  gets the list of files which are new or have been updated from a list
+    of files in order of name, by walking the user's stored files over the
+    same range in the same order */
+char* get_sorted_file_list(hdb_connection* con, char* username, char* list){
+    int count;
+    size_t req_size;
+    char** pairs = split_pairs(list, &count, &req_size);
+
+    //the client sends the list in order, but sorting it again costs little
+    //and makes the join safe from one that does not
+    qsort(pairs, count, 2*sizeof(char*), compare_pairs);
+
+    //walk the stored files from the first listed, each listed file being
+    //requested unless the next stored one has its name and checksum
+    char* req_list = (char*)malloc(req_size);
+    size_t req_length = 0;
+    if(count > 0){
+        hdb_cursor* cursor = hdb_files_from(con, username, pairs[0]);
+        char* stored_name;
+        char* stored_checksum;
+        bool more = hdb_cursor_next(cursor, &stored_name, &stored_checksum);
+        for(int k=0; k<count; k++){
+            char* filename = pairs[2*k];
+            while(more && strcmp(stored_name, filename) < 0){
+                more = hdb_cursor_next(cursor, &stored_name, &stored_checksum);
+            }
+            if(!more || strcmp(stored_name, filename) != 0 || strcmp(stored_checksum, pairs[2*k + 1]) != 0){
+                req_length += sprintf(req_list + req_length, "%s\n", filename);
+            }
+        }
+        hdb_cursor_free(cursor);
+    }
+    req_list[req_length] = '\0';
+
+    free(pairs);
     return req_list;
+}
+
+/*  gets the list of directories in list whose sums differ from the stored ones.
+    list holds a directory and its sum in hex on each pair of lines */
+char* get_changed_dirs(hdb_connection* con, char* username, char* list){
+    int count = 0;
+    int size = 64;
+    char** dirs = (char**)malloc(size*sizeof(char*));
+    uint64_t* sums = (uint64_t*)malloc(size*sizeof(uint64_t));
+    size_t changed_size = 1;
+    int i = 0;
 
+    //get every directory and its sum
+    while(list[i]){
+        if(count == size){
+            size *= 2;
+            dirs = (char**)realloc(dirs, size*sizeof(char*));
+            sums = (uint64_t*)realloc(sums, size*sizeof(uint64_t));
+        }
+        char* dir = readuntil(list, '\n', &i);
+        char* sum = readuntil(list, '\n', &i);
+        if(dir[0] == '\0' || sum[0] == '\0') break;
+        dirs[count] = dir;
+        sums[count] = strtoull(sum, NULL, 16);
+        changed_size += strlen(dirs[count]) + 1;
+        free(sum);
+        count++;
+    }
+
+    //the stored sums are fetched together, and each directory which
+    //differs ends with a '\n', as the client reads up to it
+    int64_t* stored = hdb_dir_sums(con, username, dirs, count);
+    char* changed = (char*)malloc(changed_size);
+    size_t length = 0;
+    for(int j=0; j<count; j++){
+        if((uint64_t)stored[j] != sums[j]){
+            length += sprintf(changed + length, "%s\n", dirs[j]);
+        }
+        free(dirs[j]);
+    }
+    changed[length] = '\0';
+
+    free(stored);
+    free(sums);
+    free(dirs);
+    return changed;
 }
 
 /*  this function is called when ctrl+c is pressed,
@@ -360,12 +677,26 @@ int main(int argc, char *argv[]){
     if(listen(sockfd, BACKLOG)==-1) err(EXIT_FAILURE, "%s", "Unable to listen on socket");
     syslog(LOG_INFO, "Server listening on port %s", port);
     //maintain connection
+    //each connection is handled on a thread of its own, so a client which
+    //keeps its connection open across a sync, or across many users' syncs,
+    //does not hold up the others. every request connects to Redis itself
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     while(!terminate){
         connectionfd = wait_for_connection(sockfd);
-        handle_connection(connectionfd, hostname);
+        connection_arg* conn = (connection_arg*)malloc(sizeof(connection_arg));
+        conn->connectionfd = connectionfd;
+        conn->hostname = hostname;
+        pthread_t thread;
+        if(pthread_create(&thread, &attr, connection_thread, conn) != 0){
+            syslog(LOG_ERR, "Could not start a thread for the connection");
+            close(connectionfd);
+            free(conn);
+        }
     }
+    pthread_attr_destroy(&attr);
 
-    close(connectionfd);
     close(sockfd);
 
     //disconnect syslog
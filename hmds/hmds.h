@@ -22,6 +22,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <signal.h>
+#include <pthread.h>
 
 //socket programming
 #include <sys/types.h>
@@ -44,6 +45,13 @@
 
 static bool terminate = false;
 
+//a connection accepted, handed to the thread which handles it
+typedef struct
+{
+    int connectionfd;
+    char* hostname;
+} connection_arg;
+
 #define SOCK_TYPE(s) (s == SOCK_STREAM ? "Stream" : s == SOCK_DGRAM ? "Datagram" : \
                       s == SOCK_RAW ? "Raw" : "Other")
 
@@ -58,26 +66,70 @@ int wait_for_connection(int sockfd);
 /*  waits for incomming messages, receives the message, and respondes accordingly*/
 void handle_connection(int connectionfd, char* hostname);
 
+/*  the body of each connection's thread: handles the connection of arg,
+    a connection_arg, and frees it */
+void* connection_thread(void* arg);
+
 /*  reads the type of request, and handles request accordingly */
 char* handle_request(int connectionfd, char* request, char* hostname, char* retval);
 
 /*  handles the AUTH request
 	reads the username and password from the request, 
     attempts to authenticate user in the Redis server,
-    respondes to request according to authentication status */
+    respondes to request according to authentication status.
+    a token the client kept is given back while it is still the user's
+    returns the username, or "" if the user was not authenticated */
 char* handle_auth(int connectionfd, hdb_connection* con, char* request, int i);
 
+/*  returns the user a request with token is made as, or NULL if it is not
+    authorized. a request without a token is made as username, the user
+    authenticated earlier on its connection, so an AUTH and the request
+    after it can be sent in the same flight. one with a token must be made
+    as the user it was given to */
+char* request_user(hdb_connection* con, char* username, char* token);
+
+/*  reads and drops a request body of length bytes which will not be
+    handled, so the next request on the connection is read from its start */
+void skip_body(int connectionfd, int length);
+
 /*  handles the LIST request:
     gets the token and body length from the request
     verifies the token
     if valid, gets the body of the request
-    creates a list of files which are new/updated
+    creates a list of files which are new/updated, joining a list
+    sent in order of name against the user's index of files
     sends that list to the client */ 
 void handle_list(int connectionfd, hdb_connection* con, char* username, char* request, int i);
 
-/*  gets the list of files which are new or have been updated */
+/*  handles the TREE request:
+    gets the token and body length from the request
+    verifies the token
+    if valid, gets the body of the request
+    creates a list of the directories whose sums differ from the stored ones
+    sends that list to the client */
+void handle_tree(int connectionfd, hdb_connection* con, char* username, char* request, int i);
+
+/*  handles the FILES request:
+    gets the token from the request
+    verifies the token
+    if valid, sends the client every file stored for the user
+    along with its checksum, so the files can be restored */
+void handle_files(int connectionfd, hdb_connection* con, char* username, char* request, int i);
+
+/*  gets the list of files which are new or have been updated. the stored
+    checksums of every listed file are fetched together, a batch of files
+    to each pipelined HMGET, rather than with round trips for each file */
 char* get_new_file_list(hdb_connection* con, char* username, char* list);
 
+/*  gets the list of files which are new or have been updated from a list
+    of files in order of name, by walking the user's stored files over the
+    same range in the same order */
+char* get_sorted_file_list(hdb_connection* con, char* username, char* list);
+
+/*  gets the list of directories in list whose sums differ from the stored ones.
+    list holds a directory and its sum in hex on each pair of lines */
+char* get_changed_dirs(hdb_connection* con, char* username, char* list);
+
 /*  this function is called when ctrl+c is pressed,
     it sets a flag which helps ths hmds clean up before terminating */
 void termination_handler(int signal);